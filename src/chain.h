@@ -409,4 +409,59 @@ public:
     const CBlockIndex *FindFork(const CBlockIndex *pindex) const;
 };
 
+/**
+ * An immutable view of a chain as it was when the snapshot was taken. Only
+ * the tip is recorded and other heights are reached through the skip list,
+ * so taking a snapshot costs nothing. Block index entries are never freed,
+ * and the fields used here (nHeight, pprev, pskip, phashBlock) do not change
+ * once an entry is in the index, so a snapshot of chainActive may be used
+ * without holding cs_main.
+ */
+class CChainSnapshot {
+private:
+    const CBlockIndex *pindexTip;
+
+public:
+    explicit CChainSnapshot(const CBlockIndex *pindexTipIn = NULL) : pindexTip(pindexTipIn) {}
+
+    /** Returns the index entry for the tip of this chain, or NULL if none. */
+    const CBlockIndex *Tip() const {
+        return pindexTip;
+    }
+
+    /** Returns the index entry at a particular height in this chain, or NULL if no such height exists. */
+    const CBlockIndex *operator[](int nHeight) const {
+        if (pindexTip == NULL || nHeight < 0 || nHeight > pindexTip->nHeight)
+            return NULL;
+        return pindexTip->GetAncestor(nHeight);
+    }
+
+    /** Check whether a block is present in this chain. O(log n), unlike CChain::Contains. */
+    bool Contains(const CBlockIndex *pindex) const {
+        return (*this)[pindex->nHeight] == pindex;
+    }
+
+    /** Find the successor of a block in this chain, or NULL if the given index is not found or is the tip. */
+    const CBlockIndex *Next(const CBlockIndex *pindex) const {
+        if (Contains(pindex))
+            return (*this)[pindex->nHeight + 1];
+        else
+            return NULL;
+    }
+
+    /** Return the maximal height in the chain, or -1 if it is empty. */
+    int Height() const {
+        return pindexTip ? pindexTip->nHeight : -1;
+    }
+
+    /** Find the last common block between this chain and a block index entry. */
+    const CBlockIndex *FindFork(const CBlockIndex *pindex) const {
+        if (pindex->nHeight > Height())
+            pindex = pindex->GetAncestor(Height());
+        while (pindex && !Contains(pindex))
+            pindex = pindex->pprev;
+        return pindex;
+    }
+};
+
 #endif // BITCOIN_CHAIN_H
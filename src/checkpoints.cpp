@@ -36,7 +36,7 @@ namespace Checkpoints {
     }
 
     // Guess how far we are in the verification process at the given block index
-    double GuessVerificationProgress(CBlockIndex *pindex, bool fSigchecks) {
+    double GuessVerificationProgress(const CBlockIndex *pindex, bool fSigchecks) {
         if (pindex==NULL)
             return 0.0;
 
@@ -17,6 +17,7 @@
 #include "main.h"
 #include "miner.h"
 #include "net.h"
+#include "publisher.h"
 #include "rpcserver.h"
 #include "script/standard.h"
 #include "txdb.h"
@@ -50,6 +51,7 @@ using namespace std;
 CWallet* pwalletMain = NULL;
 #endif
 bool fFeeEstimatesInitialized = false;
+static CPublisher* pPublisher = NULL;
 
 #ifdef WIN32
 // Win32 LevelDB doesn't use filedescriptors, and the ones used for
@@ -129,6 +131,8 @@ void Shutdown()
     RenameThread("bitcoin-shutoff");
     mempool.AddTransactionsUpdated(1);
     StopRPCThreads();
+    // The notification thread has been stopped; hand the wallet whatever it left behind
+    FlushValidationNotifications();
 #ifdef ENABLE_WALLET
     if (pwalletMain)
         bitdb.Flush(false);
@@ -177,6 +181,8 @@ void Shutdown()
     delete pwalletMain;
     pwalletMain = NULL;
 #endif
+    delete pPublisher;
+    pPublisher = NULL;
     LogPrintf("%s: done\n", __func__);
 }
 
@@ -222,6 +228,7 @@ std::string HelpMessage(HelpMessageMode mode)
     // When adding new options to the categories, please keep and ensure alphabetical ordering.
     string strUsage = _("Options:") + "\n";
     strUsage += "  -?                     " + _("This help message") + "\n";
+    strUsage += "  -addressindex          " + strprintf(_("Maintain an index of the outputs and spends of every script, used by the getaddresshistory rpc call (default: %u)"), 0) + "\n";
     strUsage += "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)") + "\n";
     strUsage += "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n";
     strUsage += "  -checkblocks=<n>       " + strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), 288) + "\n";
@@ -242,26 +249,34 @@ std::string HelpMessage(HelpMessageMode mode)
 #ifndef WIN32
     strUsage += "  -pid=<file>            " + strprintf(_("Specify pid file (default: %s)"), "bitcoind.pid") + "\n";
 #endif
+    strUsage += "  -pubhashblock=<addr>   " + _("Publish hashes of connected blocks on <addr> (<host>:<port> or unix:<path>)") + "\n";
+    strUsage += "  -pubhashtx=<addr>      " + _("Publish hashes of transactions accepted into the memory pool on <addr>") + "\n";
+    strUsage += "  -pubrawblock=<addr>    " + _("Publish connected blocks on <addr>") + "\n";
+    strUsage += "  -pubrawtx=<addr>       " + _("Publish transactions accepted into the memory pool on <addr>") + "\n";
     strUsage += "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + " " + _("on startup") + "\n";
+    strUsage += "  -reindex-chainstate    " + _("Rebuild only the chain state, by reconnecting the blocks already in the block index") + " " + _("on startup") + "\n";
 #if !defined(WIN32)
     strUsage += "  -sysperms              " + _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)") + "\n";
 #endif
-    strUsage += "  -txindex               " + strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call (default: %u)"), 0) + "\n";
+    strUsage += "  -txindex               " + strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call; when turned on for an existing database it is built in the background (default: %u)"), 0) + "\n";
 
     strUsage += "\n" + _("Connection options:") + "\n";
     strUsage += "  -addnode=<ip>          " + _("Add a node to connect to and attempt to keep the connection open") + "\n";
     strUsage += "  -banscore=<n>          " + strprintf(_("Threshold for disconnecting misbehaving peers (default: %u)"), 100) + "\n";
     strUsage += "  -bantime=<n>           " + strprintf(_("Number of seconds to keep misbehaving peers from reconnecting (default: %u)"), 86400) + "\n";
+    strUsage += "  -blocksonly            " + strprintf(_("Do not accept or relay transactions from peers, only blocks (default: %u)"), DEFAULT_BLOCKSONLY) + "\n";
     strUsage += "  -bind=<addr>           " + _("Bind to given address and always listen on it. Use [host]:port notation for IPv6") + "\n";
     strUsage += "  -connect=<ip>          " + _("Connect only to the specified node(s)") + "\n";
     strUsage += "  -discover              " + _("Discover own IP address (default: 1 when listening and no -externalip)") + "\n";
     strUsage += "  -dns                   " + _("Allow DNS lookups for -addnode, -seednode and -connect") + " " + _("(default: 1)") + "\n";
     strUsage += "  -dnsseed               " + _("Query for peer addresses via DNS lookup, if low on addresses (default: 1 unless -connect)") + "\n";
     strUsage += "  -externalip=<ip>       " + _("Specify your own public address") + "\n";
+    strUsage += "  -feefilter             " + strprintf(_("Tell other nodes to filter invs to us by our mempool min fee (default: %u)"), DEFAULT_FEEFILTER) + "\n";
     strUsage += "  -forcednsseed          " + strprintf(_("Always query for peer addresses via DNS lookup (default: %u)"), 0) + "\n";
     strUsage += "  -listen                " + _("Accept connections from outside (default: 1 if no -proxy or -connect)") + "\n";
     strUsage += "  -maxconnections=<n>    " + strprintf(_("Maintain at most <n> connections to peers (default: %u)"), 125) + "\n";
     strUsage += "  -maxreceivebuffer=<n>  " + strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), 5000) + "\n";
+    strUsage += "  -maxuploadtarget=<n>   " + strprintf(_("Tries to keep outbound traffic under the given target (in MiB per 24h), 0 = no limit (default: %d)"), DEFAULT_MAX_UPLOAD_TARGET) + "\n";
     strUsage += "  -maxsendbuffer=<n>     " + strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), 1000) + "\n";
     strUsage += "  -onion=<ip:port>       " + strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy") + "\n";
     strUsage += "  -onlynet=<net>         " + _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)") + "\n";
@@ -295,6 +310,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -txconfirmtarget=<n>   " + strprintf(_("If paytxfee is not set, include enough fee so transactions are confirmed on average within n blocks (default: %u)"), 1) + "\n";
     strUsage += "  -upgradewallet         " + _("Upgrade wallet to latest format") + " " + _("on startup") + "\n";
     strUsage += "  -wallet=<file>         " + _("Specify wallet file (within data directory)") + " " + strprintf(_("(default: %s)"), "wallet.dat") + "\n";
+    strUsage += "  -walletdeferkeycheck   " + strprintf(_("Check private keys stored without a checksum in the background after loading the wallet (default: %u)"), 0) + "\n";
     strUsage += "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n";
     strUsage += "  -zapwallettxes=<mode>  " + _("Delete all wallet transactions and only recover those parts of the blockchain through -rescan on startup") + "\n";
     strUsage += "                         " + _("(1 = keep tx meta data e.g. account owner and payment request information, 2 = drop tx meta data)") + "\n";
@@ -362,7 +378,9 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -rpcpassword=<pw>      " + _("Password for JSON-RPC connections") + "\n";
     strUsage += "  -rpcport=<port>        " + strprintf(_("Listen for JSON-RPC connections on <port> (default: %u or testnet: %u)"), 8332, 18332) + "\n";
     strUsage += "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified source. Valid for <ip> are a single IP (e.g. 1.2.3.4), a network/netmask (e.g. 1.2.3.4/255.255.255.0) or a network/CIDR (e.g. 1.2.3.4/24). This option can be specified multiple times") + "\n";
-    strUsage += "  -rpcthreads=<n>        " + strprintf(_("Set the number of threads to service RPC calls (default: %d)"), 4) + "\n";
+    strUsage += "  -rpcthreads=<n>        " + strprintf(_("Set the number of threads to service RPC calls (default: %d)"), DEFAULT_RPC_THREADS) + "\n";
+    strUsage += "  -rpcworkqueue=<n>      " + strprintf(_("Set the depth of the work queue to service RPC calls (default: %d)"), DEFAULT_RPC_WORKQUEUE) + "\n";
+    strUsage += "  -rpcservertimeout=<n>  " + strprintf(_("Timeout in seconds for idle keep-alive RPC connections (default: %d)"), DEFAULT_RPC_SERVER_TIMEOUT) + "\n";
 
     strUsage += "\n" + _("RPC SSL options: (see the Bitcoin Wiki for SSL setup instructions)") + "\n";
     strUsage += "  -rpcssl                                  " + _("Use OpenSSL (https) for JSON-RPC connections") + "\n";
@@ -413,18 +431,11 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     // -reindex
     if (fReindex) {
         CImportingNow imp;
-        int nFile = 0;
-        while (true) {
-            CDiskBlockPos pos(nFile, 0);
-            if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
-                break; // No block files left to reindex
-            FILE *file = OpenBlockFile(pos, true);
-            if (!file)
-                break; // This error is logged in OpenBlockFile
-            LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
-            LoadExternalBlockFile(file, &pos);
-            nFile++;
-        }
+        // The files are opened as the import reaches them, and read ahead across
+        std::vector<CImportFile> vFiles;
+        for (int nFile = 0; boost::filesystem::exists(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk")); nFile++)
+            vFiles.push_back(CImportFile(NULL, nFile));
+        LoadExternalBlockFiles(vFiles);
         pblocktree->WriteReindexing(false);
         fReindex = false;
         LogPrintf("Reindexing finished\n");
@@ -432,6 +443,22 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
         InitBlockIndex();
     }
 
+    // -reindex-chainstate: the block index is kept, only the UTXO set is rebuilt by
+    // connecting the stored blocks again, in chain order
+    if (fReindexChainState) {
+        CImportingNow imp;
+        LogPrintf("Rebuilding chain state from stored blocks...\n");
+        int64_t nStart = GetTimeMillis();
+        CValidationState state;
+        if (ActivateBestChain(state)) {
+            pblocktree->WriteFlag("reindexchainstate", false);
+            fReindexChainState = false;
+            LogPrintf("Rebuilding chain state finished in %dms\n", GetTimeMillis() - nStart);
+        } else {
+            LogPrintf("Warning: Rebuilding chain state failed: %s\n", state.GetRejectReason());
+        }
+    }
+
     // hardcoded $DATADIR/bootstrap.dat
     filesystem::path pathBootstrap = GetDataDir() / "bootstrap.dat";
     if (filesystem::exists(pathBootstrap)) {
@@ -448,16 +475,20 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     }
 
     // -loadblock=
+    std::vector<CImportFile> vFiles;
     BOOST_FOREACH(boost::filesystem::path &path, vImportFiles) {
         FILE *file = fopen(path.string().c_str(), "rb");
         if (file) {
-            CImportingNow imp;
             LogPrintf("Importing blocks file %s...\n", path.string());
-            LoadExternalBlockFile(file);
+            vFiles.push_back(CImportFile(file, -1));
         } else {
             LogPrintf("Warning: Could not open blocks file %s\n", path.string());
         }
     }
+    if (!vFiles.empty()) {
+        CImportingNow imp;
+        LoadExternalBlockFiles(vFiles);
+    }
 
     if (GetBoolArg("-stopafterblockimport", false)) {
         LogPrintf("Stopping after block import\n");
@@ -878,6 +909,9 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     // see Step 2: parameter interactions for more information about these
     fListen = GetBoolArg("-listen", DEFAULT_LISTEN);
+    fRelayTxes = !GetBoolArg("-blocksonly", DEFAULT_BLOCKSONLY);
+    if (mapArgs.count("-maxuploadtarget"))
+        CNode::SetMaxOutboundTarget(GetArg("-maxuploadtarget", DEFAULT_MAX_UPLOAD_TARGET) * 1024 * 1024);
     fDiscover = GetBoolArg("-discover", true);
     fNameLookup = GetBoolArg("-dns", true);
 
@@ -951,6 +985,7 @@ bool AppInit2(boost::thread_group& threadGroup)
             fReindex = true;
         }
     }
+    fReindexChainState = !fReindex && GetBoolArg("-reindex-chainstate", false);
 
     // cache size calculations
     size_t nTotalCache = (GetArg("-dbcache", nDefaultDbCache) << 20);
@@ -959,10 +994,12 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nTotalCache > (nMaxDbCache << 20))
         nTotalCache = (nMaxDbCache << 20); // total cache cannot be greater than nMaxDbCache
     size_t nBlockTreeDBCache = nTotalCache / 8;
-    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false))
+    if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false) && !GetBoolArg("-addressindex", false))
         nBlockTreeDBCache = (1 << 21); // block tree db cache shouldn't be larger than 2 MiB
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
+    if (fReindexChainState)
+        nCoinDBCache = nTotalCache / 8; // a chain state being rebuilt is mostly written, not read: keep the coins in memory instead
     nTotalCache -= nCoinDBCache;
     nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
 
@@ -982,11 +1019,13 @@ bool AppInit2(boost::thread_group& threadGroup)
                 delete pblocktree;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
-                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
+                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex || fReindexChainState);
                 pcoinsTip = new CCoinsViewCache(pcoinsdbview);
 
                 if (fReindex)
                     pblocktree->WriteReindexing(true);
+                else if (fReindexChainState)
+                    pblocktree->WriteFlag("reindexchainstate", true);
 
                 if (!LoadBlockIndex()) {
                     strLoadError = _("Error loading block database");
@@ -1004,9 +1043,15 @@ bool AppInit2(boost::thread_group& threadGroup)
                     break;
                 }
 
-                // Check for changed -txindex state
-                if (fTxIndex != GetBoolArg("-txindex", false)) {
-                    strLoadError = _("You need to rebuild the database using -reindex to change -txindex");
+                // Apply a changed -txindex state; a newly enabled index is built in the background
+                if (!SetTxIndex(GetBoolArg("-txindex", false))) {
+                    strLoadError = _("Error changing -txindex state");
+                    break;
+                }
+
+                // Check for changed -addressindex state
+                if (fAddressIndex != GetBoolArg("-addressindex", false)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -addressindex");
                     break;
                 }
 
@@ -1194,7 +1239,8 @@ bool AppInit2(boost::thread_group& threadGroup)
             uiInterface.InitMessage(_("Rescanning..."));
             LogPrintf("Rescanning last %i blocks (from block %i)...\n", chainActive.Height() - pindexRescan->nHeight, pindexRescan->nHeight);
             nStart = GetTimeMillis();
-            pwalletMain->ScanForWalletTransactions(pindexRescan, true);
+            if (pwalletMain->ScanForWalletTransactions(pindexRescan, true) < 0)
+                return InitError(_("Error reading a block from disk during the wallet rescan; you need to rebuild the database using -reindex"));
             LogPrintf(" rescan      %15dms\n", GetTimeMillis() - nStart);
             pwalletMain->SetBestChain(chainActive.GetLocator());
             nWalletDBUpdated++;
@@ -1231,9 +1277,29 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (mapArgs.count("-blocknotify"))
         uiInterface.NotifyBlockTip.connect(BlockNotifyCallback);
 
+    // Publish connected blocks and new transactions to local subscribers
+    for (int i = 0; i < PUB_TOPIC_COUNT; i++) {
+        PublishTopic topic = (PublishTopic)i;
+        std::string strArg = std::string("-pub") + GetPublishTopicName(topic);
+        if (!mapMultiArgs.count(strArg))
+            continue;
+        if (!pPublisher)
+            pPublisher = new CPublisher();
+        BOOST_FOREACH(const std::string& strAddr, mapMultiArgs[strArg]) {
+            std::string strError;
+            if (!pPublisher->Listen(topic, strAddr, strError))
+                return InitError(strError);
+        }
+    }
+    if (pPublisher) {
+        RegisterValidationInterface(pPublisher);
+        threadGroup.create_thread(boost::bind(&CPublisher::Thread, pPublisher));
+    }
+
     // scan for better chains in the block chain database, that are not yet connected in the active best chain
+    // (ThreadImport does this itself when the chain state is being rebuilt)
     CValidationState state;
-    if (!ActivateBestChain(state))
+    if (!fReindexChainState && !ActivateBestChain(state))
         strErrors << "Failed to connect best block";
 
     std::vector<boost::filesystem::path> vImportFiles;
@@ -1242,7 +1308,12 @@ bool AppInit2(boost::thread_group& threadGroup)
         BOOST_FOREACH(string strFile, mapMultiArgs["-loadblock"])
             vImportFiles.push_back(strFile);
     }
+    // Wallet notifications for blocks connected from here on are delivered off the validation path
+    StartValidationNotifications();
+    threadGroup.create_thread(&ThreadValidationNotifications);
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
+    if (fTxIndex && !fTxIndexSynced)
+        threadGroup.create_thread(&ThreadTxIndexSync);
 
     // ********************************************************* Step 10: start node
 
@@ -1283,6 +1354,13 @@ bool AppInit2(boost::thread_group& threadGroup)
 
         // Run a thread to flush wallet periodically
         threadGroup.create_thread(boost::bind(&ThreadFlushWalletDB, boost::ref(pwalletMain->strWalletFile)));
+
+        // Run a thread to keep the key pool filled
+        threadGroup.create_thread(boost::bind(&ThreadTopUpKeyPool, pwalletMain));
+
+        // Check the private keys that -walletdeferkeycheck skipped at load
+        if (GetBoolArg("-walletdeferkeycheck", false) && pwalletMain->HasUncheckedKeys())
+            threadGroup.create_thread(boost::bind(&ThreadCheckWalletKeys, pwalletMain));
     }
 #endif
 
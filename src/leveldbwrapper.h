@@ -90,15 +90,17 @@ public:
     ~CLevelDBWrapper();
 
     template <typename K, typename V>
-    bool Read(const K& key, V& value) const throw(leveldb_error)
+    bool Read(const K& key, V& value, const leveldb::Snapshot* psnapshot = NULL) const throw(leveldb_error)
     {
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(ssKey.GetSerializeSize(key));
         ssKey << key;
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
+        leveldb::ReadOptions options = readoptions;
+        options.snapshot = psnapshot;
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        leveldb::Status status = pdb->Get(options, slKey, &strValue);
         if (!status.ok()) {
             if (status.IsNotFound())
                 return false;
@@ -164,9 +166,52 @@ public:
     }
 
     // not exactly clean encapsulation, but it's easiest for now
+    leveldb::Iterator* NewIterator(const leveldb::Snapshot* psnapshot = NULL)
+    {
+        leveldb::ReadOptions options = iteroptions;
+        options.snapshot = psnapshot;
+        return pdb->NewIterator(options);
+    }
+
+    // pin the current state of the database for reads; prefer CLevelDBSnapshot
+    const leveldb::Snapshot* GetSnapshot() const
+    {
+        return pdb->GetSnapshot();
+    }
+
+    void ReleaseSnapshot(const leveldb::Snapshot* psnapshot) const
+    {
+        pdb->ReleaseSnapshot(psnapshot);
+    }
+};
+
+/**
+ * RAII wrapper around a LevelDB snapshot. Reads through it see the database
+ * exactly as it was when the snapshot was taken, regardless of batches
+ * written since, so multi-key reads are consistent without any locking.
+ */
+class CLevelDBSnapshot
+{
+private:
+    CLevelDBWrapper& db;
+    const leveldb::Snapshot* psnapshot;
+
+    CLevelDBSnapshot(const CLevelDBSnapshot&);
+    void operator=(const CLevelDBSnapshot&);
+
+public:
+    explicit CLevelDBSnapshot(CLevelDBWrapper& dbIn) : db(dbIn), psnapshot(dbIn.GetSnapshot()) {}
+    ~CLevelDBSnapshot() { db.ReleaseSnapshot(psnapshot); }
+
+    template <typename K, typename V>
+    bool Read(const K& key, V& value) const throw(leveldb_error)
+    {
+        return db.Read(key, value, psnapshot);
+    }
+
     leveldb::Iterator* NewIterator()
     {
-        return pdb->NewIterator(iteroptions);
+        return db.NewIterator(psnapshot);
     }
 };
 
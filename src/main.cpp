@@ -7,6 +7,7 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "bloom.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -19,11 +20,13 @@
 #include "util.h"
 #include "utilmoneystr.h"
 
+#include <deque>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace boost;
@@ -37,18 +40,38 @@ using namespace std;
 // Global state
 //
 
+/**
+ * Lock order. A lock lower in this list may be taken while holding one above
+ * it, never the reverse; DEBUG_LOCKORDER builds check this at runtime.
+ *
+ *   cs_main            block index, active chain, coins, per-peer download state
+ *   cs_orphans         orphan transaction pool
+ *   mempool.cs         transaction memory pool
+ *   cs_misbehavior     per-peer misbehaviour scores and pending bans
+ *   cs_chainSnapshot   published snapshot of the active chain
+ *
+ * cs_orphans and cs_misbehavior never need cs_main, so network bookkeeping
+ * that only touches them does not wait for validation. Wallet notifications
+ * are queued under cs_main and delivered without it, so never wait for them
+ * (SyncWithValidationNotifications) while holding cs_main.
+ */
 CCriticalSection cs_main;
 
 BlockMap mapBlockIndex;
 CChain chainActive;
 CBlockIndex *pindexBestHeader = NULL;
+static CCriticalSection cs_chainSnapshot;
+static CChainSnapshot chainSnapshot;
 int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
+bool fReindexChainState = false;
 bool fTxIndex = false;
+bool fTxIndexSynced = false;
+bool fAddressIndex = false;
 bool fIsBareMultisigStd = true;
 unsigned int nCoinCacheSize = 5000;
 
@@ -62,8 +85,9 @@ struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
 };
-map<uint256, COrphanTx> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+CCriticalSection cs_orphans;
+map<uint256, COrphanTx> mapOrphanTransactions; // Protected by cs_orphans
+map<uint256, set<uint256> > mapOrphanTransactionsByPrev; // Protected by cs_orphans
 void EraseOrphansFor(NodeId peer);
 
 // Constant stuff for coinbase transactions we create:
@@ -130,6 +154,29 @@ namespace {
 
     // Number of preferrable block download peers.
     int nPreferredDownload = 0;
+
+    /**
+     * Filter for transactions that were recently rejected by
+     * AcceptToMemoryPool. These are not rerequested until the chain tip
+     * changes, at which point the entire filter is reset. Protected by
+     * cs_main.
+     *
+     * Without this filter we'd be re-requesting txs from each of our peers,
+     * downloading and re-validating (including script checks) the same junk
+     * once per announcing peer. A flooding attacker attempting to roll-over
+     * the filter using minimum-sized, 60 byte, transactions might manage to
+     * send 1000/sec if we have fast peers, so we pick 120,000 to give our
+     * peers a two minute window to send invs to us.
+     *
+     * Decreasing the false positive rate is fairly cheap, so we pick one in a
+     * million to make it highly unlikely for users to have issues with this
+     * filter.
+     *
+     * Memory used: 1.7MB
+     */
+    boost::scoped_ptr<CRollingBloomFilter> recentRejects;
+    uint256 hashRecentRejectsChainTip;
+    CRecentRejectsStats recentRejectsStats;
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -144,6 +191,12 @@ namespace {
 struct CMainSignals {
     // Notifies listeners of updated transaction data (transaction, and optionally the block it is found in.
     boost::signals2::signal<void (const CTransaction &, const CBlock *)> SyncTransaction;
+    // Notifies listeners of all transactions of a block that was connected (with the block) or disconnected (without).
+    boost::signals2::signal<void (const std::vector<CTransaction> &, const CBlock *)> SyncTransactions;
+    // Notifies listeners of a transaction accepted into the memory pool.
+    boost::signals2::signal<void (const CTransaction &)> TransactionAddedToMempool;
+    // Notifies listeners of a block connected to the active chain, after SyncTransactions for it.
+    boost::signals2::signal<void (const CBlock &)> BlockConnected;
     // Notifies listeners of an erased transaction (currently disabled, requires transaction replacement).
     boost::signals2::signal<void (const uint256 &)> EraseTransaction;
     // Notifies listeners of an updated transaction without new data (for now: a coinbase potentially becoming visible).
@@ -158,10 +211,177 @@ struct CMainSignals {
     boost::signals2::signal<void (const CBlock&, const CValidationState&)> BlockChecked;
 } g_signals;
 
+/**
+ * Ordered queue of validation notifications. SyncTransaction(s),
+ * UpdatedTransaction and SetBestChain are pushed here with copies of their
+ * arguments while cs_main is held, and delivered in order by
+ * ThreadValidationNotifications() once it runs, so listeners (the wallet and
+ * anything it spawns) no longer add to block connection latency.
+ * BlockChecked, Inventory and Broadcast stay synchronous: their callers
+ * depend on the listeners having run when the signal returns.
+ *
+ * Until Start() is called each push is delivered straight away on the
+ * calling thread. Start() must be called before the notification thread is
+ * created: from then on pushes are only queued, so a caller holding cs_main
+ * never takes mutexDeliver (the thread takes them the other way round).
+ * Whatever is left when the thread is interrupted is delivered by Flush().
+ *
+ * Connected blocks are shared between their notifications, not copied, and
+ * ActivateBestChain waits (without cs_main) while more than
+ * MAX_QUEUED_VALIDATION_NOTIFICATIONS are queued, so a slow listener bounds
+ * how far validation runs ahead of it instead of growing the queue.
+ */
+class CValidationNotificationQueue
+{
+private:
+    //! Protects the fields below
+    boost::mutex mutex;
+    //! Signalled when a notification is pushed or delivered
+    boost::condition_variable cond;
+    //! Held while a notification runs, so they are delivered one at a time
+    boost::recursive_mutex mutexDeliver;
+    std::deque<boost::function<void ()> > queue;
+    uint64_t nQueued;
+    uint64_t nDelivered;
+    //! Set by Start(); pushes are no longer delivered inline
+    bool fStarted;
+    bool fThreadRunning;
+
+    //! Run the oldest queued notification, if any. mutexDeliver must be held.
+    bool DeliverOne()
+    {
+        boost::function<void ()> func;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (queue.empty())
+                return false;
+            func.swap(queue.front());
+            queue.pop_front();
+        }
+        try {
+            func();
+        } catch (std::exception& e) {
+            // A failing listener must not take the notification thread down with it
+            PrintExceptionContinue(&e, "bitcoin-notify");
+        }
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nDelivered++;
+        }
+        cond.notify_all();
+        return true;
+    }
+
+public:
+    CValidationNotificationQueue() : nQueued(0), nDelivered(0), fStarted(false), fThreadRunning(false) {}
+
+    //! Switch to queued delivery. Call before creating the thread running Thread().
+    void Start()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStarted = true;
+        fThreadRunning = true;
+    }
+
+    void Push(const boost::function<void ()>& func)
+    {
+        bool fInline;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            queue.push_back(func);
+            nQueued++;
+            fInline = !fStarted;
+        }
+        if (fInline)
+            Flush();
+        else
+            cond.notify_all();
+    }
+
+    //! Deliver everything queued so far on the calling thread
+    void Flush()
+    {
+        boost::unique_lock<boost::recursive_mutex> lock(mutexDeliver);
+        while (DeliverOne()) {}
+    }
+
+    //! Wait until no more than nMax notifications are queued. Never call with cs_main held.
+    void WaitForSpace(size_t nMax)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.size() > nMax && fThreadRunning)
+            cond.wait(lock);
+    }
+
+    //! Wait until everything queued before the call has been delivered
+    void Wait()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        // Before Start() pushes are delivered by whoever queued them; once the
+        // thread has stopped nothing will deliver them until Flush()
+        if (!fThreadRunning)
+            return;
+        uint64_t nTarget = nQueued;
+        while (nDelivered < nTarget && fThreadRunning)
+            cond.wait(lock);
+    }
+
+    void Thread()
+    {
+        try {
+            while (true) {
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    while (queue.empty())
+                        cond.wait(lock);
+                }
+                boost::unique_lock<boost::recursive_mutex> lock(mutexDeliver);
+                DeliverOne();
+            }
+        } catch (...) {
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                fThreadRunning = false;
+            }
+            cond.notify_all();
+            throw;
+        }
+    }
+};
+
+CValidationNotificationQueue validationQueue;
+
+void NotifySyncTransaction(const CTransaction &tx, boost::shared_ptr<const CBlock> pblock) {
+    g_signals.SyncTransaction(tx, pblock.get());
+}
+
+void NotifySyncTransactions(const std::vector<CTransaction> &vtx, boost::shared_ptr<const CBlock> pblock, bool fBlockTxs) {
+    g_signals.SyncTransactions(fBlockTxs ? pblock->vtx : vtx, pblock.get());
+}
+
+void NotifyTransactionAddedToMempool(const CTransaction &tx) {
+    g_signals.TransactionAddedToMempool(tx);
+}
+
+void NotifyBlockConnected(boost::shared_ptr<const CBlock> pblock) {
+    g_signals.BlockConnected(*pblock);
+}
+
+void NotifyUpdatedTransaction(const uint256 &hash) {
+    g_signals.UpdatedTransaction(hash);
+}
+
+void NotifySetBestChain(const CBlockLocator &locator) {
+    g_signals.SetBestChain(locator);
+}
+
 } // anon namespace
 
 void RegisterValidationInterface(CValidationInterface* pwalletIn) {
     g_signals.SyncTransaction.connect(boost::bind(&CValidationInterface::SyncTransaction, pwalletIn, _1, _2));
+    g_signals.SyncTransactions.connect(boost::bind(&CValidationInterface::SyncTransactions, pwalletIn, _1, _2));
+    g_signals.TransactionAddedToMempool.connect(boost::bind(&CValidationInterface::TransactionAddedToMempool, pwalletIn, _1));
+    g_signals.BlockConnected.connect(boost::bind(&CValidationInterface::BlockConnected, pwalletIn, _1));
     g_signals.EraseTransaction.connect(boost::bind(&CValidationInterface::EraseFromWallet, pwalletIn, _1));
     g_signals.UpdatedTransaction.connect(boost::bind(&CValidationInterface::UpdatedTransaction, pwalletIn, _1));
     g_signals.SetBestChain.connect(boost::bind(&CValidationInterface::SetBestChain, pwalletIn, _1));
@@ -177,6 +397,9 @@ void UnregisterValidationInterface(CValidationInterface* pwalletIn) {
     g_signals.SetBestChain.disconnect(boost::bind(&CValidationInterface::SetBestChain, pwalletIn, _1));
     g_signals.UpdatedTransaction.disconnect(boost::bind(&CValidationInterface::UpdatedTransaction, pwalletIn, _1));
     g_signals.EraseTransaction.disconnect(boost::bind(&CValidationInterface::EraseFromWallet, pwalletIn, _1));
+    g_signals.BlockConnected.disconnect(boost::bind(&CValidationInterface::BlockConnected, pwalletIn, _1));
+    g_signals.TransactionAddedToMempool.disconnect(boost::bind(&CValidationInterface::TransactionAddedToMempool, pwalletIn, _1));
+    g_signals.SyncTransactions.disconnect(boost::bind(&CValidationInterface::SyncTransactions, pwalletIn, _1, _2));
     g_signals.SyncTransaction.disconnect(boost::bind(&CValidationInterface::SyncTransaction, pwalletIn, _1, _2));
 }
 
@@ -187,11 +410,49 @@ void UnregisterAllValidationInterfaces() {
     g_signals.SetBestChain.disconnect_all_slots();
     g_signals.UpdatedTransaction.disconnect_all_slots();
     g_signals.EraseTransaction.disconnect_all_slots();
+    g_signals.BlockConnected.disconnect_all_slots();
+    g_signals.TransactionAddedToMempool.disconnect_all_slots();
+    g_signals.SyncTransactions.disconnect_all_slots();
     g_signals.SyncTransaction.disconnect_all_slots();
 }
 
 void SyncWithWallets(const CTransaction &tx, const CBlock *pblock) {
-    g_signals.SyncTransaction(tx, pblock);
+    boost::shared_ptr<const CBlock> pblockCopy;
+    if (pblock)
+        pblockCopy.reset(new CBlock(*pblock));
+    validationQueue.Push(boost::bind(&NotifySyncTransaction, tx, pblockCopy));
+}
+
+void SyncWithWallets(const std::vector<CTransaction> &vtx, const CBlock *pblock) {
+    boost::shared_ptr<const CBlock> pblockCopy;
+    if (pblock)
+        pblockCopy.reset(new CBlock(*pblock));
+    // Don't copy a connected block's transactions twice
+    bool fBlockTxs = pblock && &vtx == &pblock->vtx;
+    validationQueue.Push(boost::bind(&NotifySyncTransactions, fBlockTxs ? std::vector<CTransaction>() : vtx, pblockCopy, fBlockTxs));
+}
+
+/** Queue the notifications for a connected block, sharing one copy of it between them */
+static void SyncWithWalletsConnected(const boost::shared_ptr<const CBlock> &pblock) {
+    validationQueue.Push(boost::bind(&NotifySyncTransactions, std::vector<CTransaction>(), pblock, true));
+    validationQueue.Push(boost::bind(&NotifyBlockConnected, pblock));
+}
+
+void StartValidationNotifications() {
+    validationQueue.Start();
+}
+
+void ThreadValidationNotifications() {
+    RenameThread("bitcoin-notify");
+    validationQueue.Thread();
+}
+
+void SyncWithValidationNotifications() {
+    validationQueue.Wait();
+}
+
+void FlushValidationNotifications() {
+    validationQueue.Flush();
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -212,12 +473,6 @@ struct CBlockReject {
 // processing of incoming data is done after the ProcessMessage call returns,
 // and we're no longer holding the node's locks.
 struct CNodeState {
-    // Accumulated misbehaviour score for this peer.
-    int nMisbehavior;
-    // Whether this peer should be disconnected and banned (unless whitelisted).
-    bool fShouldBan;
-    // String name of this peer (debugging/logging purposes).
-    std::string name;
     // List of asynchronously-determined block rejections to notify this peer about.
     std::vector<CBlockReject> rejects;
     // The best known block we know this peer has announced.
@@ -232,25 +487,77 @@ struct CNodeState {
     int64_t nStallingSince;
     list<QueuedBlock> vBlocksInFlight;
     int nBlocksInFlight;
+    // Maximum number of blocks we request from this peer at a time, adapted to its measured speed.
+    int nBlocksInFlightLimit;
+    // Moving averages (in microseconds) of the time between requesting a block and receiving it,
+    // and of the time the peer spent serving each block once the previous one was delivered.
+    int64_t nBlockLatency;
+    int64_t nBlockServiceTime;
+    // Moving average of the block download throughput from this peer, in bytes per second.
+    int64_t nBlockBytesPerSec;
+    // Time (in microseconds) the last requested block from this peer arrived, or 0.
+    int64_t nLastBlockReceived;
     // Whether we consider this a preferred download peer.
     bool fPreferredDownload;
 
     CNodeState() {
-        nMisbehavior = 0;
-        fShouldBan = false;
         pindexBestKnownBlock = NULL;
         hashLastUnknownBlock = uint256(0);
         pindexLastCommonBlock = NULL;
         fSyncStarted = false;
         nStallingSince = 0;
         nBlocksInFlight = 0;
+        nBlocksInFlightLimit = DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER;
+        nBlockLatency = 0;
+        nBlockServiceTime = 0;
+        nBlockBytesPerSec = 0;
+        nLastBlockReceived = 0;
         fPreferredDownload = false;
     }
+
+    // Fold in the measurement of a requested block that just arrived, and recompute
+    // how many blocks to keep in flight so roughly BLOCK_DOWNLOAD_TARGET_QUEUE_TIME
+    // worth of work stays queued at this peer.
+    void UpdateBlockDownloadStats(int64_t nLatency, int64_t nServiceTime, unsigned int nBytes) {
+        nServiceTime = std::max<int64_t>(nServiceTime, 1);
+        int64_t nBytesPerSec = (int64_t)nBytes * 1000000 / nServiceTime;
+        if (nBlockServiceTime == 0) {
+            nBlockLatency = nLatency;
+            nBlockServiceTime = nServiceTime;
+            nBlockBytesPerSec = nBytesPerSec;
+        } else {
+            // Exponential moving averages with weight 1/8 for the new sample.
+            nBlockLatency += (nLatency - nBlockLatency) / 8;
+            nBlockServiceTime += (nServiceTime - nBlockServiceTime) / 8;
+            nBlockBytesPerSec += (nBytesPerSec - nBlockBytesPerSec) / 8;
+        }
+        nBlockServiceTime = std::max<int64_t>(nBlockServiceTime, 1);
+        int64_t nLimit = BLOCK_DOWNLOAD_TARGET_QUEUE_TIME / nBlockServiceTime;
+        nBlocksInFlightLimit = (int)std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(MAX_BLOCKS_IN_TRANSIT_PER_PEER, nLimit));
+    }
 };
 
 // Map maintaining per-node state. Requires cs_main.
 map<NodeId, CNodeState> mapNodeState;
 
+// Misbehaviour tracking about nodes. Kept out of CNodeState, under its own
+// lock, so that protocol violations can be scored from anywhere in message
+// processing without taking cs_main.
+struct CNodeMisbehavior {
+    // Accumulated misbehaviour score for this peer.
+    int nMisbehavior;
+    // Whether this peer should be disconnected and banned (unless whitelisted).
+    bool fShouldBan;
+    // String name of this peer (debugging/logging purposes).
+    std::string name;
+
+    CNodeMisbehavior() : nMisbehavior(0), fShouldBan(false) {}
+};
+
+CCriticalSection cs_misbehavior;
+// Map maintaining per-node misbehaviour. Requires cs_misbehavior.
+map<NodeId, CNodeMisbehavior> mapNodeMisbehavior;
+
 // Requires cs_main.
 CNodeState *State(NodeId pnode) {
     map<NodeId, CNodeState>::iterator it = mapNodeState.find(pnode);
@@ -276,31 +583,48 @@ void UpdatePreferredDownload(CNode* node, CNodeState* state)
 }
 
 void InitializeNode(NodeId nodeid, const CNode *pnode) {
-    LOCK(cs_main);
-    CNodeState &state = mapNodeState.insert(std::make_pair(nodeid, CNodeState())).first->second;
-    state.name = pnode->addrName;
+    {
+        LOCK(cs_main);
+        mapNodeState.insert(std::make_pair(nodeid, CNodeState()));
+    }
+    LOCK(cs_misbehavior);
+    mapNodeMisbehavior[nodeid].name = pnode->addrName;
 }
 
 void FinalizeNode(NodeId nodeid) {
-    LOCK(cs_main);
-    CNodeState *state = State(nodeid);
+    {
+        LOCK(cs_main);
+        CNodeState *state = State(nodeid);
 
-    if (state->fSyncStarted)
-        nSyncStarted--;
+        if (state->fSyncStarted)
+            nSyncStarted--;
 
-    BOOST_FOREACH(const QueuedBlock& entry, state->vBlocksInFlight)
-        mapBlocksInFlight.erase(entry.hash);
-    EraseOrphansFor(nodeid);
-    nPreferredDownload -= state->fPreferredDownload;
+        BOOST_FOREACH(const QueuedBlock& entry, state->vBlocksInFlight)
+            mapBlocksInFlight.erase(entry.hash);
+        nPreferredDownload -= state->fPreferredDownload;
 
-    mapNodeState.erase(nodeid);
+        mapNodeState.erase(nodeid);
+    }
+    EraseOrphansFor(nodeid);
+    LOCK(cs_misbehavior);
+    mapNodeMisbehavior.erase(nodeid);
 }
 
 // Requires cs_main.
-void MarkBlockAsReceived(const uint256& hash) {
+// If nodeFrom is the peer we requested the block from, its download speed measurements are updated.
+void MarkBlockAsReceived(const uint256& hash, NodeId nodeFrom = -1, unsigned int nBytes = 0) {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState *state = State(itInFlight->second.first);
+        if (itInFlight->second.first == nodeFrom) {
+            int64_t nNow = GetTimeMicros();
+            int64_t nRequested = itInFlight->second.second->nTime;
+            // Requests are pipelined, so the peer only started serving this block once it
+            // had delivered the previous one (or when we asked for it, if that was later).
+            int64_t nStarted = std::max(nRequested, state->nLastBlockReceived);
+            state->UpdateBlockDownloadStats(nNow - nRequested, nNow - nStarted, nBytes);
+            state->nLastBlockReceived = nNow;
+        }
         state->vBlocksInFlight.erase(itInFlight->second.second);
         state->nBlocksInFlight--;
         state->nStallingSince = 0;
@@ -375,8 +699,9 @@ CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
 }
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
- *  at most count entries. */
-void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller) {
+ *  at most count entries. If the download window is blocked, nodeStaller and pindexStalling are set
+ *  to the peer and the in-flight block it is waiting for. */
+void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller, CBlockIndex*& pindexStalling) {
     if (count == 0)
         return;
 
@@ -412,6 +737,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
     int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     NodeId waitingfor = -1;
+    CBlockIndex *pindexWaitingFor = NULL;
     while (pindexWalk->nHeight < nMaxHeight) {
         // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
         // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
@@ -438,6 +764,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                     if (vBlocks.size() == 0 && waitingfor != nodeid) {
                         // We aren't able to fetch anything, but we would be if the download window was one larger.
                         nodeStaller = waitingfor;
+                        pindexStalling = pindexWaitingFor;
                     }
                     return;
                 }
@@ -448,6 +775,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                pindexWaitingFor = pindex;
             }
         }
     }
@@ -455,14 +783,26 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
 
 } // anon namespace
 
+void GetRecentRejectsStats(CRecentRejectsStats &stats) {
+    LOCK(cs_main);
+    stats = recentRejectsStats;
+}
+
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
+    {
+        LOCK(cs_misbehavior);
+        map<NodeId, CNodeMisbehavior>::const_iterator it = mapNodeMisbehavior.find(nodeid);
+        stats.nMisbehavior = (it != mapNodeMisbehavior.end()) ? it->second.nMisbehavior : 0;
+    }
     LOCK(cs_main);
     CNodeState *state = State(nodeid);
     if (state == NULL)
         return false;
-    stats.nMisbehavior = state->nMisbehavior;
     stats.nSyncHeight = state->pindexBestKnownBlock ? state->pindexBestKnownBlock->nHeight : -1;
     stats.nCommonHeight = state->pindexLastCommonBlock ? state->pindexLastCommonBlock->nHeight : -1;
+    stats.dBlockLatency = state->nBlockLatency / 1e6;
+    stats.nBlockBytesPerSec = state->nBlockBytesPerSec;
+    stats.nBlocksInFlightLimit = state->nBlocksInFlightLimit;
     BOOST_FOREACH(const QueuedBlock& queue, state->vBlocksInFlight) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
@@ -513,6 +853,7 @@ CBlockTreeDB *pblocktree = NULL;
 
 bool AddOrphanTx(const CTransaction& tx, NodeId peer)
 {
+    LOCK(cs_orphans);
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
         return false;
@@ -543,6 +884,7 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer)
 
 void static EraseOrphanTx(uint256 hash)
 {
+    AssertLockHeld(cs_orphans);
     map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
     if (it == mapOrphanTransactions.end())
         return;
@@ -560,6 +902,7 @@ void static EraseOrphanTx(uint256 hash)
 
 void EraseOrphansFor(NodeId peer)
 {
+    LOCK(cs_orphans);
     int nErased = 0;
     map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
     while (iter != mapOrphanTransactions.end())
@@ -577,6 +920,7 @@ void EraseOrphansFor(NodeId peer)
 
 unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
 {
+    LOCK(cs_orphans);
     unsigned int nEvicted = 0;
     while (mapOrphanTransactions.size() > nMaxOrphans)
     {
@@ -1044,10 +1388,27 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     }
 
     SyncWithWallets(tx, NULL);
+    validationQueue.Push(boost::bind(&NotifyTransactionAddedToMempool, tx));
 
     return true;
 }
 
+// LevelDB handles reads concurrent with block connection, and the block tree
+// outlives the RPC server, so these don't take cs_main.
+bool GetAddressIndex(const uint160& hashScript, int nAfterHeight, const uint256& txidAfter, unsigned int nCount, std::vector<std::pair<CAddressIndexKey, CAddressIndexValue> >& vEntries)
+{
+    if (!fAddressIndex)
+        return false;
+    return pblocktree->ReadAddressIndex(hashScript, nAfterHeight, txidAfter, nCount, vEntries);
+}
+
+bool GetSpentIndex(const COutPoint& outpoint, CSpentIndexValue& value)
+{
+    if (!fAddressIndex)
+        return false;
+    return pblocktree->ReadSpentIndex(outpoint, value);
+}
+
 // Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1155,6 +1516,7 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
         return error("ReadBlockFromDisk : OpenBlockFile failed");
 
     // Read block
+    block.SetNull();
     try {
         filein >> block;
     }
@@ -1287,15 +1649,16 @@ void CheckForkWarningConditionsOnNewFork(CBlockIndex* pindexNewForkTip)
     CheckForkWarningConditions();
 }
 
-// Requires cs_main.
 void Misbehaving(NodeId pnode, int howmuch)
 {
     if (howmuch == 0)
         return;
 
-    CNodeState *state = State(pnode);
-    if (state == NULL)
+    LOCK(cs_misbehavior);
+    map<NodeId, CNodeMisbehavior>::iterator it = mapNodeMisbehavior.find(pnode);
+    if (it == mapNodeMisbehavior.end())
         return;
+    CNodeMisbehavior *state = &it->second;
 
     state->nMisbehavior += howmuch;
     int banscore = GetArg("-banscore", 100);
@@ -1468,7 +1831,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
 
 
 
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean, bool fUpdateIndexes)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
 
@@ -1487,11 +1850,21 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
         return error("DisconnectBlock() : block and undo data inconsistent");
 
+    bool fEraseAddressIndex = fAddressIndex && fUpdateIndexes;
+    std::vector<CAddressIndexKey> vAddressIndex;
+    std::vector<COutPoint> vSpentIndex;
+
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
         const CTransaction &tx = block.vtx[i];
         uint256 hash = tx.GetHash();
 
+        if (fEraseAddressIndex) {
+            for (unsigned int k = 0; k < tx.vout.size(); k++)
+                if (!tx.vout[k].scriptPubKey.IsUnspendable())
+                    vAddressIndex.push_back(CAddressIndexKey(CScriptID(tx.vout[k].scriptPubKey), pindex->nHeight, hash, k, false));
+        }
+
         // Check that all outputs are available and match the outputs in the block itself
         // exactly. Note that transactions with only provably unspendable outputs won't
         // have outputs available even in the block itself, so we handle that case
@@ -1540,10 +1913,19 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
                 if (coins->vout.size() < out.n+1)
                     coins->vout.resize(out.n+1);
                 coins->vout[out.n] = undo.txout;
+
+                if (fEraseAddressIndex) {
+                    vAddressIndex.push_back(CAddressIndexKey(CScriptID(undo.txout.scriptPubKey), pindex->nHeight, hash, j, true));
+                    vSpentIndex.push_back(out);
+                }
             }
         }
     }
 
+    if (fEraseAddressIndex)
+        if (!pblocktree->EraseAddressIndex(vAddressIndex, vSpentIndex))
+            return state.Abort("Failed to erase address index");
+
     // move best block pointer to prevout block
     view.SetBestBlock(pindex->pprev->GetBlockHash());
 
@@ -1654,6 +2036,8 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
     vPos.reserve(block.vtx.size());
+    std::vector<std::pair<CAddressIndexKey, CAddressIndexValue> > vAddressIndex;
+    std::vector<std::pair<COutPoint, CSpentIndexValue> > vSpentIndex;
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
@@ -1690,13 +2074,31 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
             control.Add(vChecks);
         }
 
+        const uint256 hash = tx.GetHash();
+        if (fAddressIndex && !fJustCheck) {
+            // Spent outputs have to be looked up before UpdateCoins removes them
+            if (!tx.IsCoinBase()) {
+                for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                    const COutPoint &prevout = tx.vin[j].prevout;
+                    const CTxOut &prev = view.GetOutputFor(tx.vin[j]);
+                    vAddressIndex.push_back(std::make_pair(CAddressIndexKey(CScriptID(prev.scriptPubKey), pindex->nHeight, hash, j, true), CAddressIndexValue(prev.nValue, prevout)));
+                    vSpentIndex.push_back(std::make_pair(prevout, CSpentIndexValue(hash, j, pindex->nHeight)));
+                }
+            }
+            for (unsigned int k = 0; k < tx.vout.size(); k++) {
+                const CTxOut &out = tx.vout[k];
+                if (!out.scriptPubKey.IsUnspendable())
+                    vAddressIndex.push_back(std::make_pair(CAddressIndexKey(CScriptID(out.scriptPubKey), pindex->nHeight, hash, k, false), CAddressIndexValue(out.nValue, COutPoint())));
+            }
+        }
+
         CTxUndo undoDummy;
         if (i > 0) {
             blockundo.vtxundo.push_back(CTxUndo());
         }
         UpdateCoins(tx, state, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
 
-        vPos.push_back(std::make_pair(tx.GetHash(), pos));
+        vPos.push_back(std::make_pair(hash, pos));
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
     int64_t nTime1 = GetTimeMicros(); nTimeConnect += nTime1 - nTimeStart;
@@ -1742,6 +2144,10 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
         if (!pblocktree->WriteTxIndex(vPos))
             return state.Abort("Failed to write transaction index");
 
+    if (fAddressIndex)
+        if (!pblocktree->WriteAddressIndex(vAddressIndex, vSpentIndex))
+            return state.Abort("Failed to write address index");
+
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
@@ -1750,7 +2156,7 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
 
     // Watch for changes to the previous coinbase transaction.
     static uint256 hashPrevBestCoinBase;
-    g_signals.UpdatedTransaction(hashPrevBestCoinBase);
+    validationQueue.Push(boost::bind(&NotifyUpdatedTransaction, hashPrevBestCoinBase));
     hashPrevBestCoinBase = block.vtx[0].GetHash();
 
     int64_t nTime4 = GetTimeMicros(); nTimeCallbacks += nTime4 - nTime3;
@@ -1779,9 +2185,21 @@ bool static WriteChainState(CValidationState &state, bool forceWrite=false) {
     return true;
 }
 
+/** Publish the current chainActive tip for lock-free readers. Requires cs_main. */
+void static PublishChainSnapshot() {
+    LOCK(cs_chainSnapshot);
+    chainSnapshot = CChainSnapshot(chainActive.Tip());
+}
+
+CChainSnapshot GetActiveChainSnapshot() {
+    LOCK(cs_chainSnapshot);
+    return chainSnapshot;
+}
+
 // Update chainActive and related internal data structures.
 void static UpdateTip(CBlockIndex *pindexNew) {
     chainActive.SetTip(pindexNew);
+    PublishChainSnapshot();
 
     // New best block
     nTimeBestReceived = GetTime();
@@ -1839,23 +2257,25 @@ bool static DisconnectTip(CValidationState &state) {
     // Write the chain state to disk, if necessary.
     if (!WriteChainState(state))
         return false;
-    // Resurrect mempool transactions from the disconnected block.
-    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-        // ignore validation errors in resurrected transactions
-        list<CTransaction> removed;
-        CValidationState stateDummy;
-        if (!tx.IsCoinBase())
-            if (!AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
-                mempool.remove(tx, removed, true);
+    // Resurrect mempool transactions from the disconnected block. Nodes
+    // running in blocks-only mode don't maintain a relay mempool, so skip
+    // the revalidation work there.
+    if (fRelayTxes) {
+        BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+            // ignore validation errors in resurrected transactions
+            list<CTransaction> removed;
+            CValidationState stateDummy;
+            if (!tx.IsCoinBase())
+                if (!AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+                    mempool.remove(tx, removed, true);
+        }
     }
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
     UpdateTip(pindexDelete->pprev);
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
-    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-        SyncWithWallets(tx, NULL);
-    }
+    SyncWithWallets(block.vtx, NULL);
     return true;
 }
 
@@ -1872,11 +2292,15 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     mempool.check(pcoinsTip);
     // Read block from disk.
     int64_t nTime1 = GetTimeMicros();
-    CBlock block;
+    // Queued notifications share this copy of the block
+    boost::shared_ptr<CBlock> pblockShared;
     if (!pblock) {
-        if (!ReadBlockFromDisk(block, pindexNew))
+        pblockShared.reset(new CBlock());
+        if (!ReadBlockFromDisk(*pblockShared, pindexNew))
             return state.Abort("Failed to read block");
-        pblock = &block;
+        pblock = pblockShared.get();
+    } else {
+        pblockShared.reset(new CBlock(*pblock));
     }
     // Apply the block atomically to the chain state.
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
@@ -1916,13 +2340,11 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
         SyncWithWallets(tx, NULL);
     }
     // ... and about transactions that got confirmed:
-    BOOST_FOREACH(const CTransaction &tx, pblock->vtx) {
-        SyncWithWallets(tx, pblock);
-    }
+    SyncWithWalletsConnected(pblockShared);
     // Update best block in wallet (so we can detect restored wallets)
     // Emit this signal after the SyncWithWallets signals as the wallet relies on that everything up to this point has been synced
     if ((chainActive.Height() % 20160) == 0 || ((chainActive.Height() % 144) == 0 && !IsInitialBlockDownload()))
-        g_signals.SetBestChain(chainActive.GetLocator());
+        validationQueue.Push(boost::bind(&NotifySetBestChain, chainActive.GetLocator()));
 
     int64_t nTime6 = GetTimeMicros(); nTimePostConnect += nTime6 - nTime5; nTimeTotal += nTime6 - nTime1;
     LogPrint("bench", "  - Connect postprocess: %.2fms [%.2fs]\n", (nTime6 - nTime5) * 0.001, nTimePostConnect * 0.000001);
@@ -2058,6 +2480,10 @@ bool ActivateBestChain(CValidationState &state, CBlock *pblock) {
     do {
         boost::this_thread::interruption_point();
 
+        // Let the wallet catch up before connecting more blocks; its
+        // notifications need cs_main, so wait before taking it
+        validationQueue.WaitForSpace(MAX_QUEUED_VALIDATION_NOTIFICATIONS);
+
         bool fInitialDownload;
         {
             LOCK(cs_main);
@@ -2280,6 +2706,9 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
 {
     // These are checks that are independent of context.
 
+    if (block.fChecked)
+        return true;
+
     if (!CheckBlockHeader(block, state, fCheckPOW))
         return false;
 
@@ -2331,6 +2760,9 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"),
                          REJECT_INVALID, "bad-blk-sigops", true);
 
+    if (fCheckPOW && fCheckMerkleRoot)
+        block.fChecked = true;
+
     return true;
 }
 
@@ -2534,7 +2966,10 @@ bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDis
 
     {
         LOCK(cs_main);
-        MarkBlockAsReceived(pblock->GetHash());
+        if (pfrom)
+            MarkBlockAsReceived(pblock->GetHash(), pfrom->GetId(), ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
+        else
+            MarkBlockAsReceived(pblock->GetHash());
         if (!checked) {
             return error("%s : CheckBlock FAILED", __func__);
         }
@@ -2874,15 +3309,28 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadReindexing(fReindexing);
     fReindex |= fReindexing;
 
+    // Check whether a rebuild of the chain state was interrupted
+    bool fReindexingChainState = false;
+    pblocktree->ReadFlag("reindexchainstate", fReindexingChainState);
+    fReindexChainState |= fReindexingChainState;
+
     // Check whether we have a transaction index
+    // While it is being built in the background, the index remembers how far it got
     pblocktree->ReadFlag("txindex", fTxIndex);
-    LogPrintf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
+    CBlockLocator locatorTxIndex;
+    fTxIndexSynced = fTxIndex && !pblocktree->ReadTxIndexBestBlock(locatorTxIndex);
+    LogPrintf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? (fTxIndexSynced ? "enabled" : "enabled, still being built") : "disabled");
+
+    // Check whether we have an address index
+    pblocktree->ReadFlag("addressindex", fAddressIndex);
+    LogPrintf("LoadBlockIndexDB(): address index %s\n", fAddressIndex ? "enabled" : "disabled");
 
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    PublishChainSnapshot();
     LogPrintf("LoadBlockIndexDB(): hashBestChain=%s height=%d date=%s progress=%f\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(),
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
@@ -2944,7 +3392,7 @@ bool CVerifyDB::VerifyDB(CCoinsView *coinsview, int nCheckLevel, int nCheckDepth
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
         if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
             bool fClean = true;
-            if (!DisconnectBlock(block, state, pindex, coins, &fClean))
+            if (!DisconnectBlock(block, state, pindex, coins, &fClean, false))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
             pindexState = pindex->pprev;
             if (!fClean) {
@@ -2982,6 +3430,7 @@ void UnloadBlockIndex()
     mapBlockIndex.clear();
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
+    PublishChainSnapshot();
     pindexBestInvalid = NULL;
 }
 
@@ -2996,13 +3445,25 @@ bool LoadBlockIndex()
 
 bool InitBlockIndex() {
     LOCK(cs_main);
+
+    // Initialize global variables that cannot be constructed at startup.
+    recentRejects.reset(new CRollingBloomFilter(120000, 0.000001, GetRand(std::numeric_limits<unsigned int>::max())));
+    hashRecentRejectsChainTip = uint256();
+
     // Check whether we're already initialized
     if (chainActive.Genesis() != NULL)
         return true;
 
+    // When only the chain state is rebuilt the block database stays as it is; ThreadImport reconnects its blocks
+    if (fReindexChainState && mapBlockIndex.count(Params().HashGenesisBlock()))
+        return true;
+
     // Use the provided setting for -txindex in the new database
     fTxIndex = GetBoolArg("-txindex", false);
+    fTxIndexSynced = fTxIndex;
     pblocktree->WriteFlag("txindex", fTxIndex);
+    fAddressIndex = GetBoolArg("-addressindex", false);
+    pblocktree->WriteFlag("addressindex", fAddressIndex);
     LogPrintf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -3032,6 +3493,123 @@ bool InitBlockIndex() {
     return true;
 }
 
+bool SetTxIndex(bool fEnable)
+{
+    LOCK(cs_main);
+    if (fEnable && fReindexChainState) {
+        // Rebuilding the chain state reconnects, and so indexes, every block
+        if (!pblocktree->EraseTxIndexBestBlock() || !pblocktree->WriteFlag("txindex", true))
+            return error("%s : failed to write transaction index state", __func__);
+        fTxIndex = true;
+        fTxIndexSynced = true;
+        return true;
+    }
+    if (fEnable == fTxIndex)
+        return true;
+
+    if (fEnable) {
+        // New blocks are indexed by ConnectBlock straight away; ThreadTxIndexSync fills in the
+        // rest, starting from where the index was left when it was last turned off
+        CBlockLocator locator;
+        if (!pblocktree->ReadTxIndexBestBlock(locator))
+            locator = chainActive.GetLocator(chainActive.Genesis());
+        if (!pblocktree->WriteTxIndex(std::vector<std::pair<uint256, CDiskTxPos> >(), locator))
+            return error("%s : failed to write transaction index state", __func__);
+    } else if (fTxIndexSynced) {
+        // The index covers the chain up to here, so turning it back on only has to catch up from this point
+        if (!pblocktree->WriteTxIndex(std::vector<std::pair<uint256, CDiskTxPos> >(), chainActive.GetLocator()))
+            return error("%s : failed to write transaction index state", __func__);
+    }
+    if (!pblocktree->WriteFlag("txindex", fEnable))
+        return error("%s : failed to write transaction index state", __func__);
+
+    fTxIndex = fEnable;
+    fTxIndexSynced = false;
+    LogPrintf("%s: transaction index %s\n", __func__, fEnable ? "enabled, to be built in the background" : "disabled");
+    return true;
+}
+
+/** Write the entries collected by ThreadTxIndexSync so far, recording pindex as the point to resume from */
+static bool WriteTxIndexSync(std::vector<std::pair<uint256, CDiskTxPos> >& vPos, const CBlockIndex* pindex)
+{
+    CBlockLocator locator;
+    {
+        LOCK(cs_main);
+        locator = chainActive.GetLocator(pindex);
+    }
+    if (!pblocktree->WriteTxIndex(vPos, locator))
+        return false;
+    vPos.clear();
+    return true;
+}
+
+void ThreadTxIndexSync()
+{
+    RenameThread("bitcoin-txindex");
+
+    const CBlockIndex* pindex;
+    {
+        LOCK(cs_main);
+        if (!fTxIndex || fTxIndexSynced)
+            return;
+        CBlockLocator locator;
+        pblocktree->ReadTxIndexBestBlock(locator);
+        pindex = FindForkInGlobalIndex(chainActive, locator);
+    }
+    LogPrintf("%s: building transaction index from height %d\n", __func__, pindex->nHeight);
+
+    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
+    try {
+        while (true) {
+            boost::this_thread::interruption_point();
+
+            {
+                LOCK(cs_main);
+                // Blocks on a branch that was reorganized away keep their entries, which do no harm
+                if (!chainActive.Contains(pindex))
+                    pindex = chainActive.FindFork(pindex);
+                const CBlockIndex* pindexNext = chainActive.Next(pindex);
+                if (!pindexNext) {
+                    // Caught up: everything past this point was connected with the index enabled
+                    if (!pblocktree->WriteTxIndex(vPos) || !pblocktree->EraseTxIndexBestBlock()) {
+                        AbortNode("Failed to write transaction index");
+                        return;
+                    }
+                    fTxIndexSynced = true;
+                    break;
+                }
+                pindex = pindexNext;
+            }
+
+            // Same positions ConnectBlock would have recorded
+            CBlock block;
+            if (!ReadBlockFromDisk(block, pindex)) {
+                AbortNode("Failed to read block");
+                return;
+            }
+            CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
+            BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+                vPos.push_back(make_pair(tx.GetHash(), pos));
+                pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+            }
+
+            if (vPos.size() >= TXINDEX_SYNC_BATCH_SIZE) {
+                if (!WriteTxIndexSync(vPos, pindex)) {
+                    AbortNode("Failed to write transaction index");
+                    return;
+                }
+                LogPrintf("%s: transaction index built up to height %d\n", __func__, pindex->nHeight);
+            }
+        }
+    } catch (boost::thread_interrupted) {
+        // Keep what was collected; the next start resumes after pindex
+        WriteTxIndexSync(vPos, pindex);
+        throw;
+    }
+
+    LogPrintf("%s: transaction index caught up with the tip at height %d\n", __func__, pindex->nHeight);
+}
+
 
 
 void PrintBlockTree()
@@ -3103,20 +3681,55 @@ void PrintBlockTree()
     }
 }
 
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+namespace {
+
+/** A block found in an import file */
+struct CImportBlock
 {
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
-    int64_t nStart = GetTimeMillis();
+    CDiskBlockPos pos; // null for external files
+    unsigned int nSize;
+    std::vector<char> vData; // until deserialized
+    CBlock block;
+    uint256 hash;
+    bool fValid;
+    bool fFileStart; // no block: marks where block file pos.nFile starts
 
-    int nLoaded = 0;
-    try {
+    CImportBlock() : nSize(0), fValid(false), fFileStart(false) {}
+};
+
+//! Blocks with unknown parent by parent hash, with their position and, if kept in memory, the block
+typedef std::multimap<uint256, std::pair<CDiskBlockPos, boost::shared_ptr<CImportBlock> > > UnknownParentMap;
+
+/**
+ * Scans import files for blocks on one thread and deserializes and checks
+ * them on others, ahead of the thread that adds them to the block index in
+ * file order.
+ */
+class CBlockImportReader
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condScanner;
+    boost::condition_variable condWorker;
+    boost::condition_variable condMaster;
+    boost::thread_group threadGroup;
+
+    std::vector<CImportFile> vFiles;
+    size_t nNextFile;
+    uint64_t nNextSeq;
+    uint64_t nTakeSeq;
+    uint64_t nReadAheadBytes;
+    bool fScanDone;
+    bool fQuit;
+    std::deque<std::pair<uint64_t, CImportBlock*> > queueWork;
+    std::map<uint64_t, CImportBlock*> mapRead;
+
+    void ScanFile(FILE* fileIn, int nFile)
+    {
         // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
         CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
         uint64_t nRewind = blkdat.GetPos();
         while (!blkdat.eof()) {
-            boost::this_thread::interruption_point();
-
             blkdat.SetPos(nRewind);
             nRewind++; // start one byte further next time, in case of failure
             blkdat.SetLimit(); // remove former limit
@@ -3137,71 +3750,275 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                 // no valid block header found; don't complain
                 break;
             }
+            CImportBlock* pimport = new CImportBlock();
             try {
-                // read block
+                // read block, to be deserialized by a worker
                 uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
+                if (nFile >= 0)
+                    pimport->pos = CDiskBlockPos(nFile, nBlockPos);
                 blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
+                pimport->nSize = nSize;
+                pimport->vData.resize(nSize);
+                blkdat.read(&pimport->vData[0], nSize);
                 nRewind = blkdat.GetPos();
+            } catch (const std::exception &e) {
+                LogPrintf("%s : Deserialize or I/O error - %s\n", __func__, e.what());
+                delete pimport;
+                continue;
+            }
 
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                            block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
-                }
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fQuit && nReadAheadBytes > 0 && nReadAheadBytes + nSize > IMPORT_READ_AHEAD)
+                condScanner.wait(lock);
+            if (fQuit) {
+                delete pimport;
+                return;
+            }
+            nReadAheadBytes += nSize;
+            queueWork.push_back(std::make_pair(nNextSeq++, pimport));
+            condWorker.notify_one();
+        }
+    }
+
+    void ThreadScan()
+    {
+        RenameThread("bitcoin-loadblk-scan");
+        while (true) {
+            CImportFile importFile(NULL, -1);
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (fQuit || nNextFile == vFiles.size())
+                    break;
+                importFile = vFiles[nNextFile++];
+            }
+            FILE* file = importFile.file;
+            if (!file) {
+                file = OpenBlockFile(CDiskBlockPos(importFile.nFile, 0), true);
+                if (!file)
+                    break; // This error is logged in OpenBlockFile
+            }
+            if (importFile.nFile >= 0) {
+                // Let the import log it when it gets there, rather than when the scan does
+                CImportBlock* pmarker = new CImportBlock();
+                pmarker->pos = CDiskBlockPos(importFile.nFile, 0);
+                pmarker->fFileStart = true;
+                boost::unique_lock<boost::mutex> lock(mutex);
+                mapRead[nNextSeq++] = pmarker;
+                condMaster.notify_one();
+            }
+            try {
+                ScanFile(file, importFile.nFile);
+            } catch (const std::exception &e) {
+                LogPrintf("%s : I/O error - %s\n", __func__, e.what());
+            }
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fScanDone = true;
+        condMaster.notify_one();
+    }
+
+    void ThreadWork()
+    {
+        RenameThread("bitcoin-loadblk-check");
+        while (true) {
+            std::pair<uint64_t, CImportBlock*> work;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fQuit && queueWork.empty())
+                    condWorker.wait(lock);
+                if (fQuit)
+                    return;
+                work = queueWork.front();
+                queueWork.pop_front();
+            }
+
+            CImportBlock* pimport = work.second;
+            try {
+                CDataStream ss(pimport->vData, SER_DISK, CLIENT_VERSION);
+                ss >> pimport->block;
+                pimport->fValid = true;
+            } catch (const std::exception &e) {
+                LogPrintf("%s : Deserialize or I/O error - %s\n", __func__, e.what());
+            }
+            std::vector<char>().swap(pimport->vData);
+            if (pimport->fValid) {
+                pimport->hash = pimport->block.GetHash();
+                // The context-free checks; a block that passes is marked and not checked again when accepted
+                CValidationState state;
+                CheckBlock(pimport->block, state);
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            mapRead[work.first] = pimport;
+            condMaster.notify_one();
+        }
+    }
+
+public:
+    CBlockImportReader(const std::vector<CImportFile>& vFilesIn, int nThreads) :
+        vFiles(vFilesIn), nNextFile(0), nNextSeq(0), nTakeSeq(0), nReadAheadBytes(0),
+        fScanDone(false), fQuit(false)
+    {
+        threadGroup.create_thread(boost::bind(&CBlockImportReader::ThreadScan, this));
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CBlockImportReader::ThreadWork, this));
+    }
+
+    ~CBlockImportReader()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fQuit = true;
+            condScanner.notify_all();
+            condWorker.notify_all();
+        }
+        threadGroup.join_all();
+        for (size_t i = nNextFile; i < vFiles.size(); i++)
+            if (vFiles[i].file)
+                fclose(vFiles[i].file);
+        for (std::deque<std::pair<uint64_t, CImportBlock*> >::iterator it = queueWork.begin(); it != queueWork.end(); ++it)
+            delete it->second;
+        for (std::map<uint64_t, CImportBlock*>::iterator it = mapRead.begin(); it != mapRead.end(); ++it)
+            delete it->second;
+    }
+
+    //! Wait for the next block in file order; the caller owns the result. NULL once all files are done.
+    CImportBlock* Take()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        std::map<uint64_t, CImportBlock*>::iterator it;
+        while ((it = mapRead.find(nTakeSeq)) == mapRead.end()) {
+            if (fScanDone && nTakeSeq == nNextSeq)
+                return NULL;
+            condMaster.wait(lock);
+        }
+        CImportBlock* pimport = it->second;
+        mapRead.erase(it);
+        nTakeSeq++;
+        nReadAheadBytes -= pimport->nSize;
+        condScanner.notify_one();
+        return pimport;
+    }
+};
+
+} // anon namespace
+
+bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+{
+    return LoadExternalBlockFiles(std::vector<CImportFile>(1, CImportFile(fileIn, dbp ? dbp->nFile : -1)));
+}
+
+bool LoadExternalBlockFiles(const std::vector<CImportFile>& vFiles)
+{
+    // Blocks with unknown parent (only used for reindex), by parent hash. The
+    // most recent ones are kept in memory, the others are read again from disk.
+    static UnknownParentMap mapBlocksUnknownParent;
+    static uint64_t nUnknownParentBytes = 0;
+    int64_t nStart = GetTimeMillis();
+    int64_t nLastReport = nStart;
 
-                // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
-                    CValidationState state;
-                    if (ProcessNewBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                } else if (hash != Params().HashGenesisBlock() && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                    LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+    int nLoaded = 0;
+    int nRead = 0;
+    uint64_t nReadBytes = 0;
+    try {
+        int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency() - 1, MAX_IMPORT_THREADS));
+        CBlockImportReader reader(vFiles, nThreads);
+        while (true) {
+            boost::shared_ptr<CImportBlock> pimport(reader.Take());
+            if (!pimport)
+                break;
+            boost::this_thread::interruption_point();
+            if (pimport->fFileStart) {
+                LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)pimport->pos.nFile);
+                continue;
+            }
+
+            nRead++;
+            nReadBytes += pimport->nSize;
+            if (GetTimeMillis() - nLastReport > 10000) {
+                nLastReport = GetTimeMillis();
+                double dSeconds = 0.001 * (nLastReport - nStart);
+                int nHeight;
+                {
+                    LOCK(cs_main);
+                    nHeight = chainActive.Height();
+                }
+                LogPrintf("Block import: read %d blocks (%.1f MB, %.1f blocks/s, %.2f MB/s), loaded %d, height %d\n",
+                    nRead, nReadBytes * 0.000001, nRead / dSeconds, nReadBytes * 0.000001 / dSeconds, nLoaded, nHeight);
+            }
+            if (!pimport->fValid)
+                continue;
+
+            CBlock& block = pimport->block;
+            CDiskBlockPos* dbp = pimport->pos.IsNull() ? NULL : &pimport->pos;
+
+            // detect out of order blocks, and store them for later
+            uint256 hash = pimport->hash;
+            if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
+                LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                        block.hashPrevBlock.ToString());
+                if (dbp) {
+                    boost::shared_ptr<CImportBlock> pimportKeep;
+                    if (nUnknownParentBytes + pimport->nSize <= MAX_IMPORT_UNKNOWN_PARENT_CACHE) {
+                        pimportKeep = pimport;
+                        nUnknownParentBytes += pimport->nSize;
+                    }
+                    mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, std::make_pair(*dbp, pimportKeep)));
                 }
+                continue;
+            }
+
+            // process in case the block isn't known yet
+            if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+                CValidationState state;
+                if (ProcessNewBlock(state, NULL, &block, dbp))
+                    nLoaded++;
+                if (state.IsError())
+                    break;
+            } else if (hash != Params().HashGenesisBlock() && mapBlockIndex[hash]->nHeight % 1000 == 0) {
+                LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+            }
 
-                // Recursively process earlier encountered successors of this block
-                deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second))
+            // Recursively process earlier encountered successors of this block
+            deque<uint256> queue;
+            queue.push_back(hash);
+            while (!queue.empty()) {
+                uint256 head = queue.front();
+                queue.pop_front();
+                std::pair<UnknownParentMap::iterator, UnknownParentMap::iterator> range = mapBlocksUnknownParent.equal_range(head);
+                while (range.first != range.second) {
+                    UnknownParentMap::iterator it = range.first;
+                    boost::shared_ptr<CImportBlock> pchild = it->second.second;
+                    CBlock blockRead;
+                    CBlock* pblockChild = &blockRead;
+                    if (pchild) {
+                        nUnknownParentBytes -= pchild->nSize;
+                        pblockChild = &pchild->block;
+                    }
+                    if (pchild || ReadBlockFromDisk(blockRead, it->second.first))
+                    {
+                        LogPrintf("%s: Processing out of order child %s of %s\n", __func__, pblockChild->GetHash().ToString(),
+                                head.ToString());
+                        CValidationState dummy;
+                        if (ProcessNewBlock(dummy, NULL, pblockChild, &it->second.first))
                         {
-                            LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
-                                    head.ToString());
-                            CValidationState dummy;
-                            if (ProcessNewBlock(dummy, NULL, &block, &it->second))
-                            {
-                                nLoaded++;
-                                queue.push_back(block.GetHash());
-                            }
+                            nLoaded++;
+                            queue.push_back(pblockChild->GetHash());
                         }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
                     }
+                    range.first++;
+                    mapBlocksUnknownParent.erase(it);
                 }
-            } catch (std::exception &e) {
-                LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
             }
         }
     } catch(std::runtime_error &e) {
         AbortNode(std::string("System error: ") + e.what());
     }
-    if (nLoaded > 0)
-        LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
+    if (nLoaded > 0) {
+        int64_t nElapsed = std::max(GetTimeMillis() - nStart, (int64_t)1);
+        LogPrintf("Loaded %i blocks from external file in %dms (%.2f MB/s)\n", nLoaded, nElapsed, nReadBytes * 0.001 / nElapsed);
+    }
     return nLoaded > 0;
 }
 
@@ -3281,10 +4098,31 @@ bool static AlreadyHave(const CInv& inv)
     {
     case MSG_TX:
         {
-            bool txInMap = false;
-            txInMap = mempool.exists(inv.hash);
-            return txInMap || mapOrphanTransactions.count(inv.hash) ||
-                pcoinsTip->HaveCoins(inv.hash);
+            assert(recentRejects);
+            if (chainActive.Tip() && chainActive.Tip()->GetBlockHash() != hashRecentRejectsChainTip)
+            {
+                // If the chain tip has changed previously rejected transactions
+                // might be now valid, e.g. due to a nLockTime'd tx becoming valid,
+                // or a double-spend. Reset the rejects filter and give those
+                // txs a second chance.
+                hashRecentRejectsChainTip = chainActive.Tip()->GetBlockHash();
+                recentRejects->clear();
+                recentRejectsStats.nResets++;
+            }
+
+            if (recentRejects->contains(inv.hash)) {
+                recentRejectsStats.nFiltered++;
+                return true;
+            }
+
+            if (mempool.exists(inv.hash))
+                return true;
+            {
+                LOCK(cs_orphans);
+                if (mapOrphanTransactions.count(inv.hash))
+                    return true;
+            }
+            return pcoinsTip->HaveCoins(inv.hash);
         }
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash);
@@ -3333,6 +4171,17 @@ void static ProcessGetData(CNode* pfrom)
                         send = true;
                     }
                 }
+                // Disconnect the peer if we have reached the -maxuploadtarget budget we allow for
+                // serving historical blocks. Whitelisted peers are never disconnected.
+                static const int nOneWeek = 7 * 24 * 60 * 60; // blocks older than this are historical
+                if (send && CNode::OutboundTargetReached(MAX_BLOCK_SIZE) &&
+                    ((pindexBestHeader != NULL && pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > nOneWeek) || inv.type == MSG_FILTERED_BLOCK) &&
+                    !pfrom->fWhitelisted)
+                {
+                    LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+                    pfrom->fDisconnect = true;
+                    send = false;
+                }
                 if (send)
                 {
                     // Send block from disk
@@ -3368,10 +4217,11 @@ void static ProcessGetData(CNode* pfrom)
                     {
                         // Bypass PushInventory, this must send even if redundant,
                         // and we want it right after the last block so they don't
-                        // wait for other stuff first.
+                        // wait for other stuff first. Queue it with the blocks so
+                        // it can't overtake them.
                         vector<CInv> vInv;
                         vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
-                        pfrom->PushMessage("inv", vInv);
+                        pfrom->PushBulkMessage("inv", vInv);
                         pfrom->hashContinue = 0;
                     }
                 }
@@ -3662,8 +4512,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             bool fAlreadyHave = AlreadyHave(inv);
             LogPrint("net", "got inv: %s  %s peer=%d\n", inv.ToString(), fAlreadyHave ? "have" : "new", pfrom->id);
 
-            if (!fAlreadyHave && !fImporting && !fReindex && inv.type != MSG_BLOCK)
-                pfrom->AskFor(inv);
+            if (inv.type != MSG_BLOCK) {
+                // In blocks-only mode we told the peer not to relay transactions
+                // to us; whitelisted peers are still allowed to feed us theirs.
+                if (!fRelayTxes && !pfrom->fWhitelisted)
+                    LogPrint("net", "transaction (%s) inv sent in violation of protocol peer=%d\n", inv.hash.ToString(), pfrom->id);
+                else if (!fAlreadyHave && !fImporting && !fReindex)
+                    pfrom->AskFor(inv);
+            }
 
             if (inv.type == MSG_BLOCK) {
                 UpdateBlockAvailability(pfrom->GetId(), inv.hash);
@@ -3799,6 +4655,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == "tx")
     {
+        // Stop processing the transaction early if we are in blocks-only
+        // mode and the peer is not whitelisted.
+        if (!fRelayTxes && !pfrom->fWhitelisted)
+        {
+            LogPrint("net", "transaction sent in violation of protocol peer=%d\n", pfrom->id);
+            return true;
+        }
+
         vector<uint256> vWorkQueue;
         vector<uint256> vEraseQueue;
         CTransaction tx;
@@ -3827,6 +4691,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 mempool.mapTx.size());
 
             // Recursively process any orphan transactions that depended on this one
+            LOCK(cs_orphans);
             set<NodeId> setMisbehaving;
             for (unsigned int i = 0; i < vWorkQueue.size(); i++)
             {
@@ -3868,6 +4733,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                         }
                         // too-little-fee orphan
                         LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                        recentRejects->insert(orphanHash);
+                        recentRejectsStats.nInserted++;
                     }
                     mempool.check(pcoinsTip);
                 }
@@ -3885,11 +4752,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
             if (nEvicted > 0)
                 LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        } else if (pfrom->fWhitelisted) {
-            // Always relay transactions received from whitelisted peers, even
-            // if they are already in the mempool (allowing the node to function
-            // as a gateway for nodes hidden behind it).
-            RelayTransaction(tx);
+        } else {
+            // AcceptToMemoryPool() returned false, possibly because the tx is
+            // already in the mempool; if the tx isn't in the mempool that
+            // means it was rejected and we shouldn't ask for it again.
+            if (!mempool.exists(tx.GetHash())) {
+                recentRejects->insert(tx.GetHash());
+                recentRejectsStats.nInserted++;
+            }
+            if (pfrom->fWhitelisted) {
+                // Always relay transactions received from whitelisted peers, even
+                // if they are already in the mempool (allowing the node to function
+                // as a gateway for nodes hidden behind it).
+                RelayTransaction(tx);
+            }
         }
         int nDoS = 0;
         if (state.IsInvalid(nDoS))
@@ -3973,10 +4849,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (state.IsInvalid(nDoS)) {
             pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
                                state.GetRejectReason(), inv.hash);
-            if (nDoS > 0) {
-                LOCK(cs_main);
+            if (nDoS > 0)
                 Misbehaving(pfrom->GetId(), nDoS);
-            }
         }
 
     }
@@ -4174,6 +5048,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == "feefilter")
+    {
+        CAmount newFeeFilter = 0;
+        vRecv >> newFeeFilter;
+        if (MoneyRange(newFeeFilter)) {
+            {
+                LOCK(pfrom->cs_feeFilter);
+                pfrom->minFeeFilter = newFeeFilter;
+            }
+            LogPrint("net", "received: feefilter of %s from peer=%d\n", CFeeRate(newFeeFilter).ToString(), pfrom->id);
+        }
+    }
+
+
     else if (strCommand == "reject")
     {
         if (fDebug) {
@@ -4372,6 +5260,30 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
         }
 
+        // Bans only need cs_misbehavior, so they are not held up by validation
+        bool fShouldBan = false;
+        {
+            LOCK(cs_misbehavior);
+            map<NodeId, CNodeMisbehavior>::iterator it = mapNodeMisbehavior.find(pto->GetId());
+            if (it != mapNodeMisbehavior.end() && it->second.fShouldBan) {
+                fShouldBan = true;
+                it->second.fShouldBan = false;
+            }
+        }
+        if (fShouldBan) {
+            if (pto->fWhitelisted)
+                LogPrintf("Warning: not punishing whitelisted peer %s!\n", pto->addr.ToString());
+            else {
+                pto->fDisconnect = true;
+                if (pto->addr.IsLocal())
+                    LogPrintf("Warning: not banning local peer %s!\n", pto->addr.ToString());
+                else
+                {
+                    CNode::Ban(pto->addr);
+                }
+            }
+        }
+
         TRY_LOCK(cs_main, lockMain); // Acquire cs_main for IsInitialBlockDownload() and CNodeState()
         if (!lockMain)
             return true;
@@ -4421,20 +5333,6 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         }
 
         CNodeState &state = *State(pto->GetId());
-        if (state.fShouldBan) {
-            if (pto->fWhitelisted)
-                LogPrintf("Warning: not punishing whitelisted peer %s!\n", pto->addr.ToString());
-            else {
-                pto->fDisconnect = true;
-                if (pto->addr.IsLocal())
-                    LogPrintf("Warning: not banning local peer %s!\n", pto->addr.ToString());
-                else
-                {
-                    CNode::Ban(pto->addr);
-                }
-            }
-            state.fShouldBan = false;
-        }
 
         BOOST_FOREACH(const CBlockReject& reject, state.rejects)
             pto->PushMessage("reject", (string)"block", reject.chRejectCode, reject.strRejectReason, reject.hashBlock);
@@ -4469,6 +5367,12 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         vector<CInv> vInv;
         vector<CInv> vInvWait;
         {
+            CFeeRate filterrate;
+            {
+                LOCK(pto->cs_feeFilter);
+                filterrate = CFeeRate(pto->minFeeFilter);
+            }
+
             LOCK(pto->cs_inventory);
             vInv.reserve(pto->vInventoryToSend.size());
             vInvWait.reserve(pto->vInventoryToSend.size());
@@ -4477,6 +5381,13 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 if (pto->setInventoryKnown.count(inv))
                     continue;
 
+                // Don't announce transactions the peer told us it would drop anyway
+                if (inv.type == MSG_TX && filterrate.GetFeePerK() > 0) {
+                    CFeeRate txrate;
+                    if (mempool.lookupFeeRate(inv.hash, txrate) && txrate < filterrate)
+                        continue;
+                }
+
                 // trickle out tx inv to protect privacy
                 if (inv.type == MSG_TX && !fSendTrickle)
                 {
@@ -4511,6 +5422,17 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
 
+        //
+        // Message: feefilter
+        //
+        if (pto->nVersion >= FEEFILTER_VERSION && fRelayTxes && GetBoolArg("-feefilter", DEFAULT_FEEFILTER)) {
+            CAmount currentFilter = ::minRelayTxFee.GetFeePerK();
+            if (currentFilter != pto->lastSentFeeFilter) {
+                pto->PushMessage("feefilter", currentFilter);
+                pto->lastSentFeeFilter = currentFilter;
+            }
+        }
+
         // Detect whether we're stalling
         int64_t nNow = GetTimeMicros();
         if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
@@ -4525,10 +5447,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && fFetch && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        if (!pto->fDisconnect && !pto->fClient && fFetch && state.nBlocksInFlight < state.nBlocksInFlightLimit) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            CBlockIndex *pindexStalling = NULL;
+            FindNextBlocksToDownload(pto->GetId(), state.nBlocksInFlightLimit - state.nBlocksInFlight, vToDownload, staller, pindexStalling);
             BOOST_FOREACH(CBlockIndex *pindex, vToDownload) {
                 vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), pindex);
@@ -4536,8 +5459,19 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     pindex->nHeight, pto->id);
             }
             if (state.nBlocksInFlight == 0 && staller != -1) {
-                if (State(staller)->nStallingSince == 0) {
-                    State(staller)->nStallingSince = nNow;
+                CNodeState *stateStaller = State(staller);
+                // If we are measurably faster than the peer holding up the window, and that block has
+                // already been outstanding longer than it would take us, fetch it from us instead.
+                const QueuedBlock &queued = *mapBlocksInFlight[pindexStalling->GetBlockHash()].second;
+                if (state.nBlockServiceTime > 0 &&
+                    (stateStaller->nBlockServiceTime == 0 || state.nBlockServiceTime * 2 < stateStaller->nBlockServiceTime) &&
+                    nNow - queued.nTime > 2 * state.nBlockLatency) {
+                    LogPrint("net", "Reassigning stalled block %s (%d) from peer=%d to peer=%d\n", pindexStalling->GetBlockHash().ToString(),
+                        pindexStalling->nHeight, staller, pto->id);
+                    vGetData.push_back(CInv(MSG_BLOCK, pindexStalling->GetBlockHash()));
+                    MarkBlockAsInFlight(pto->GetId(), pindexStalling->GetBlockHash(), pindexStalling);
+                } else if (stateStaller->nStallingSince == 0) {
+                    stateStaller->nStallingSince = nNow;
                     LogPrint("net", "Stall started peer=%d\n", staller);
                 }
             }
@@ -4647,6 +5581,7 @@ public:
         mapBlockIndex.clear();
 
         // orphan transactions
+        LOCK(cs_orphans);
         mapOrphanTransactions.clear();
         mapOrphanTransactionsByPrev.clear();
     }
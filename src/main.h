@@ -16,6 +16,7 @@
 #include "coins.h"
 #include "core/block.h"
 #include "core/transaction.h"
+#include "crypto/common.h"
 #include "net.h"
 #include "pow.h"
 #include "script/script.h"
@@ -48,6 +49,7 @@ class CValidationState;
 
 struct CBlockTemplate;
 struct CNodeStateStats;
+struct CRecentRejectsStats;
 
 /** The maximum allowed size for a serialized block, in bytes (network rule) */
 static const unsigned int MAX_BLOCK_SIZE = 1000000;
@@ -76,14 +78,29 @@ static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 /** Coinbase transaction outputs can only be spent after this number of new blocks (network rule) */
 static const int COINBASE_MATURITY = 100;
+/** Number of transaction index entries the background -txindex build collects per database write */
+static const unsigned int TXINDEX_SYNC_BATCH_SIZE = 200000;
 /** Threshold for nLockTime: below this value it is interpreted as block number, otherwise as UNIX timestamp. */
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
-static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Maximum number of threads deserializing and checking blocks during -reindex and -loadblock */
+static const int MAX_IMPORT_THREADS = 8;
+/** Bytes of block data an import may read ahead of the block being added to the index */
+static const unsigned int IMPORT_READ_AHEAD = 64 * 1024 * 1024;
+/** Bytes of blocks read ahead of their parent during -reindex that are kept in memory instead of being read again */
+static const unsigned int MAX_IMPORT_UNKNOWN_PARENT_CACHE = 32 * 1024 * 1024;
+/** Queued wallet notifications above which block connection waits for the notification thread to catch up */
+static const unsigned int MAX_QUEUED_VALIDATION_NOTIFICATIONS = 100;
+/** Number of blocks that can be requested at any given time from a single peer, before its download speed is known. */
+static const int DEFAULT_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds for the adaptive number of blocks that can be requested at any given time from a single peer. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 64;
+/** Amount of block download work, in microseconds at the peer's measured speed, we try to keep queued at each peer. */
+static const int64_t BLOCK_DOWNLOAD_TARGET_QUEUE_TIME = 4 * 1000000;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -111,6 +128,7 @@ struct BlockHasher
 };
 
 extern CScript COINBASE_FLAGS;
+/** Protects the block index, the active chain and coins; see main.cpp for the lock order */
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
 typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
@@ -123,8 +141,11 @@ extern CWaitableCriticalSection csBestBlock;
 extern CConditionVariable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
+extern bool fReindexChainState;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
+extern bool fTxIndexSynced;
+extern bool fAddressIndex;
 extern bool fIsBareMultisigStd;
 extern unsigned int nCoinCacheSize;
 extern CFeeRate minRelayTxFee;
@@ -143,6 +164,16 @@ void UnregisterValidationInterface(CValidationInterface* pwalletIn);
 void UnregisterAllValidationInterfaces();
 /** Push an updated transaction to all registered wallets */
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL);
+/** Push the transactions of a connected or disconnected block to all registered wallets at once */
+void SyncWithWallets(const std::vector<CTransaction>& vtx, const CBlock* pblock);
+/** Queue wallet notifications from now on instead of delivering them inline; call before starting ThreadValidationNotifications */
+void StartValidationNotifications();
+/** Deliver queued wallet notifications in order; runs until interrupted */
+void ThreadValidationNotifications();
+/** Wait until the notifications queued before this call have reached the wallets. Must not be called with cs_main held. */
+void SyncWithValidationNotifications();
+/** Deliver whatever is still queued on the calling thread (at shutdown, once the notification thread has stopped) */
+void FlushValidationNotifications();
 
 /** Register with a network node to receive its signals */
 void RegisterNodeSignals(CNodeSignals& nodeSignals);
@@ -169,6 +200,21 @@ FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/** A file to import blocks from with LoadExternalBlockFiles */
+struct CImportFile
+{
+    FILE* file;  //!< opened file, or NULL to open block file nFile once it is reached
+    int nFile;   //!< number of the block file, when reindexing our own (-1 for an external file)
+
+    CImportFile(FILE* fileIn, int nFileIn) : file(fileIn), nFile(nFileIn) {}
+};
+/**
+ * Import blocks from several files, in order. Scanning the files and
+ * deserializing and checking their blocks is done ahead by background
+ * threads; only adding blocks to the index and connecting them happens on
+ * the calling thread. Takes over (and closes) the given files.
+ */
+bool LoadExternalBlockFiles(const std::vector<CImportFile>& vFiles);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
@@ -183,6 +229,10 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Turn the transaction index on or off for an already initialized block database. The index starts out incomplete, see ThreadTxIndexSync. */
+bool SetTxIndex(bool fEnable);
+/** Index the transactions of blocks connected while -txindex was off, until the index catches up with the tip */
+void ThreadTxIndexSync();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Format a string that describes several potential problems detected by the core */
@@ -199,7 +249,9 @@ CBlockIndex * InsertBlockIndex(uint256 hash);
 bool AbortNode(const std::string &msg, const std::string &userMessage="");
 /** Get statistics from node state */
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
-/** Increase a node's misbehavior score. */
+/** Get statistics about the recently-rejected transaction filter */
+void GetRecentRejectsStats(CRecentRejectsStats &stats);
+/** Increase a node's misbehavior score. Does not require cs_main. */
 void Misbehaving(NodeId nodeid, int howmuch);
 
 
@@ -213,6 +265,18 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    double dBlockLatency;
+    int64_t nBlockBytesPerSec;
+    int nBlocksInFlightLimit;
+};
+
+/** Counters for the filter of transactions recently rejected by AcceptToMemoryPool. */
+struct CRecentRejectsStats {
+    uint64_t nInserted;  //! Rejected txids added to the filter
+    uint64_t nFiltered;  //! Announcements answered from the filter instead of being downloaded and revalidated
+    uint64_t nResets;    //! Times the filter was cleared because the chain tip changed
+
+    CRecentRejectsStats() : nInserted(0), nFiltered(0), nResets(0) {}
 };
 
 struct CDiskTxPos : public CDiskBlockPos
@@ -240,6 +304,89 @@ struct CDiskTxPos : public CDiskBlockPos
     }
 };
 
+/**
+ * Key of an -addressindex entry: an output paying to a script, or an input
+ * spending such an output. Scripts are identified by the Hash160 of their
+ * scriptPubKey, and a script's entries sort by height, then transaction.
+ */
+struct CAddressIndexKey
+{
+    uint160 hashScript;
+    int nHeight;
+    uint256 txid;
+    unsigned int nIndex; //! output index, or input index for a spend
+    bool fSpend;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(hashScript);
+        // Big endian, so the database's byte order is height order
+        unsigned char pchHeight[4];
+        if (!ser_action.ForRead())
+            WriteBE32(pchHeight, nHeight);
+        READWRITE(FLATDATA(pchHeight));
+        if (ser_action.ForRead())
+            nHeight = ReadBE32(pchHeight);
+        READWRITE(txid);
+        READWRITE(nIndex);
+        READWRITE(fSpend);
+    }
+
+    CAddressIndexKey() : nHeight(0), nIndex(0), fSpend(false) {}
+    CAddressIndexKey(const uint160& hashScriptIn, int nHeightIn, const uint256& txidIn, unsigned int nIndexIn, bool fSpendIn) :
+        hashScript(hashScriptIn), nHeight(nHeightIn), txid(txidIn), nIndex(nIndexIn), fSpend(fSpendIn) {}
+};
+
+/** Value of an -addressindex entry; prevout is only set for spends */
+struct CAddressIndexValue
+{
+    CAmount nValue;
+    COutPoint prevout;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(nValue);
+        READWRITE(prevout);
+    }
+
+    CAddressIndexValue() : nValue(0) {}
+    CAddressIndexValue(CAmount nValueIn, const COutPoint& prevoutIn) : nValue(nValueIn), prevout(prevoutIn) {}
+};
+
+/** The input that spent an output, kept by -addressindex for each spent outpoint */
+struct CSpentIndexValue
+{
+    uint256 txid;
+    unsigned int nIndex;
+    int nHeight;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(txid);
+        READWRITE(VARINT(nIndex));
+        READWRITE(VARINT(nHeight));
+    }
+
+    CSpentIndexValue() : nIndex(0), nHeight(0) {}
+    CSpentIndexValue(const uint256& txidIn, unsigned int nIndexIn, int nHeightIn) : txid(txidIn), nIndex(nIndexIn), nHeight(nHeightIn) {}
+};
+
+/**
+ * Read about nCount -addressindex entries for a script, in height order,
+ * starting after the transaction txidAfter at height nAfterHeight (-1 to
+ * start at the first entry). A transaction's entries are not split across
+ * reads, so more than nCount can be returned.
+ */
+bool GetAddressIndex(const uint160& hashScript, int nAfterHeight, const uint256& txidAfter, unsigned int nCount, std::vector<std::pair<CAddressIndexKey, CAddressIndexValue> >& vEntries);
+/** Find the input that spent an output, if -addressindex is enabled and it has been spent */
+bool GetSpentIndex(const COutPoint& outpoint, CSpentIndexValue& value);
+
 
 CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowFree);
 
@@ -453,8 +600,9 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
  *  In case pfClean is provided, operation will try to be tolerant about errors, and *pfClean
  *  will be true if no problems were found. Otherwise, the return value will be false in case
- *  of problems. Note that in any case, coins may be modified. */
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
+ *  of problems. Note that in any case, coins may be modified. The block's -addressindex
+ *  entries are removed unless fUpdateIndexes is false (for a trial disconnect). */
+bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL, bool fUpdateIndexes = true);
 
 // Apply the effects of this block (with given index) on the UTXO set represented by coins
 bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck = false);
@@ -601,6 +749,9 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 /** The currently-connected chain of blocks. */
 extern CChain chainActive;
 
+/** Snapshot of chainActive as of its last tip change; does not require cs_main. */
+CChainSnapshot GetActiveChainSnapshot();
+
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
@@ -650,8 +801,16 @@ public:
 
 
 class CValidationInterface {
+public:
+    virtual ~CValidationInterface() {}
 protected:
     virtual void SyncTransaction(const CTransaction &tx, const CBlock *pblock) {};
+    virtual void SyncTransactions(const std::vector<CTransaction> &vtx, const CBlock *pblock) {
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            SyncTransaction(vtx[i], pblock);
+    };
+    virtual void TransactionAddedToMempool(const CTransaction &tx) {};
+    virtual void BlockConnected(const CBlock &block) {};
     virtual void EraseFromWallet(const uint256 &hash) {};
     virtual void SetBestChain(const CBlockLocator &locator) {};
     virtual void UpdatedTransaction(const uint256 &hash) {};
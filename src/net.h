@@ -6,6 +6,7 @@
 #ifndef BITCOIN_NET_H
 #define BITCOIN_NET_H
 
+#include "amount.h"
 #include "bloom.h"
 #include "compat.h"
 #include "hash.h"
@@ -46,6 +47,14 @@ static const int TIMEOUT_INTERVAL = 20 * 60;
 static const unsigned int MAX_INV_SZ = 50000;
 /** -listen default */
 static const bool DEFAULT_LISTEN = true;
+/** -maxuploadtarget default (MiB per 24h, 0 = unlimited) */
+static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
+/** Length of an upload budget cycle, in seconds */
+static const uint64_t MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
+/** -feefilter default */
+static const bool DEFAULT_FEEFILTER = true;
+/** -blocksonly default */
+static const bool DEFAULT_BLOCKSONLY = false;
 /** -upnp default */
 #ifdef USE_UPNP
 static const bool DEFAULT_UPNP = USE_UPNP;
@@ -118,6 +127,8 @@ CAddress GetLocalAddress(const CNetAddr *paddrPeer = NULL);
 
 extern bool fDiscover;
 extern bool fListen;
+/** Whether we ask peers to relay transactions to us (false in -blocksonly mode) */
+extern bool fRelayTxes;
 extern uint64_t nLocalServices;
 extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
@@ -163,6 +174,7 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    CAmount minFeeFilter;
 };
 
 
@@ -218,10 +230,16 @@ public:
     uint64_t nServices;
     SOCKET hSocket;
     CDataStream ssSend;
-    size_t nSendSize; // total size of all vSendMsg entries
-    size_t nSendOffset; // offset inside the first vSendMsg already sent
+    size_t nSendSize; // total size of all vSendMsg and vSendMsgBulk entries
+    size_t nSendOffset; // offset inside the message currently being sent
     uint64_t nSendBytes;
+    // Outgoing messages are queued by priority: control, header and inventory
+    // messages in vSendMsg are sent ahead of bulk block data in vSendMsgBulk,
+    // except that a message that is partially sent is always finished first.
     std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializeData> vSendMsgBulk;
+    bool fSendingBulk; // whether the message being sent is the front of vSendMsgBulk
+    bool fSendBulk; // whether the message being assembled in ssSend is bulk data
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -300,6 +318,13 @@ public:
     // Whether a ping is requested.
     bool fPingQueued;
 
+    // Fee filtering of relayed transactions:
+    // Minimum fee rate (satoshis per 1000 bytes) the peer asked us to relay to it.
+    CAmount minFeeFilter;
+    CCriticalSection cs_feeFilter;
+    // Last fee filter we announced to the peer.
+    CAmount lastSentFeeFilter;
+
     CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false);
     ~CNode();
 
@@ -310,6 +335,12 @@ private:
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
 
+    // Upload budget (-maxuploadtarget), protected by cs_totalBytesSent
+    static uint64_t nMaxOutboundTotalBytesSentInCycle;
+    static uint64_t nMaxOutboundCycleStartTime;
+    static uint64_t nMaxOutboundLimit;
+    static uint64_t nMaxOutboundTimeframe;
+
     CNode(const CNode&);
     void operator=(const CNode&);
 
@@ -434,6 +465,24 @@ public:
         }
     }
 
+    //! Queue a message behind the bulk block data already queued, to keep it in order with those blocks
+    template<typename T1>
+    void PushBulkMessage(const char* pszCommand, const T1& a1)
+    {
+        try
+        {
+            BeginMessage(pszCommand);
+            fSendBulk = true;
+            ssSend << a1;
+            EndMessage();
+        }
+        catch (...)
+        {
+            AbortMessage();
+            throw;
+        }
+    }
+
     template<typename T1, typename T2>
     void PushMessage(const char* pszCommand, const T1& a1, const T2& a2)
     {
@@ -595,6 +644,24 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    //! Set the upload budget in bytes per timeframe (0 = unlimited)
+    static void SetMaxOutboundTarget(uint64_t limit);
+    static uint64_t GetMaxOutboundTarget();
+
+    //! Length of an upload budget cycle in seconds
+    static uint64_t GetMaxOutboundTimeframe();
+
+    //! Check whether the upload budget for this cycle is used up. If
+    //! nReserveBlockSize is set, enough budget is held back to relay a block
+    //! of that size every 10 minutes for the rest of the cycle.
+    static bool OutboundTargetReached(unsigned int nReserveBlockSize = 0);
+
+    //! Bytes left in the current cycle; 0 if unlimited
+    static uint64_t GetOutboundTargetBytesLeft();
+
+    //! Seconds left in the current cycle; 0 if unlimited
+    static uint64_t GetMaxOutboundTimeLeftInCycle();
 };
 
 
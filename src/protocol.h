@@ -66,6 +66,10 @@ public:
 /** nServices flags */
 enum {
     NODE_NETWORK = (1 << 0),
+    // NODE_BLOOM means the node is capable and willing to handle bloom-filtered
+    // connections (BIP 111). Bitcoin Core nodes always did so before protocol
+    // version 70011, and this one still does, so it is always advertised.
+    NODE_BLOOM = (1 << 2),
 
     // Bits 24-31 are reserved for temporary experiments. Just pick a bit that
     // isn't getting used, or one not being used much, and notify the
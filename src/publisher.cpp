@@ -0,0 +1,350 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "publisher.h"
+
+#include "core/block.h"
+#include "core/transaction.h"
+#include "netbase.h"
+#include "streams.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "version.h"
+
+#ifndef WIN32
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+const char* GetPublishTopicName(PublishTopic topic)
+{
+    switch (topic)
+    {
+    case PUB_HASHBLOCK: return "hashblock";
+    case PUB_HASHTX: return "hashtx";
+    case PUB_RAWBLOCK: return "rawblock";
+    case PUB_RAWTX: return "rawtx";
+    case PUB_TOPIC_COUNT: break;
+    }
+    return NULL;
+}
+
+/** Serialize obj as the body of a message, without building the body separately first */
+template <typename T>
+static boost::shared_ptr<const CSerializeData> MakeMessage(PublishTopic topic, const T& obj, uint32_t nSequence)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << std::string(GetPublishTopicName(topic));
+    WriteCompactSize(ss, ::GetSerializeSize(obj, SER_NETWORK, PROTOCOL_VERSION));
+    ss << obj << nSequence;
+    return boost::shared_ptr<const CSerializeData>(new CSerializeData(ss.begin(), ss.end()));
+}
+
+/** Write as much of the subscriber's queue as the socket takes without blocking; false if it has gone away */
+static bool SubscriberSend(SOCKET hSocket, std::deque<boost::shared_ptr<const CSerializeData> >& vSend, size_t& nSendOffset, size_t& nSendSize)
+{
+    while (!vSend.empty()) {
+        const CSerializeData& data = *vSend.front();
+        int nBytes = send(hSocket, &data[nSendOffset], data.size() - nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (nBytes < 0) {
+            int nErr = WSAGetLastError();
+            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
+                LogPrint("publish", "subscriber send error %s\n", NetworkErrorString(nErr));
+                return false;
+            }
+            break;
+        }
+        nSendOffset += nBytes;
+        if (nSendOffset < data.size())
+            break;
+        nSendOffset = 0;
+        nSendSize -= data.size();
+        vSend.pop_front();
+    }
+    return true;
+}
+
+CPublisher::CPublisher()
+{
+    for (int i = 0; i < PUB_TOPIC_COUNT; i++)
+        nSequence[i] = 0;
+}
+
+CPublisher::~CPublisher()
+{
+    LOCK(cs);
+    BOOST_FOREACH(CSubscriber& subscriber, vSubscribers)
+        CloseSocket(subscriber.hSocket);
+    vSubscribers.clear();
+    BOOST_FOREACH(CListener& listener, vListeners) {
+        CloseSocket(listener.hSocket);
+#ifndef WIN32
+        if (!listener.strUnixPath.empty())
+            unlink(listener.strUnixPath.c_str());
+#endif
+    }
+    vListeners.clear();
+}
+
+bool CPublisher::Listen(PublishTopic topic, const std::string& strAddr, std::string& strError)
+{
+    LOCK(cs);
+    BOOST_FOREACH(CListener& listener, vListeners) {
+        if (listener.strAddr == strAddr) {
+            listener.nTopics |= 1 << topic;
+            LogPrintf("Publishing %s on %s\n", GetPublishTopicName(topic), strAddr);
+            return true;
+        }
+    }
+
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    std::string strUnixPath;
+    if (boost::starts_with(strAddr, "unix:")) {
+#ifdef WIN32
+        strError = strprintf(_("Unix sockets are not supported on this platform: %s"), strAddr);
+        return false;
+#else
+        strUnixPath = strAddr.substr(5);
+        struct sockaddr_un* paddr = (struct sockaddr_un*)&sockaddr;
+        if (strUnixPath.empty() || strUnixPath.size() >= sizeof(paddr->sun_path)) {
+            strError = strprintf(_("Invalid socket path: %s"), strAddr);
+            return false;
+        }
+        paddr->sun_family = AF_UNIX;
+        memcpy(paddr->sun_path, strUnixPath.c_str(), strUnixPath.size());
+        len = sizeof(struct sockaddr_un);
+        // Remove a socket left behind by an earlier run, but nothing else
+        struct stat st;
+        if (lstat(strUnixPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+            unlink(strUnixPath.c_str());
+#endif
+    } else {
+        CService addr;
+        if (!Lookup(strAddr.c_str(), addr, 0, false) || addr.GetPort() == 0 ||
+            !addr.GetSockAddr((struct sockaddr*)&sockaddr, &len)) {
+            strError = strprintf(_("Invalid address to publish on: %s"), strAddr);
+            return false;
+        }
+    }
+
+    SOCKET hSocket = socket(((struct sockaddr*)&sockaddr)->sa_family, SOCK_STREAM, strUnixPath.empty() ? IPPROTO_TCP : 0);
+    if (hSocket == INVALID_SOCKET) {
+        strError = strprintf(_("Couldn't open socket to publish on %s (socket returned error %s)"), strAddr, NetworkErrorString(WSAGetLastError()));
+        return false;
+    }
+#ifndef WIN32
+    int nOne = 1;
+#ifdef SO_NOSIGPIPE
+    setsockopt(hSocket, SOL_SOCKET, SO_NOSIGPIPE, (void*)&nOne, sizeof(int));
+#endif
+    if (strUnixPath.empty())
+        setsockopt(hSocket, SOL_SOCKET, SO_REUSEADDR, (void*)&nOne, sizeof(int));
+#endif
+    if (!SetSocketNonBlocking(hSocket, true) ||
+        ::bind(hSocket, (struct sockaddr*)&sockaddr, len) == SOCKET_ERROR ||
+        listen(hSocket, SOMAXCONN) == SOCKET_ERROR) {
+        strError = strprintf(_("Unable to publish on %s (error %s)"), strAddr, NetworkErrorString(WSAGetLastError()));
+        CloseSocket(hSocket);
+        return false;
+    }
+
+    CListener listener;
+    listener.hSocket = hSocket;
+    listener.nTopics = 1 << topic;
+    listener.strAddr = strAddr;
+    listener.strUnixPath = strUnixPath;
+    vListeners.push_back(listener);
+    LogPrintf("Publishing %s on %s\n", GetPublishTopicName(topic), strAddr);
+    return true;
+}
+
+void CPublisher::Send(PublishTopic topic, const boost::shared_ptr<const CSerializeData>& msg)
+{
+    LOCK(cs);
+    for (unsigned int i = 0; i < vSubscribers.size(); i++) {
+        CSubscriber& subscriber = vSubscribers[i];
+        if (!(subscriber.nTopics & (1 << topic)))
+            continue;
+        if (subscriber.nSendSize + msg->size() > MAX_PUBLISH_BUFFER) {
+            if (subscriber.nDropped++ == 0)
+                LogPrintf("Subscriber on socket %d is falling behind, dropping messages\n", (int)subscriber.hSocket);
+            continue;
+        }
+        subscriber.vSend.push_back(msg);
+        subscriber.nSendSize += msg->size();
+        // Start writing straight away instead of waiting for the next select()
+        if (subscriber.vSend.size() == 1 &&
+            !SubscriberSend(subscriber.hSocket, subscriber.vSend, subscriber.nSendOffset, subscriber.nSendSize)) {
+            CloseSocket(subscriber.hSocket);
+            vSubscribers.erase(vSubscribers.begin() + i);
+            i--;
+        }
+    }
+}
+
+void CPublisher::PublishTransaction(const CTransaction& tx)
+{
+    uint32_t nHashSeq, nRawSeq;
+    unsigned int nWanted = 0;
+    {
+        LOCK(cs);
+        nHashSeq = nSequence[PUB_HASHTX]++;
+        nRawSeq = nSequence[PUB_RAWTX]++;
+        BOOST_FOREACH(const CSubscriber& subscriber, vSubscribers)
+            nWanted |= subscriber.nTopics;
+    }
+    if (nWanted & (1 << PUB_HASHTX))
+        Send(PUB_HASHTX, MakeMessage(PUB_HASHTX, tx.GetHash(), nHashSeq));
+    if (nWanted & (1 << PUB_RAWTX))
+        Send(PUB_RAWTX, MakeMessage(PUB_RAWTX, tx, nRawSeq));
+}
+
+void CPublisher::PublishBlock(const CBlock& block)
+{
+    uint32_t nHashSeq, nRawSeq;
+    unsigned int nWanted = 0;
+    {
+        LOCK(cs);
+        nHashSeq = nSequence[PUB_HASHBLOCK]++;
+        nRawSeq = nSequence[PUB_RAWBLOCK]++;
+        BOOST_FOREACH(const CSubscriber& subscriber, vSubscribers)
+            nWanted |= subscriber.nTopics;
+    }
+    if (nWanted & (1 << PUB_HASHBLOCK))
+        Send(PUB_HASHBLOCK, MakeMessage(PUB_HASHBLOCK, block.GetHash(), nHashSeq));
+    if (nWanted & (1 << PUB_RAWBLOCK))
+        Send(PUB_RAWBLOCK, MakeMessage(PUB_RAWBLOCK, block, nRawSeq));
+}
+
+void CPublisher::TransactionAddedToMempool(const CTransaction& tx)
+{
+    PublishTransaction(tx);
+}
+
+void CPublisher::BlockConnected(const CBlock& block)
+{
+    PublishBlock(block);
+}
+
+size_t CPublisher::GetSubscriberCount() const
+{
+    LOCK(cs);
+    return vSubscribers.size();
+}
+
+void CPublisher::AcceptSubscribers(const fd_set& fdsetRecv)
+{
+    LOCK(cs);
+    BOOST_FOREACH(const CListener& listener, vListeners) {
+        if (!FD_ISSET(listener.hSocket, &fdsetRecv))
+            continue;
+        struct sockaddr_storage sockaddr;
+        socklen_t len = sizeof(sockaddr);
+        SOCKET hSocket = accept(listener.hSocket, (struct sockaddr*)&sockaddr, &len);
+        if (hSocket == INVALID_SOCKET) {
+            int nErr = WSAGetLastError();
+            if (nErr != WSAEWOULDBLOCK)
+                LogPrintf("subscriber accept failed: %s\n", NetworkErrorString(nErr));
+            continue;
+        }
+#ifndef WIN32
+        // select() can't watch descriptors past FD_SETSIZE
+        if (hSocket >= FD_SETSIZE) {
+            LogPrintf("subscriber refused, too many open sockets\n");
+            CloseSocket(hSocket);
+            continue;
+        }
+#endif
+        if (!SetSocketNonBlocking(hSocket, true)) {
+            CloseSocket(hSocket);
+            continue;
+        }
+        CSubscriber subscriber;
+        subscriber.hSocket = hSocket;
+        subscriber.nTopics = listener.nTopics;
+        subscriber.nSendOffset = 0;
+        subscriber.nSendSize = 0;
+        subscriber.nDropped = 0;
+        vSubscribers.push_back(subscriber);
+        LogPrint("publish", "accepted subscriber on %s\n", listener.strAddr);
+    }
+}
+
+void CPublisher::ServeSubscribers(const fd_set& fdsetSend, const fd_set& fdsetRecv)
+{
+    LOCK(cs);
+    for (unsigned int i = 0; i < vSubscribers.size(); i++) {
+        CSubscriber& subscriber = vSubscribers[i];
+        bool fKeep = true;
+        if (FD_ISSET(subscriber.hSocket, &fdsetRecv)) {
+            // Subscribers have nothing to say; this only tells us they hung up
+            char pchBuf[256];
+            int nBytes = recv(subscriber.hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+            if (nBytes == 0)
+                fKeep = false;
+            else if (nBytes < 0) {
+                int nErr = WSAGetLastError();
+                fKeep = (nErr == WSAEWOULDBLOCK || nErr == WSAEMSGSIZE || nErr == WSAEINTR || nErr == WSAEINPROGRESS);
+            }
+        }
+        if (fKeep && FD_ISSET(subscriber.hSocket, &fdsetSend))
+            fKeep = SubscriberSend(subscriber.hSocket, subscriber.vSend, subscriber.nSendOffset, subscriber.nSendSize);
+        if (!fKeep) {
+            LogPrint("publish", "subscriber disconnected (%u messages dropped)\n", subscriber.nDropped);
+            CloseSocket(subscriber.hSocket);
+            vSubscribers.erase(vSubscribers.begin() + i);
+            i--;
+        }
+    }
+}
+
+void CPublisher::Thread()
+{
+    RenameThread("bitcoin-publish");
+    while (true) {
+        fd_set fdsetRecv;
+        fd_set fdsetSend;
+        FD_ZERO(&fdsetRecv);
+        FD_ZERO(&fdsetSend);
+        SOCKET hSocketMax = 0;
+        bool have_fds = false;
+        {
+            LOCK(cs);
+            BOOST_FOREACH(const CListener& listener, vListeners) {
+                FD_SET(listener.hSocket, &fdsetRecv);
+                hSocketMax = std::max(hSocketMax, listener.hSocket);
+                have_fds = true;
+            }
+            BOOST_FOREACH(const CSubscriber& subscriber, vSubscribers) {
+                FD_SET(subscriber.hSocket, &fdsetRecv);
+                if (!subscriber.vSend.empty())
+                    FD_SET(subscriber.hSocket, &fdsetSend);
+                hSocketMax = std::max(hSocketMax, subscriber.hSocket);
+                have_fds = true;
+            }
+        }
+
+        struct timeval timeout;
+        timeout.tv_sec  = 0;
+        timeout.tv_usec = 50000; // frequency to pick up new subscribers and queued messages
+        int nSelect = select(have_fds ? hSocketMax + 1 : 0, &fdsetRecv, &fdsetSend, NULL, &timeout);
+        boost::this_thread::interruption_point();
+
+        if (nSelect == SOCKET_ERROR) {
+            if (have_fds)
+                LogPrintf("publisher select error %s\n", NetworkErrorString(WSAGetLastError()));
+            MilliSleep(timeout.tv_usec/1000);
+            continue;
+        }
+
+        AcceptSubscribers(fdsetRecv);
+        ServeSubscribers(fdsetSend, fdsetRecv);
+    }
+}
@@ -0,0 +1,97 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_PUBLISHER_H
+#define BITCOIN_PUBLISHER_H
+
+#include "allocators.h"
+#include "compat.h"
+#include "main.h"
+#include "sync.h"
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+/** Maximum number of bytes queued for one subscriber before messages for it are dropped */
+static const size_t MAX_PUBLISH_BUFFER = 64 * 1024 * 1024;
+
+enum PublishTopic
+{
+    PUB_HASHBLOCK,
+    PUB_HASHTX,
+    PUB_RAWBLOCK,
+    PUB_RAWTX,
+    PUB_TOPIC_COUNT
+};
+
+/** Name of a topic, as sent to subscribers and used in its -pub<topic> option */
+const char* GetPublishTopicName(PublishTopic topic);
+
+/**
+ * Pushes blocks connected to the active chain and transactions accepted into
+ * the memory pool to subscribers on local TCP or Unix sockets, so they don't
+ * have to poll RPC. Each message is, in the usual serialization,
+ *
+ *   string topic ("hashblock", "hashtx", "rawblock" or "rawtx")
+ *   vector<unsigned char> body (a 32 byte hash, or the serialized block/tx)
+ *   uint32_t sequence
+ *
+ * The sequence is counted per topic from startup. Messages for a subscriber
+ * that falls more than MAX_PUBLISH_BUFFER behind are dropped rather than
+ * queued, which shows up as a gap in the sequence.
+ */
+class CPublisher : public CValidationInterface
+{
+private:
+    struct CListener
+    {
+        SOCKET hSocket;
+        unsigned int nTopics; //!< bitmask of PublishTopic
+        std::string strAddr;
+        std::string strUnixPath;
+    };
+
+    struct CSubscriber
+    {
+        SOCKET hSocket;
+        unsigned int nTopics;
+        std::deque<boost::shared_ptr<const CSerializeData> > vSend;
+        size_t nSendOffset;
+        size_t nSendSize;
+        uint64_t nDropped;
+    };
+
+    mutable CCriticalSection cs;
+    std::vector<CListener> vListeners;
+    std::vector<CSubscriber> vSubscribers;
+    uint32_t nSequence[PUB_TOPIC_COUNT];
+
+    void Send(PublishTopic topic, const boost::shared_ptr<const CSerializeData>& msg);
+    void AcceptSubscribers(const fd_set& fdsetRecv);
+    void ServeSubscribers(const fd_set& fdsetSend, const fd_set& fdsetRecv);
+
+protected:
+    void TransactionAddedToMempool(const CTransaction& tx);
+    void BlockConnected(const CBlock& block);
+
+public:
+    CPublisher();
+    ~CPublisher();
+
+    /** Listen on strAddr ("unix:<path>" or <host>:<port>) and publish topic to subscribers there */
+    bool Listen(PublishTopic topic, const std::string& strAddr, std::string& strError);
+
+    void PublishTransaction(const CTransaction& tx);
+    void PublishBlock(const CBlock& block);
+
+    size_t GetSubscriberCount() const;
+
+    /** Accept subscribers and write out queued messages; runs until interrupted */
+    void Thread();
+};
+
+#endif // BITCOIN_PUBLISHER_H
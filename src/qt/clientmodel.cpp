@@ -61,8 +61,7 @@ int ClientModel::getNumConnections(unsigned int flags) const
 
 int ClientModel::getNumBlocks() const
 {
-    LOCK(cs_main);
-    return chainActive.Height();
+    return GetActiveChainSnapshot().Height();
 }
 
 int ClientModel::getNumBlocksAtStartup()
@@ -83,17 +82,16 @@ quint64 ClientModel::getTotalBytesSent() const
 
 QDateTime ClientModel::getLastBlockDate() const
 {
-    LOCK(cs_main);
-    if (chainActive.Tip())
-        return QDateTime::fromTime_t(chainActive.Tip()->GetBlockTime());
+    const CBlockIndex* pindexTip = GetActiveChainSnapshot().Tip();
+    if (pindexTip)
+        return QDateTime::fromTime_t(pindexTip->GetBlockTime());
     else
         return QDateTime::fromTime_t(Params().GenesisBlock().GetBlockTime()); // Genesis block's time of current network
 }
 
 double ClientModel::getVerificationProgress() const
 {
-    LOCK(cs_main);
-    return Checkpoints::GuessVerificationProgress(chainActive.Tip());
+    return Checkpoints::GuessVerificationProgress(GetActiveChainSnapshot().Tip());
 }
 
 void ClientModel::updateTimer()
@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
 #include "rpcserver.h"
 #include "streams.h"
 #include "utilstrencodings.h"
@@ -12,10 +13,18 @@
 #include "version.h"
 #include "main.h"
 #include "sync.h"
+#include "txmempool.h"
 
 using namespace std;
 using namespace json_spirit;
 
+//! Maximum number of headers returned by a single /rest/headers/ request
+static const unsigned int MAX_REST_HEADERS_RESULTS = 2000;
+//! Maximum number of outpoints accepted by a single /rest/getutxos/ request
+static const unsigned int MAX_GETUTXOS_OUTPOINTS = 1000;
+//! Bodies sent with chunked transfer encoding are flushed in chunks of about this size
+static const size_t REST_CHUNK_SIZE = 64 * 1024;
+
 enum RetFormat {
     RF_BINARY,
     RF_HEX,
@@ -37,8 +46,95 @@ public:
     string message;
 };
 
-extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry);
-extern Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex);
+struct CCoin {
+    uint32_t nTxVer; // Don't call this nVersion, that name has a special meaning inside IMPLEMENT_SERIALIZE
+    uint32_t nHeight;
+    CTxOut out;
+
+    CCoin() : nTxVer(0), nHeight(0) {}
+    CCoin(uint32_t nTxVerIn, uint32_t nHeightIn, const CTxOut& outIn) : nTxVer(nTxVerIn), nHeight(nHeightIn), out(outIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(nTxVer);
+        READWRITE(nHeight);
+        READWRITE(out);
+    }
+};
+
+/**
+ * Writes a successful REST response body as it is produced. HTTP/1.1 clients
+ * receive it with chunked transfer encoding: each chunk is handed to the
+ * connection thread, which waits for the client to take earlier ones before
+ * accepting more, so only a few chunks of the body are held in memory. For
+ * HTTP/1.0 clients the body is collected and sent with a Content-Length by
+ * Finish().
+ *
+ * Only construct this once the request is known to succeed: the reply header
+ * may be sent right away, after which an error can no longer be reported.
+ */
+class RESTResponseWriter
+{
+public:
+    RESTResponseWriter(AcceptedConnection* connIn, bool fRunIn, int nProto, const char* contentTypeIn)
+        : conn(connIn), fRun(fRunIn), fChunked(nProto >= 1), contentType(contentTypeIn)
+    {
+        if (fChunked)
+            conn->stream() << HTTPReplyHeaderChunked(HTTP_OK, fRun, contentType);
+    }
+
+    //! Output buffer that may be appended to directly; call Flush() afterwards
+    string& Buffer() { return strBuffer; }
+
+    void Write(const char* pch, size_t nSize)
+    {
+        for (size_t nPos = 0; nPos < nSize; nPos += REST_CHUNK_SIZE) {
+            strBuffer.append(pch + nPos, std::min<size_t>(REST_CHUNK_SIZE, nSize - nPos));
+            Flush();
+        }
+    }
+
+    void Write(const string& str) { Write(str.data(), str.size()); }
+
+    //! Send the buffered data as a chunk once enough of it has accumulated
+    void Flush()
+    {
+        if (fChunked && strBuffer.size() >= REST_CHUNK_SIZE)
+            SendChunk();
+    }
+
+    void Finish()
+    {
+        if (!fChunked) {
+            conn->stream() << HTTPReply(HTTP_OK, strBuffer, fRun, false, contentType) << std::flush;
+            return;
+        }
+        if (!strBuffer.empty())
+            SendChunk();
+        conn->stream() << "0\r\n\r\n" << std::flush;
+    }
+
+private:
+    AcceptedConnection* conn;
+    bool fRun;
+    bool fChunked;
+    const char* contentType;
+    string strBuffer;
+
+    void SendChunk()
+    {
+        conn->stream() << strprintf("%x\r\n", strBuffer.size()) << strBuffer << "\r\n" << std::flush;
+        strBuffer.clear();
+    }
+};
+
+extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, JSONStreamWriter& entry);
+extern void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, JSONStreamWriter& result, const boost::function<void ()>& fnFlush);
+extern void ScriptPubKeyToJSON(const CScript& scriptPubKey, JSONStreamWriter& out, bool fIncludeHex);
+extern bool ParseAddressIndexScript(const string& str, uint160& hashScript);
+extern void AddressIndexEntryToJSON(const pair<CAddressIndexKey, CAddressIndexValue>& entry, JSONStreamWriter& out);
 
 static RestErr RESTERR(enum HTTPStatusCode status, string message)
 {
@@ -66,10 +162,30 @@ static bool ParseHashStr(const string& strReq, uint256& v)
     return true;
 }
 
+static void blockheaderToJSON(const CBlockIndex* pindex, int nConfirmations, const CBlockIndex* pnext, JSONStreamWriter& result)
+{
+    result.Pair("hash", pindex->GetBlockHash().GetHex());
+    result.Pair("confirmations", nConfirmations);
+    result.Pair("height", pindex->nHeight);
+    result.Pair("version", pindex->nVersion);
+    result.Pair("merkleroot", pindex->hashMerkleRoot.GetHex());
+    result.Pair("time", (int64_t)pindex->nTime);
+    result.Pair("nonce", (int64_t)pindex->nNonce);
+    result.Pair("bits", strprintf("%08x", pindex->nBits));
+    result.Pair("difficulty", GetDifficulty(pindex));
+    result.Pair("chainwork", pindex->nChainWork.GetHex());
+    if (pindex->pprev)
+        result.Pair("previousblockhash", pindex->pprev->GetBlockHash().GetHex());
+    if (pnext)
+        result.Pair("nextblockhash", pnext->GetBlockHash().GetHex());
+}
+
 static bool rest_block(AcceptedConnection *conn,
                        string& strReq,
+                       const string& strBody,
                        map<string, string>& mapHeaders,
-                       bool fRun)
+                       bool fRun,
+                       int nProto)
 {
     vector<string> params;
     boost::split(params, strReq, boost::is_any_of("/"));
@@ -81,38 +197,53 @@ static bool rest_block(AcceptedConnection *conn,
     if (!ParseHashStr(hashStr, hash))
         throw RESTERR(HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
 
-    CBlock block;
     CBlockIndex* pblockindex = NULL;
+    CDiskBlockPos blockPos;
     {
         LOCK(cs_main);
-        if (mapBlockIndex.count(hash) == 0)
-            throw RESTERR(HTTP_NOT_FOUND, hashStr + " not found");
-
-        pblockindex = mapBlockIndex[hash];
-        if (!ReadBlockFromDisk(block, pblockindex))
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA))
             throw RESTERR(HTTP_NOT_FOUND, hashStr + " not found");
+        pblockindex = mi->second;
+        blockPos = pblockindex->GetBlockPos();
     }
 
-    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
-    ssBlock << block;
+    // Block index entries are never deleted, but their position fields are
+    // written under cs_main; read from the copy taken above without it.
+    CBlock block;
+    if (!ReadBlockFromDisk(block, blockPos) || block.GetHash() != hash)
+        throw RESTERR(HTTP_NOT_FOUND, hashStr + " not found");
 
     switch (rf) {
     case RF_BINARY: {
-        string binaryBlock = ssBlock.str();
-        conn->stream() << HTTPReply(HTTP_OK, binaryBlock, fRun, true, "application/octet-stream") << binaryBlock << std::flush;
+        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+        ssBlock << block;
+        RESTResponseWriter writer(conn, fRun, nProto, "application/octet-stream");
+        writer.Write(&ssBlock[0], ssBlock.size());
+        writer.Finish();
         return true;
     }
 
     case RF_HEX: {
-        string strHex = HexStr(ssBlock.begin(), ssBlock.end()) + "\n";;
-        conn->stream() << HTTPReply(HTTP_OK, strHex, fRun, false, "text/plain") << std::flush;
+        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+        ssBlock << block;
+        RESTResponseWriter writer(conn, fRun, nProto, "text/plain");
+        for (size_t nPos = 0; nPos < ssBlock.size(); nPos += REST_CHUNK_SIZE / 2) {
+            size_t nLen = std::min<size_t>(REST_CHUNK_SIZE / 2, ssBlock.size() - nPos);
+            writer.Buffer() += HexStr(ssBlock.begin() + nPos, ssBlock.begin() + nPos + nLen);
+            writer.Flush();
+        }
+        writer.Buffer() += "\n";
+        writer.Finish();
         return true;
     }
 
     case RF_JSON: {
-        Object objBlock = blockToJSON(block, pblockindex);
-        string strJSON = write_string(Value(objBlock), false) + "\n";
-        conn->stream() << HTTPReply(HTTP_OK, strJSON, fRun) << std::flush;
+        RESTResponseWriter writer(conn, fRun, nProto, "application/json");
+        JSONStreamWriter result(writer.Buffer());
+        blockToJSON(block, pblockindex, result, boost::bind(&RESTResponseWriter::Flush, &writer));
+        writer.Buffer() += "\n";
+        writer.Finish();
         return true;
      }
     }
@@ -123,8 +254,10 @@ static bool rest_block(AcceptedConnection *conn,
 
 static bool rest_tx(AcceptedConnection *conn,
                     string& strReq,
+                    const string& strBody,
                     map<string, string>& mapHeaders,
-                    bool fRun)
+                    bool fRun,
+                    int nProto)
 {
     vector<string> params;
     boost::split(params, strReq, boost::is_any_of("/"));
@@ -158,9 +291,15 @@ static bool rest_tx(AcceptedConnection *conn,
     }
 
     case RF_JSON: {
-        Object objTx;
-        TxToJSON(tx, hashBlock, objTx);
-        string strJSON = write_string(Value(objTx), false) + "\n";
+        string strJSON;
+        JSONStreamWriter objTx(strJSON);
+        objTx.BeginObject();
+        {
+            LOCK(cs_main);
+            TxToJSON(tx, hashBlock, objTx);
+        }
+        objTx.EndObject();
+        strJSON += "\n";
         conn->stream() << HTTPReply(HTTP_OK, strJSON, fRun) << std::flush;
         return true;
      }
@@ -170,28 +309,370 @@ static bool rest_tx(AcceptedConnection *conn,
     return true;     // continue to process further HTTP reqs on this cxn
 }
 
+static bool rest_headers(AcceptedConnection *conn,
+                         string& strReq,
+                         const string& strBody,
+                         map<string, string>& mapHeaders,
+                         bool fRun,
+                         int nProto)
+{
+    vector<string> params;
+    boost::split(params, strReq, boost::is_any_of("/"));
+
+    if (params.size() < 2)
+        throw RESTERR(HTTP_BAD_REQUEST, "No header count specified. Use /rest/headers/<count>/<hash>/<format>");
+
+    enum RetFormat rf = ParseDataFormat(params.size() > 2 ? params[2] : string(""));
+
+    int32_t nCount = 0;
+    if (!ParseInt32(params[0], &nCount) || nCount < 1 || (unsigned int)nCount > MAX_REST_HEADERS_RESULTS)
+        throw RESTERR(HTTP_BAD_REQUEST, strprintf("Header count out of range: %s", params[0]));
+
+    string hashStr = params[1];
+    uint256 hash;
+    if (!ParseHashStr(hashStr, hash))
+        throw RESTERR(HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
+
+    // Only the index lookup needs cs_main; the chain is walked in a
+    // snapshot and everything reported below is immutable once the entry
+    // exists.
+    const CBlockIndex* pindex = NULL;
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            throw RESTERR(HTTP_NOT_FOUND, hashStr + " not found");
+        pindex = mi->second;
+    }
+
+    CChainSnapshot chain = GetActiveChainSnapshot();
+    int nConfirmationsFirst = -1;
+    if (chain.Contains(pindex))
+        nConfirmationsFirst = chain.Height() - pindex->nHeight + 1;
+    vector<const CBlockIndex*> headers;
+    headers.reserve(nCount);
+    while (pindex != NULL && headers.size() < (unsigned int)nCount) {
+        headers.push_back(pindex);
+        pindex = chain.Next(pindex);
+    }
+    const CBlockIndex* pnextLast = chain.Next(headers.back());
+
+    switch (rf) {
+    case RF_BINARY:
+    case RF_HEX: {
+        CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+        BOOST_FOREACH(const CBlockIndex* pindex, headers)
+            ssHeader << pindex->GetBlockHeader();
+
+        if (rf == RF_BINARY) {
+            string binaryHeaders = ssHeader.str();
+            conn->stream() << HTTPReply(HTTP_OK, binaryHeaders, fRun, true, "application/octet-stream") << binaryHeaders << std::flush;
+        } else {
+            string strHex = HexStr(ssHeader.begin(), ssHeader.end()) + "\n";
+            conn->stream() << HTTPReply(HTTP_OK, strHex, fRun, false, "text/plain") << std::flush;
+        }
+        return true;
+    }
+
+    case RF_JSON: {
+        RESTResponseWriter writer(conn, fRun, nProto, "application/json");
+        JSONStreamWriter result(writer.Buffer());
+        result.BeginArray();
+        for (unsigned int i = 0; i < headers.size(); i++) {
+            // All entries after the first are on the active chain iff the first is
+            int nConfirmations = nConfirmationsFirst < 0 ? -1 : nConfirmationsFirst - (int)i;
+            const CBlockIndex* pnext = (i + 1 < headers.size()) ? headers[i + 1] : pnextLast;
+            result.BeginObject();
+            blockheaderToJSON(headers[i], nConfirmations, pnext, result);
+            result.EndObject();
+            writer.Flush();
+        }
+        result.EndArray();
+        writer.Buffer() += "\n";
+        writer.Finish();
+        return true;
+    }
+    }
+
+    // not reached
+    return true;     // continue to process further HTTP reqs on this cxn
+}
+
+static bool rest_blockhash_by_height(AcceptedConnection *conn,
+                                     string& strReq,
+                                     const string& strBody,
+                                     map<string, string>& mapHeaders,
+                                     bool fRun,
+                                     int nProto)
+{
+    vector<string> params;
+    boost::split(params, strReq, boost::is_any_of("/"));
+
+    enum RetFormat rf = ParseDataFormat(params.size() > 1 ? params[1] : string(""));
+
+    int32_t nHeight = -1;
+    if (!ParseInt32(params[0], &nHeight) || nHeight < 0)
+        throw RESTERR(HTTP_BAD_REQUEST, "Invalid height: " + params[0]);
+
+    const CBlockIndex* pindex = GetActiveChainSnapshot()[nHeight];
+    if (pindex == NULL)
+        throw RESTERR(HTTP_NOT_FOUND, "Block height out of range");
+    uint256 hash = pindex->GetBlockHash();
+
+    switch (rf) {
+    case RF_BINARY: {
+        CDataStream ssHash(SER_NETWORK, PROTOCOL_VERSION);
+        ssHash << hash;
+        string binaryHash = ssHash.str();
+        conn->stream() << HTTPReply(HTTP_OK, binaryHash, fRun, true, "application/octet-stream") << binaryHash << std::flush;
+        return true;
+    }
+
+    case RF_HEX: {
+        conn->stream() << HTTPReply(HTTP_OK, hash.GetHex() + "\n", fRun, false, "text/plain") << std::flush;
+        return true;
+    }
+
+    case RF_JSON: {
+        string strJSON;
+        JSONStreamWriter result(strJSON);
+        result.BeginObject();
+        result.Pair("blockhash", hash.GetHex());
+        result.EndObject();
+        strJSON += "\n";
+        conn->stream() << HTTPReply(HTTP_OK, strJSON, fRun) << std::flush;
+        return true;
+    }
+    }
+
+    // not reached
+    return true;     // continue to process further HTTP reqs on this cxn
+}
+
+static bool rest_getutxos(AcceptedConnection *conn,
+                          string& strReq,
+                          const string& strBody,
+                          map<string, string>& mapHeaders,
+                          bool fRun,
+                          int nProto)
+{
+    vector<string> params;
+    boost::split(params, strReq, boost::is_any_of("/"));
+
+    // The request is /rest/getutxos/[checkmempool/]<format> with a binary
+    // serialized vector of outpoints as the body
+    bool fCheckMemPool = false;
+    if (!params.empty() && params[0] == "checkmempool") {
+        fCheckMemPool = true;
+        params.erase(params.begin());
+    }
+    enum RetFormat rf = ParseDataFormat(params.size() > 0 ? params[0] : string(""));
+
+    if (strBody.empty())
+        throw RESTERR(HTTP_BAD_REQUEST, "Missing outpoints in request body");
+
+    vector<COutPoint> vOutPoints;
+    try {
+        CDataStream ssRequest(strBody.data(), strBody.data() + strBody.size(), SER_NETWORK, PROTOCOL_VERSION);
+        ssRequest >> vOutPoints;
+    } catch (const std::exception&) {
+        throw RESTERR(HTTP_BAD_REQUEST, "Parse error");
+    }
+
+    if (vOutPoints.empty() || vOutPoints.size() > MAX_GETUTXOS_OUTPOINTS)
+        throw RESTERR(HTTP_BAD_REQUEST, strprintf("Error: number of outpoints must be between 1 and %u", MAX_GETUTXOS_OUTPOINTS));
+
+    vector<bool> hits;
+    vector<CCoin> outs;
+    hits.reserve(vOutPoints.size());
+    int nChainHeight;
+    uint256 hashChainTip;
+    {
+        LOCK2(cs_main, mempool.cs);
+
+        CCoinsViewMemPool viewMempool(pcoinsTip, mempool);
+        CCoinsView& view = fCheckMemPool ? (CCoinsView&)viewMempool : (CCoinsView&)*pcoinsTip;
+
+        BOOST_FOREACH(const COutPoint& outpoint, vOutPoints) {
+            CCoins coins;
+            bool hit = false;
+            if (view.GetCoins(outpoint.hash, coins)) {
+                if (fCheckMemPool)
+                    mempool.pruneSpent(outpoint.hash, coins);
+                if (coins.IsAvailable(outpoint.n)) {
+                    hit = true;
+                    outs.push_back(CCoin(coins.nVersion, coins.nHeight, coins.vout[outpoint.n]));
+                }
+            }
+            hits.push_back(hit);
+        }
+
+        nChainHeight = chainActive.Height();
+        hashChainTip = chainActive.Tip()->GetBlockHash();
+    }
+
+    // One bit per requested outpoint, least significant bit first
+    vector<unsigned char> bitmap((hits.size() + 7) / 8);
+    string strBitmap;
+    for (unsigned int i = 0; i < hits.size(); i++) {
+        bitmap[i / 8] |= ((uint8_t)hits[i]) << (i % 8);
+        strBitmap += hits[i] ? "1" : "0";
+    }
+
+    switch (rf) {
+    case RF_BINARY:
+    case RF_HEX: {
+        CDataStream ssOutputs(SER_NETWORK, PROTOCOL_VERSION);
+        ssOutputs << nChainHeight << hashChainTip << bitmap << outs;
+
+        if (rf == RF_BINARY) {
+            string binaryOutputs = ssOutputs.str();
+            conn->stream() << HTTPReply(HTTP_OK, binaryOutputs, fRun, true, "application/octet-stream") << binaryOutputs << std::flush;
+        } else {
+            string strHex = HexStr(ssOutputs.begin(), ssOutputs.end()) + "\n";
+            conn->stream() << HTTPReply(HTTP_OK, strHex, fRun, false, "text/plain") << std::flush;
+        }
+        return true;
+    }
+
+    case RF_JSON: {
+        RESTResponseWriter writer(conn, fRun, nProto, "application/json");
+        JSONStreamWriter result(writer.Buffer());
+        result.BeginObject();
+        result.Pair("chainHeight", nChainHeight);
+        result.Pair("chaintipHash", hashChainTip.GetHex());
+        result.Pair("bitmap", strBitmap);
+        result.Key("utxos");
+        result.BeginArray();
+        BOOST_FOREACH(const CCoin& coin, outs) {
+            result.BeginObject();
+            result.Pair("txvers", (int64_t)coin.nTxVer);
+            result.Pair("height", (int64_t)coin.nHeight);
+            result.Pair("value", ValueFromAmount(coin.out.nValue).get_real());
+            result.Key("scriptPubKey");
+            result.BeginObject();
+            ScriptPubKeyToJSON(coin.out.scriptPubKey, result, true);
+            result.EndObject();
+            result.EndObject();
+            writer.Flush();
+        }
+        result.EndArray();
+        result.EndObject();
+        writer.Buffer() += "\n";
+        writer.Finish();
+        return true;
+    }
+    }
+
+    // not reached
+    return true;     // continue to process further HTTP reqs on this cxn
+}
+
+static bool rest_address(AcceptedConnection *conn,
+                         string& strReq,
+                         const string& strBody,
+                         map<string, string>& mapHeaders,
+                         bool fRun,
+                         int nProto)
+{
+    vector<string> params;
+    boost::split(params, strReq, boost::is_any_of("/"));
+
+    if (params.size() < 3)
+        throw RESTERR(HTTP_BAD_REQUEST, "No paging specified. Use /rest/address/<count>/<start or height:txid>/<address or hex script>/<format>");
+
+    enum RetFormat rf = ParseDataFormat(params.size() > 3 ? params[3] : string(""));
+
+    if (!fAddressIndex)
+        throw RESTERR(HTTP_NOT_FOUND, "Address index not enabled");
+
+    int32_t nCount = 0;
+    if (!ParseInt32(params[0], &nCount) || nCount < 0 || (unsigned int)nCount > MAX_ADDRESS_HISTORY_RESULTS)
+        throw RESTERR(HTTP_BAD_REQUEST, strprintf("Count out of range: %s", params[0]));
+    // Continue after the transaction of the last entry of the previous page
+    int32_t nAfterHeight = -1;
+    uint256 txidAfter;
+    if (params[1] != "start") {
+        size_t nColon = params[1].find(':');
+        if (nColon == string::npos || !ParseInt32(params[1].substr(0, nColon), &nAfterHeight) || nAfterHeight < 0 ||
+            !ParseHashStr(params[1].substr(nColon + 1), txidAfter))
+            throw RESTERR(HTTP_BAD_REQUEST, strprintf("Invalid position: %s", params[1]));
+    }
+    uint160 hashScript;
+    if (!ParseAddressIndexScript(params[2], hashScript))
+        throw RESTERR(HTTP_BAD_REQUEST, "Invalid address or script: " + params[2]);
+
+    vector<pair<CAddressIndexKey, CAddressIndexValue> > vEntries;
+    if (!GetAddressIndex(hashScript, nAfterHeight, txidAfter, nCount, vEntries))
+        throw RESTERR(HTTP_INTERNAL_SERVER_ERROR, "Unable to read address index");
+
+    switch (rf) {
+    case RF_BINARY:
+    case RF_HEX: {
+        CDataStream ssEntries(SER_NETWORK, PROTOCOL_VERSION);
+        ssEntries << vEntries;
+
+        if (rf == RF_BINARY) {
+            string binaryEntries = ssEntries.str();
+            conn->stream() << HTTPReply(HTTP_OK, binaryEntries, fRun, true, "application/octet-stream") << binaryEntries << std::flush;
+        } else {
+            string strHex = HexStr(ssEntries.begin(), ssEntries.end()) + "\n";
+            conn->stream() << HTTPReply(HTTP_OK, strHex, fRun, false, "text/plain") << std::flush;
+        }
+        return true;
+    }
+
+    case RF_JSON: {
+        RESTResponseWriter writer(conn, fRun, nProto, "application/json");
+        JSONStreamWriter result(writer.Buffer());
+        result.BeginArray();
+        for (unsigned int i = 0; i < vEntries.size(); i++) {
+            result.BeginObject();
+            AddressIndexEntryToJSON(vEntries[i], result);
+            result.EndObject();
+            writer.Flush();
+        }
+        result.EndArray();
+        writer.Buffer() += "\n";
+        writer.Finish();
+        return true;
+    }
+    }
+
+    // not reached
+    return true;     // continue to process further HTTP reqs on this cxn
+}
+
 static const struct {
     const char *prefix;
     bool (*handler)(AcceptedConnection *conn,
                     string& strURI,
+                    const string& strBody,
                     map<string, string>& mapHeaders,
-                    bool fRun);
+                    bool fRun,
+                    int nProto);
 } uri_prefixes[] = {
     { "/rest/tx/", rest_tx },
     { "/rest/block/", rest_block },
+    { "/rest/headers/", rest_headers },
+    { "/rest/blockhashbyheight/", rest_blockhash_by_height },
+    { "/rest/getutxos/", rest_getutxos },
+    { "/rest/address/", rest_address },
 };
 
 bool HTTPReq_REST(AcceptedConnection *conn,
                   string& strURI,
+                  string& strRequest,
                   map<string, string>& mapHeaders,
-                  bool fRun)
+                  bool fRun,
+                  int nProto)
 {
     try {
         for (unsigned int i = 0; i < ARRAYLEN(uri_prefixes); i++) {
             unsigned int plen = strlen(uri_prefixes[i].prefix);
             if (strURI.substr(0, plen) == uri_prefixes[i].prefix) {
                 string strReq = strURI.substr(plen);
-                return uri_prefixes[i].handler(conn, strReq, mapHeaders, fRun);
+                return uri_prefixes[i].handler(conn, strReq, strRequest, mapHeaders, fRun, nProto);
             }
         }
     }
@@ -203,4 +684,3 @@ bool HTTPReq_REST(AcceptedConnection *conn,
     conn->stream() << HTTPError(HTTP_NOT_FOUND, false) << std::flush;
     return false;
 }
-
@@ -11,6 +11,8 @@
 
 #include <stdint.h>
 
+#include <boost/function.hpp>
+
 #include "json/json_spirit_value.h"
 
 using namespace json_spirit;
@@ -24,10 +26,9 @@ double GetDifficulty(const CBlockIndex* blockindex)
     // minimum difficulty = 1.0.
     if (blockindex == NULL)
     {
-        if (chainActive.Tip() == NULL)
+        blockindex = GetActiveChainSnapshot().Tip();
+        if (blockindex == NULL)
             return 1.0;
-        else
-            blockindex = chainActive.Tip();
     }
 
     int nShift = (blockindex->nBits >> 24) & 0xff;
@@ -50,35 +51,55 @@ double GetDifficulty(const CBlockIndex* blockindex)
 }
 
 
-Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex)
+/**
+ * Write a block as a JSON object, without building a json_spirit tree.
+ * fnFlush, if set, is called as the transaction list grows, so that
+ * callers sending the output as it is produced can pass it on.
+ */
+void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, JSONStreamWriter& result, const boost::function<void ()>& fnFlush)
 {
-    Object result;
-    result.push_back(Pair("hash", block.GetHash().GetHex()));
+    result.BeginObject();
+    result.Pair("hash", block.GetHash().GetHex());
+    CChainSnapshot chain = GetActiveChainSnapshot();
     int confirmations = -1;
     // Only report confirmations if the block is on the main chain
-    if (chainActive.Contains(blockindex))
-        confirmations = chainActive.Height() - blockindex->nHeight + 1;
-    result.push_back(Pair("confirmations", confirmations));
-    result.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
-    result.push_back(Pair("height", blockindex->nHeight));
-    result.push_back(Pair("version", block.nVersion));
-    result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
-    Array txs;
-    BOOST_FOREACH(const CTransaction&tx, block.vtx)
-        txs.push_back(tx.GetHash().GetHex());
-    result.push_back(Pair("tx", txs));
-    result.push_back(Pair("time", block.GetBlockTime()));
-    result.push_back(Pair("nonce", (uint64_t)block.nNonce));
-    result.push_back(Pair("bits", strprintf("%08x", block.nBits)));
-    result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
-    result.push_back(Pair("chainwork", blockindex->nChainWork.GetHex()));
+    if (chain.Contains(blockindex))
+        confirmations = chain.Height() - blockindex->nHeight + 1;
+    result.Pair("confirmations", confirmations);
+    result.Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    result.Pair("height", blockindex->nHeight);
+    result.Pair("version", block.nVersion);
+    result.Pair("merkleroot", block.hashMerkleRoot.GetHex());
+    result.Key("tx");
+    result.BeginArray();
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        result.String(block.vtx[i].GetHash().GetHex());
+        if (fnFlush && i % 1000 == 999)
+            fnFlush();
+    }
+    result.EndArray();
+    result.Pair("time", block.GetBlockTime());
+    result.Pair("nonce", (int64_t)block.nNonce);
+    result.Pair("bits", strprintf("%08x", block.nBits));
+    result.Pair("difficulty", GetDifficulty(blockindex));
+    result.Pair("chainwork", blockindex->nChainWork.GetHex());
 
     if (blockindex->pprev)
-        result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
-    CBlockIndex *pnext = chainActive.Next(blockindex);
+        result.Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex());
+    const CBlockIndex *pnext = chain.Next(blockindex);
     if (pnext)
-        result.push_back(Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
-    return result;
+        result.Pair("nextblockhash", pnext->GetBlockHash().GetHex());
+    result.EndObject();
+}
+
+/** Encode a block as a JSON object */
+static string blockToJSON(const CBlock& block, const CBlockIndex* blockindex)
+{
+    string strJSON;
+    strJSON.reserve(1024 + block.vtx.size() * 67);
+    JSONStreamWriter result(strJSON);
+    blockToJSON(block, blockindex, result, boost::function<void ()>());
+    return strJSON;
 }
 
 
@@ -95,7 +116,7 @@ Value getblockcount(const Array& params, bool fHelp)
             + HelpExampleRpc("getblockcount", "")
         );
 
-    return chainActive.Height();
+    return GetActiveChainSnapshot().Height();
 }
 
 Value getbestblockhash(const Array& params, bool fHelp)
@@ -111,7 +132,7 @@ Value getbestblockhash(const Array& params, bool fHelp)
             + HelpExampleRpc("getbestblockhash", "")
         );
 
-    return chainActive.Tip()->GetBlockHash().GetHex();
+    return GetActiveChainSnapshot().Tip()->GetBlockHash().GetHex();
 }
 
 Value getdifficulty(const Array& params, bool fHelp)
@@ -169,6 +190,7 @@ Value getrawmempool(const Array& params, bool fHelp)
 
     if (fVerbose)
     {
+        int nHeight = GetActiveChainSnapshot().Height();
         LOCK(mempool.cs);
         Object o;
         BOOST_FOREACH(const PAIRTYPE(uint256, CTxMemPoolEntry)& entry, mempool.mapTx)
@@ -181,7 +203,7 @@ Value getrawmempool(const Array& params, bool fHelp)
             info.push_back(Pair("time", e.GetTime()));
             info.push_back(Pair("height", (int)e.GetHeight()));
             info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
-            info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
+            info.push_back(Pair("currentpriority", e.GetPriority(nHeight)));
             const CTransaction& tx = e.GetTx();
             set<string> setDepends;
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
@@ -224,14 +246,14 @@ Value getblockhash(const Array& params, bool fHelp)
         );
 
     int nHeight = params[0].get_int();
-    if (nHeight < 0 || nHeight > chainActive.Height())
+    const CBlockIndex* pblockindex = GetActiveChainSnapshot()[nHeight];
+    if (pblockindex == NULL)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
 
-    CBlockIndex* pblockindex = chainActive[nHeight];
     return pblockindex->GetBlockHash().GetHex();
 }
 
-Value getblock(const Array& params, bool fHelp)
+string getblock(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
         throw runtime_error(
@@ -274,13 +296,23 @@ Value getblock(const Array& params, bool fHelp)
     if (params.size() > 1)
         fVerbose = params[1].get_bool();
 
-    if (mapBlockIndex.count(hash) == 0)
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+    CBlockIndex* pblockindex = NULL;
+    CDiskBlockPos blockPos;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        pblockindex = mi->second;
+        if (!(pblockindex->nStatus & BLOCK_HAVE_DATA))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available on disk");
+        blockPos = pblockindex->GetBlockPos();
+    }
 
+    // nStatus, nFile and nDataPos are written under cs_main, so read from
+    // the position copied above rather than from the index entry.
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-
-    if(!ReadBlockFromDisk(block, pblockindex))
+    if (!ReadBlockFromDisk(block, blockPos) || block.GetHash() != hash)
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
 
     if (!fVerbose)
@@ -288,7 +320,7 @@ Value getblock(const Array& params, bool fHelp)
         CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
         ssBlock << block;
         std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
-        return strHex;
+        return write_string(Value(strHex), false);
     }
 
     return blockToJSON(block, pblockindex);
@@ -318,8 +350,12 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
 
     Object ret;
 
+    // Only the flush needs cs_main; the scan reads a database snapshot.
     CCoinsStats stats;
-    pcoinsTip->Flush();
+    {
+        LOCK(cs_main);
+        pcoinsTip->Flush();
+    }
     if (pcoinsTip->GetStats(stats)) {
         ret.push_back(Pair("height", (int64_t)stats.nHeight));
         ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
@@ -548,6 +584,11 @@ Value getmempoolinfo(const Array& params, bool fHelp)
             "{\n"
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
+            "  \"recentrejects\": {           (json object) Filter of transactions recently rejected by the memory pool\n"
+            "    \"inserted\": xxxxx          (numeric) Rejected transactions added to the filter\n"
+            "    \"filtered\": xxxxx          (numeric) Announcements not downloaded and revalidated because of the filter\n"
+            "    \"resets\": xxxxx            (numeric) Times the filter was cleared on a chain tip change\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmempoolinfo", "")
@@ -558,6 +599,14 @@ Value getmempoolinfo(const Array& params, bool fHelp)
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
 
+    CRecentRejectsStats rejectsStats;
+    GetRecentRejectsStats(rejectsStats);
+    Object rejects;
+    rejects.push_back(Pair("inserted", rejectsStats.nInserted));
+    rejects.push_back(Pair("filtered", rejectsStats.nFiltered));
+    rejects.push_back(Pair("resets", rejectsStats.nResets));
+    ret.push_back(Pair("recentrejects", rejects));
+
     return ret;
 }
 
@@ -69,6 +69,8 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "getblock", 1 },
     { "gettransaction", 1 },
     { "getrawtransaction", 1 },
+    { "getaddresshistory", 1 },
+    { "getaddresshistory", 2 },
     { "createrawtransaction", 0 },
     { "createrawtransaction", 1 },
     { "signrawtransaction", 1 },
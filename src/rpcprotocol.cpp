@@ -70,6 +70,7 @@ static const char *httpStatusDescription(int nStatus)
         case HTTP_FORBIDDEN: return "Forbidden";
         case HTTP_NOT_FOUND: return "Not Found";
         case HTTP_INTERNAL_SERVER_ERROR: return "Internal Server Error";
+        case HTTP_SERVICE_UNAVAILABLE: return "Service Unavailable";
         default: return "";
     }
 }
@@ -117,6 +118,24 @@ string HTTPReplyHeader(int nStatus, bool keepalive, size_t contentLength, const
         FormatFullVersion());
 }
 
+string HTTPReplyHeaderChunked(int nStatus, bool keepalive, const char *contentType)
+{
+    return strprintf(
+            "HTTP/1.1 %d %s\r\n"
+            "Date: %s\r\n"
+            "Connection: %s\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "Content-Type: %s\r\n"
+            "Server: bitcoin-json-rpc/%s\r\n"
+            "\r\n",
+        nStatus,
+        httpStatusDescription(nStatus),
+        rfc1123Time(),
+        keepalive ? "keep-alive" : "close",
+        contentType,
+        FormatFullVersion());
+}
+
 string HTTPReply(int nStatus, const string& strMsg, bool keepalive,
                  bool headersOnly, const char *contentType)
 {
@@ -283,6 +302,80 @@ string JSONRPCReply(const Value& result, const Value& error, const Value& id)
     return write_string(Value(reply), false) + "\n";
 }
 
+RPCResult RPCResult::FromEncoded(const string& strJSON)
+{
+    RPCResult result;
+    result.strEncoded = strJSON;
+    result.fEncoded = true;
+    return result;
+}
+
+string RPCResult::Write() const
+{
+    if (fEncoded)
+        return strEncoded;
+    return write_string(value, false);
+}
+
+Value RPCResult::GetValue() const
+{
+    if (!fEncoded)
+        return value;
+    Value valueRet;
+    if (!read_string(strEncoded, valueRet))
+        throw runtime_error("RPCResult::GetValue() : invalid encoded result");
+    return valueRet;
+}
+
+string WriteJSONRPCReply(const RPCResult& result, const Value& error, const Value& id)
+{
+    if (!result.IsEncoded() || error.type() != null_type)
+        return write_string(Value(JSONRPCReplyObj(result.IsEncoded() ? Value::null : result.GetValue(), error, id)), false);
+    // Same members, in the same order, as JSONRPCReplyObj
+    return "{\"result\":" + result.Write() + ",\"error\":null,\"id\":" + write_string(id, false) + "}";
+}
+
+void JSONStreamWriter::Int(int64_t n)
+{
+    Separator();
+    strOut += strprintf("%d", n);
+}
+
+void JSONStreamWriter::Real(double d)
+{
+    // Same as the (Bitcoin-modified) json_spirit writer: fixed, 8 decimals
+    Separator();
+    strOut += strprintf("%.8f", d);
+}
+
+void JSONStreamWriter::WriteString(const string& str)
+{
+    strOut += '"';
+    strOut += json_spirit::add_esc_chars(str);
+    strOut += '"';
+}
+
+void JSONValueWriter::Add(const Value& value)
+{
+    if (vOpen.empty())
+        objOut.push_back(json_spirit::Pair(strKey, value));
+    else if (vOpen.back().fArray)
+        vOpen.back().arr.push_back(value);
+    else
+        vOpen.back().obj.push_back(json_spirit::Pair(vOpen.back().strKey, value));
+}
+
+void JSONValueWriter::End()
+{
+    Value value;
+    if (vOpen.back().fArray)
+        value = vOpen.back().arr;
+    else
+        value = vOpen.back().obj;
+    vOpen.pop_back();
+    Add(value);
+}
+
 Object JSONRPCError(int code, const string& message)
 {
     Object error;
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_RPCPROTOCOL_H
 #define BITCOIN_RPCPROTOCOL_H
 
+#include <deque>
 #include <list>
 #include <map>
 #include <stdint.h>
@@ -28,6 +29,7 @@ enum HTTPStatusCode
     HTTP_FORBIDDEN             = 403,
     HTTP_NOT_FOUND             = 404,
     HTTP_INTERNAL_SERVER_ERROR = 500,
+    HTTP_SERVICE_UNAVAILABLE   = 503,
 };
 
 // Bitcoin RPC error codes
@@ -151,6 +153,9 @@ std::string HTTPError(int nStatus, bool keepalive,
                       bool headerOnly = false);
 std::string HTTPReplyHeader(int nStatus, bool keepalive, size_t contentLength,
                       const char *contentType = "application/json");
+/** Reply header for a body sent with chunked transfer encoding (HTTP/1.1 clients only) */
+std::string HTTPReplyHeaderChunked(int nStatus, bool keepalive,
+                      const char *contentType = "application/json");
 std::string HTTPReply(int nStatus, const std::string& strMsg, bool keepalive,
                       bool headerOnly = false,
                       const char *contentType = "application/json");
@@ -165,4 +170,117 @@ json_spirit::Object JSONRPCReplyObj(const json_spirit::Value& result, const json
 std::string JSONRPCReply(const json_spirit::Value& result, const json_spirit::Value& error, const json_spirit::Value& id);
 json_spirit::Object JSONRPCError(int code, const std::string& message);
 
+/**
+ * Result of an RPC call: a json_spirit value, or a document the method
+ * encoded itself so that a large result does not have to be built as a
+ * json_spirit tree first. An encoded result is spliced into the reply
+ * unchanged.
+ */
+class RPCResult
+{
+public:
+    RPCResult() : fEncoded(false) {}
+    RPCResult(const json_spirit::Value& valueIn) : value(valueIn), fEncoded(false) {}
+    static RPCResult FromEncoded(const std::string& strJSON);
+
+    bool IsEncoded() const { return fEncoded; }
+    //! The result as compact JSON
+    std::string Write() const;
+    //! The result as a json_spirit value; an encoded result is parsed first
+    json_spirit::Value GetValue() const;
+
+private:
+    json_spirit::Value value;
+    std::string strEncoded;
+    bool fEncoded;
+};
+
+/** Encode a reply like JSONRPCReply, without trailing newline */
+std::string WriteJSONRPCReply(const RPCResult& result, const json_spirit::Value& error, const json_spirit::Value& id);
+
+/**
+ * Appends compact JSON to a string as it is produced, formatted exactly like
+ * json_spirit's write_string(). Members are written in call order; callers
+ * are responsible for nesting Begin/End calls correctly.
+ */
+class JSONStreamWriter
+{
+public:
+    JSONStreamWriter(std::string& strOutIn) : strOut(strOutIn), fFirst(true) {}
+
+    void BeginObject() { Separator(); strOut += '{'; fFirst = true; }
+    void EndObject() { strOut += '}'; fFirst = false; }
+    void BeginArray() { Separator(); strOut += '['; fFirst = true; }
+    void EndArray() { strOut += ']'; fFirst = false; }
+    void Key(const std::string& key) { Separator(); WriteString(key); strOut += ':'; fFirst = true; }
+
+    void String(const std::string& str) { Separator(); WriteString(str); }
+    void Int(int64_t n);
+    void Real(double d);
+    void Bool(bool f) { Separator(); strOut += f ? "true" : "false"; }
+    void Null() { Separator(); strOut += "null"; }
+
+    void Pair(const std::string& key, const std::string& str) { Key(key); String(str); }
+    void Pair(const std::string& key, const char* str) { Key(key); String(str); }
+    void Pair(const std::string& key, int64_t n) { Key(key); Int(n); }
+    void Pair(const std::string& key, int n) { Key(key); Int(n); }
+    void Pair(const std::string& key, double d) { Key(key); Real(d); }
+
+private:
+    std::string& strOut;
+    //! Nothing written yet at the current nesting level, or a key was just written
+    bool fFirst;
+
+    void Separator() { if (!fFirst) strOut += ','; fFirst = false; }
+    void WriteString(const std::string& str);
+};
+
+/**
+ * Builds a json_spirit tree through the same calls as JSONStreamWriter, so
+ * that one serializer, written against either, can produce both. Members
+ * are appended to the object passed to the constructor.
+ */
+class JSONValueWriter
+{
+public:
+    JSONValueWriter(json_spirit::Object& objOutIn) : objOut(objOutIn) {}
+
+    void BeginObject() { vOpen.push_back(Container(false)); }
+    void EndObject() { End(); }
+    void BeginArray() { vOpen.push_back(Container(true)); }
+    void EndArray() { End(); }
+    void Key(const std::string& key) { (vOpen.empty() ? strKey : vOpen.back().strKey) = key; }
+
+    void String(const std::string& str) { Add(str); }
+    void Int(int64_t n) { Add(n); }
+    void Real(double d) { Add(d); }
+    void Bool(bool f) { Add(f); }
+    void Null() { Add(json_spirit::Value::null); }
+
+    void Pair(const std::string& key, const std::string& str) { Key(key); String(str); }
+    void Pair(const std::string& key, const char* str) { Key(key); String(str); }
+    void Pair(const std::string& key, int64_t n) { Key(key); Int(n); }
+    void Pair(const std::string& key, int n) { Key(key); Add(n); }
+    void Pair(const std::string& key, double d) { Key(key); Real(d); }
+
+private:
+    //! An object or array that has been begun but not ended yet
+    struct Container
+    {
+        bool fArray;
+        json_spirit::Object obj;
+        json_spirit::Array arr;
+        std::string strKey;
+        explicit Container(bool fArrayIn) : fArray(fArrayIn) {}
+    };
+
+    json_spirit::Object& objOut;
+    //! Key for the next member of objOut
+    std::string strKey;
+    std::deque<Container> vOpen;
+
+    void Add(const json_spirit::Value& value);
+    void End();
+};
+
 #endif // BITCOIN_RPCPROTOCOL_H
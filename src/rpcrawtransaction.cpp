@@ -30,82 +30,125 @@ using namespace boost::assign;
 using namespace json_spirit;
 using namespace std;
 
-void ScriptPubKeyToJSON(const CScript& scriptPubKey, Object& out, bool fIncludeHex)
+namespace {
+
+/**
+ * The JSON representations of scripts and transactions, written once
+ * against the JSONStreamWriter interface. The overloads below instantiate
+ * them with JSONStreamWriter, to encode large results directly, and with
+ * JSONValueWriter, to build json_spirit objects.
+ */
+template <typename JSONWriter>
+void WriteScriptPubKey(const CScript& scriptPubKey, JSONWriter& out, bool fIncludeHex)
 {
     txnouttype type;
     vector<CTxDestination> addresses;
     int nRequired;
 
-    out.push_back(Pair("asm", scriptPubKey.ToString()));
+    out.Pair("asm", scriptPubKey.ToString());
     if (fIncludeHex)
-        out.push_back(Pair("hex", HexStr(scriptPubKey.begin(), scriptPubKey.end())));
+        out.Pair("hex", HexStr(scriptPubKey.begin(), scriptPubKey.end()));
 
     if (!ExtractDestinations(scriptPubKey, type, addresses, nRequired)) {
-        out.push_back(Pair("type", GetTxnOutputType(type)));
+        out.Pair("type", GetTxnOutputType(type));
         return;
     }
 
-    out.push_back(Pair("reqSigs", nRequired));
-    out.push_back(Pair("type", GetTxnOutputType(type)));
+    out.Pair("reqSigs", nRequired);
+    out.Pair("type", GetTxnOutputType(type));
 
-    Array a;
+    out.Key("addresses");
+    out.BeginArray();
     BOOST_FOREACH(const CTxDestination& addr, addresses)
-        a.push_back(CBitcoinAddress(addr).ToString());
-    out.push_back(Pair("addresses", a));
+        out.String(CBitcoinAddress(addr).ToString());
+    out.EndArray();
 }
 
-void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
+template <typename JSONWriter>
+void WriteTx(const CTransaction& tx, const uint256 hashBlock, JSONWriter& entry)
 {
-    entry.push_back(Pair("txid", tx.GetHash().GetHex()));
-    entry.push_back(Pair("version", tx.nVersion));
-    entry.push_back(Pair("locktime", (int64_t)tx.nLockTime));
-    Array vin;
+    entry.Pair("txid", tx.GetHash().GetHex());
+    entry.Pair("version", tx.nVersion);
+    entry.Pair("locktime", (int64_t)tx.nLockTime);
+    entry.Key("vin");
+    entry.BeginArray();
     BOOST_FOREACH(const CTxIn& txin, tx.vin) {
-        Object in;
+        entry.BeginObject();
         if (tx.IsCoinBase())
-            in.push_back(Pair("coinbase", HexStr(txin.scriptSig.begin(), txin.scriptSig.end())));
+            entry.Pair("coinbase", HexStr(txin.scriptSig.begin(), txin.scriptSig.end()));
         else {
-            in.push_back(Pair("txid", txin.prevout.hash.GetHex()));
-            in.push_back(Pair("vout", (int64_t)txin.prevout.n));
-            Object o;
-            o.push_back(Pair("asm", txin.scriptSig.ToString()));
-            o.push_back(Pair("hex", HexStr(txin.scriptSig.begin(), txin.scriptSig.end())));
-            in.push_back(Pair("scriptSig", o));
+            entry.Pair("txid", txin.prevout.hash.GetHex());
+            entry.Pair("vout", (int64_t)txin.prevout.n);
+            entry.Key("scriptSig");
+            entry.BeginObject();
+            entry.Pair("asm", txin.scriptSig.ToString());
+            entry.Pair("hex", HexStr(txin.scriptSig.begin(), txin.scriptSig.end()));
+            entry.EndObject();
         }
-        in.push_back(Pair("sequence", (int64_t)txin.nSequence));
-        vin.push_back(in);
+        entry.Pair("sequence", (int64_t)txin.nSequence);
+        entry.EndObject();
     }
-    entry.push_back(Pair("vin", vin));
-    Array vout;
+    entry.EndArray();
+    entry.Key("vout");
+    entry.BeginArray();
     for (unsigned int i = 0; i < tx.vout.size(); i++) {
         const CTxOut& txout = tx.vout[i];
-        Object out;
-        out.push_back(Pair("value", ValueFromAmount(txout.nValue)));
-        out.push_back(Pair("n", (int64_t)i));
-        Object o;
-        ScriptPubKeyToJSON(txout.scriptPubKey, o, true);
-        out.push_back(Pair("scriptPubKey", o));
-        vout.push_back(out);
+        entry.BeginObject();
+        entry.Pair("value", ValueFromAmount(txout.nValue).get_real());
+        entry.Pair("n", (int64_t)i);
+        entry.Key("scriptPubKey");
+        entry.BeginObject();
+        WriteScriptPubKey(txout.scriptPubKey, entry, true);
+        entry.EndObject();
+        entry.EndObject();
     }
-    entry.push_back(Pair("vout", vout));
+    entry.EndArray();
 
     if (hashBlock != 0) {
-        entry.push_back(Pair("blockhash", hashBlock.GetHex()));
+        entry.Pair("blockhash", hashBlock.GetHex());
         BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end() && (*mi).second) {
             CBlockIndex* pindex = (*mi).second;
             if (chainActive.Contains(pindex)) {
-                entry.push_back(Pair("confirmations", 1 + chainActive.Height() - pindex->nHeight));
-                entry.push_back(Pair("time", pindex->GetBlockTime()));
-                entry.push_back(Pair("blocktime", pindex->GetBlockTime()));
+                entry.Pair("confirmations", 1 + chainActive.Height() - pindex->nHeight);
+                entry.Pair("time", pindex->GetBlockTime());
+                entry.Pair("blocktime", pindex->GetBlockTime());
             }
             else
-                entry.push_back(Pair("confirmations", 0));
+                entry.Pair("confirmations", 0);
         }
     }
 }
 
-Value getrawtransaction(const Array& params, bool fHelp)
+} // anon namespace
+
+void ScriptPubKeyToJSON(const CScript& scriptPubKey, Object& out, bool fIncludeHex)
+{
+    JSONValueWriter writer(out);
+    WriteScriptPubKey(scriptPubKey, writer, fIncludeHex);
+}
+
+void ScriptPubKeyToJSON(const CScript& scriptPubKey, JSONStreamWriter& out, bool fIncludeHex)
+{
+    WriteScriptPubKey(scriptPubKey, out, fIncludeHex);
+}
+
+/**
+ * Write the members of a transaction's JSON representation. Large results
+ * are encoded this way, without building a json_spirit tree first.
+ */
+void TxToJSON(const CTransaction& tx, const uint256 hashBlock, JSONStreamWriter& entry)
+{
+    WriteTx(tx, hashBlock, entry);
+}
+
+void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
+{
+    JSONValueWriter writer(entry);
+    WriteTx(tx, hashBlock, writer);
+}
+
+string getrawtransaction(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
         throw runtime_error(
@@ -185,12 +228,132 @@ Value getrawtransaction(const Array& params, bool fHelp)
     string strHex = EncodeHexTx(tx);
 
     if (!fVerbose)
-        return strHex;
+        return write_string(Value(strHex), false);
 
-    Object result;
-    result.push_back(Pair("hex", strHex));
+    string strJSON;
+    strJSON.reserve(strHex.size() * 4);
+    JSONStreamWriter result(strJSON);
+    result.BeginObject();
+    result.Pair("hex", strHex);
     TxToJSON(tx, hashBlock, result);
-    return result;
+    result.EndObject();
+    return strJSON;
+}
+
+/** Hash an address, or a hex scriptPubKey, the way -addressindex keys its entries */
+bool ParseAddressIndexScript(const string& str, uint160& hashScript)
+{
+    CBitcoinAddress address(str);
+    CScript script;
+    if (address.IsValid())
+        script = GetScriptForDestination(address.Get());
+    else if (IsHex(str)) {
+        vector<unsigned char> vch(ParseHex(str));
+        script = CScript(vch.begin(), vch.end());
+    } else
+        return false;
+    hashScript = CScriptID(script);
+    return true;
+}
+
+void AddressIndexEntryToJSON(const pair<CAddressIndexKey, CAddressIndexValue>& entry, JSONStreamWriter& out)
+{
+    const CAddressIndexKey& key = entry.first;
+    out.Pair("txid", key.txid.GetHex());
+    out.Pair("height", key.nHeight);
+    out.Pair("type", key.fSpend ? "spend" : "output");
+    out.Pair(key.fSpend ? "vin" : "vout", (int64_t)key.nIndex);
+    out.Pair("value", ValueFromAmount(entry.second.nValue).get_real());
+    if (key.fSpend) {
+        out.Key("prevout");
+        out.BeginObject();
+        out.Pair("txid", entry.second.prevout.hash.GetHex());
+        out.Pair("vout", (int64_t)entry.second.prevout.n);
+        out.EndObject();
+    } else {
+        CSpentIndexValue spent;
+        if (GetSpentIndex(COutPoint(key.txid, key.nIndex), spent)) {
+            out.Key("spentby");
+            out.BeginObject();
+            out.Pair("txid", spent.txid.GetHex());
+            out.Pair("vin", (int64_t)spent.nIndex);
+            out.Pair("height", spent.nHeight);
+            out.EndObject();
+        }
+    }
+}
+
+string getaddresshistory(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() == 3 || params.size() > 4)
+        throw runtime_error(
+            "getaddresshistory \"address\" ( count height \"txid\" )\n"
+            "\nReturns the outputs paying to an address or script, and the inputs spending them, in block height order.\n"
+            "Requires the -addressindex command line option.\n"
+            "The entries of one transaction are never split between calls, so more than count entries may be returned;\n"
+            "pass the height and txid of the last entry returned to get the next ones.\n"
+
+            "\nArguments:\n"
+            "1. \"address\"    (string, required) A bitcoin address, or a hex-encoded scriptPubKey\n"
+            "2. count          (numeric, optional, default=" + strprintf("%u", DEFAULT_ADDRESS_HISTORY_RESULTS) + ") The number of entries to return, at most " + strprintf("%u", MAX_ADDRESS_HISTORY_RESULTS) + "\n"
+            "3. height         (numeric, optional) The height of the last transaction returned by the previous call\n"
+            "4. \"txid\"       (string, required with height) The id of that transaction\n"
+
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"txid\" : \"id\",            (string) The transaction id\n"
+            "    \"height\" : n,               (numeric) The height of the block containing it\n"
+            "    \"type\" : \"output\",        (string) \"output\" for a payment to the script, \"spend\" for an input spending one\n"
+            "    \"vout\" : n,                 (numeric) The output index (\"vin\", the input index, for spends)\n"
+            "    \"value\" : x.xxx,            (numeric) The value in btc\n"
+            "    \"prevout\" : {...},          (object, spends only) The txid and vout of the output spent\n"
+            "    \"spentby\" : {...}           (object, spent outputs only) The txid, vin and height of the spending input\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+
+            "\nExamples:\n"
+            + HelpExampleCli("getaddresshistory", "\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"")
+            + HelpExampleCli("getaddresshistory", "\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\" 100 330000 \"mytxid\"")
+            + HelpExampleRpc("getaddresshistory", "\"1PSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\", 100, 330000, \"mytxid\"")
+        );
+
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled, restart with -addressindex -reindex");
+
+    uint160 hashScript;
+    if (!ParseAddressIndexScript(params[0].get_str(), hashScript))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address or script");
+
+    int nCount = DEFAULT_ADDRESS_HISTORY_RESULTS;
+    if (params.size() > 1)
+        nCount = params[1].get_int();
+    if (nCount < 0 || (unsigned int)nCount > MAX_ADDRESS_HISTORY_RESULTS)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Count out of range");
+    int nAfterHeight = -1;
+    uint256 txidAfter;
+    if (params.size() > 2) {
+        nAfterHeight = params[2].get_int();
+        if (nAfterHeight < 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative height");
+        txidAfter = ParseHashV(params[3], "txid");
+    }
+
+    vector<pair<CAddressIndexKey, CAddressIndexValue> > vEntries;
+    if (!GetAddressIndex(hashScript, nAfterHeight, txidAfter, nCount, vEntries))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read address index");
+
+    string strJSON;
+    JSONStreamWriter result(strJSON);
+    result.BeginArray();
+    for (unsigned int i = 0; i < vEntries.size(); i++) {
+        result.BeginObject();
+        AddressIndexEntryToJSON(vEntries[i], result);
+        result.EndObject();
+    }
+    result.EndArray();
+    return strJSON;
 }
 
 #ifdef ENABLE_WALLET
@@ -18,6 +18,7 @@
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
 #include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
 #include <boost/iostreams/concepts.hpp>
@@ -26,6 +27,10 @@
 #include <boost/thread.hpp>
 #include "json/json_spirit_writer_template.h"
 
+#include <deque>
+#include <set>
+#include <sstream>
+
 using namespace boost;
 using namespace boost::asio;
 using namespace json_spirit;
@@ -47,6 +52,231 @@ static boost::asio::io_service::work *rpc_dummy_work = NULL;
 static std::vector<CSubNet> rpc_allow_subnets; //!< List of subnets to allow RPC connections from
 static std::vector< boost::shared_ptr<ip::tcp::acceptor> > rpc_acceptors;
 
+
+//! Every accepted connection is serviced by its own thread, registered here
+static const size_t MAX_RPC_CONNECTIONS = 128;
+static boost::mutex cs_rpc_connections;
+static boost::condition_variable cond_rpc_connections;
+static std::set< boost::shared_ptr<AcceptedConnection> > rpc_connections;
+
+/** Call count and timing of one RPC method, reported by getrpcinfo */
+struct CRPCMethodStats
+{
+    uint64_t nCalls;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+
+    CRPCMethodStats() : nCalls(0), nTotalMicros(0), nMaxMicros(0) {}
+};
+static CCriticalSection cs_rpcStats;
+static std::map<std::string, CRPCMethodStats> mapRPCMethodStats;
+
+/** Unit of work executed by an RPC worker thread */
+class RPCWorkItem
+{
+public:
+    virtual ~RPCWorkItem() {}
+
+    //! Execute the work, called from a worker thread
+    virtual void Run() = 0;
+
+    //! Called instead of Run() for work still queued when the server stops
+    virtual void Abort() {}
+};
+
+//! Reply bytes a handler may have waiting for the connection thread before Append() blocks
+static const size_t MAX_RPC_REPLY_BUFFER = 256 * 1024;
+
+/**
+ * A request read from a connection, waiting for or being executed by an RPC
+ * worker thread. The connection thread takes the reply with WaitOutput() as
+ * the handler produces it, one request at a time, so that replies are sent
+ * back in the order the requests arrived. A handler producing output faster
+ * than the client reads it waits in Append(), so at most about
+ * MAX_RPC_REPLY_BUFFER of a reply is held in memory.
+ */
+class HTTPWorkItem : public RPCWorkItem
+{
+public:
+    HTTPWorkItem(const std::string& strURIIn, const std::map<std::string, std::string>& mapHeadersIn,
+                 const std::string& strRequestIn, const std::string& strPeerIn, bool fRunIn, int nProtoIn) :
+        strURI(strURIIn), mapHeaders(mapHeadersIn), strRequest(strRequestIn), strPeer(strPeerIn),
+        fRun(fRunIn), nProto(nProtoIn), fDone(false), fKeepOpen(false), fOutput(false), fAbandoned(false) {}
+
+    virtual void Run();
+
+    //! Drop the request without executing it; the connection will be closed
+    virtual void Abort() { Finish(false); }
+
+    //! Add reply data for the connection thread to send, first waiting for it to take what is buffered if that is too much
+    void Append(const std::string& str)
+    {
+        if (str.empty())
+            return;
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (!fAbandoned && !strReply.empty() && strReply.size() + str.size() > MAX_RPC_REPLY_BUFFER)
+            cond.wait(lock);
+        if (fAbandoned)
+            return;
+        strReply += str;
+        fOutput = true;
+        cond.notify_all();
+    }
+
+    //! Wait for reply data. Returns true once the complete reply has been taken.
+    bool WaitOutput(std::string& strOutputRet)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (!fDone && strReply.empty())
+            cond.wait(lock);
+        strOutputRet.swap(strReply);
+        strReply.clear();
+        cond.notify_all();
+        return fDone;
+    }
+
+    //! The connection thread will not take any more output; drop it instead of waiting
+    void Abandon()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fAbandoned = true;
+        strReply.clear();
+        cond.notify_all();
+    }
+
+    //! Whether the connection can be kept open after the reply (valid once complete)
+    bool KeepOpen()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        return fKeepOpen;
+    }
+
+private:
+    std::string strURI;
+    std::map<std::string, std::string> mapHeaders;
+    std::string strRequest;
+    std::string strPeer;
+    bool fRun;
+    int nProto;
+
+    boost::mutex cs;
+    boost::condition_variable cond;
+    bool fDone;
+    bool fKeepOpen;
+    bool fOutput; //!< Some of the reply has already been handed out
+    bool fAbandoned; //!< Nobody will send the rest of the reply
+    std::string strReply;
+
+    void Finish(bool fKeepOpenIn)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fKeepOpen = fKeepOpenIn;
+        fDone = true;
+        cond.notify_all();
+    }
+
+    bool HasOutput()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        return fOutput;
+    }
+};
+
+/**
+ * Bounded queue of requests waiting for a worker thread. When it is full,
+ * new requests are refused so the client gets an HTTP 503 instead of
+ * waiting indefinitely.
+ */
+class RPCWorkQueue
+{
+public:
+    RPCWorkQueue(size_t nMaxDepthIn) : nMaxDepth(nMaxDepthIn), fRunning(true), nActive(0), nPeakDepth(0), nRejected(0) {}
+
+    /**
+     * Queue work; returns false if the queue is full. Refused client requests are counted in the stats.
+     * Other work (helpers for batch requests) may only use the first half of the queue, so that
+     * one large batch cannot get concurrent clients refused.
+     */
+    bool Enqueue(const boost::shared_ptr<RPCWorkItem>& item, bool fClientRequest = true)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        size_t nLimit = fClientRequest ? nMaxDepth : nMaxDepth / 2;
+        if (!fRunning || queue.size() >= nLimit) {
+            if (fClientRequest)
+                nRejected++;
+            return false;
+        }
+        queue.push_back(item);
+        nPeakDepth = std::max(nPeakDepth, queue.size());
+        cond.notify_one();
+        return true;
+    }
+
+    //! Worker thread main loop
+    void Run()
+    {
+        while (true) {
+            boost::shared_ptr<RPCWorkItem> item;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (fRunning && queue.empty())
+                    cond.wait(lock);
+                if (!fRunning)
+                    return;
+                item = queue.front();
+                queue.pop_front();
+                nActive++;
+            }
+            item->Run();
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                nActive--;
+            }
+        }
+    }
+
+    //! Make the worker threads exit, and abort requests that have not started
+    void Interrupt()
+    {
+        std::deque< boost::shared_ptr<RPCWorkItem> > vAborted;
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            fRunning = false;
+            vAborted.swap(queue);
+            cond.notify_all();
+        }
+        BOOST_FOREACH(const boost::shared_ptr<RPCWorkItem>& item, vAborted)
+            item->Abort();
+    }
+
+    void GetStats(size_t& nDepthRet, size_t& nActiveRet, size_t& nPeakDepthRet, uint64_t& nRejectedRet)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        nDepthRet = queue.size();
+        nActiveRet = nActive;
+        nPeakDepthRet = nPeakDepth;
+        nRejectedRet = nRejected;
+    }
+
+    size_t MaxDepth() const { return nMaxDepth; }
+
+private:
+    const size_t nMaxDepth;
+    boost::mutex cs;
+    boost::condition_variable cond;
+    std::deque< boost::shared_ptr<RPCWorkItem> > queue;
+    bool fRunning;
+    size_t nActive;
+    size_t nPeakDepth;
+    uint64_t nRejected;
+};
+
+//! Requests are executed by these threads, separate from the accepting I/O threads
+static RPCWorkQueue* rpc_work_queue = NULL;
+static boost::thread_group* rpc_queue_workers = NULL;
+static int nRPCWorkThreads = 0;
+static int nRPCServerTimeout = DEFAULT_RPC_SERVER_TIMEOUT;
+
 void RPCTypeCheck(const Array& params,
                   const list<Value_type>& typesExpected,
                   bool fAllowNull)
@@ -146,7 +376,7 @@ string CRPCTable::help(string strCommand) const
 {
     string strRet;
     string category;
-    set<rpcfn_type> setDone;
+    set<CRPCActor> setDone;
     vector<pair<string, const CRPCCommand*> > vCommands;
 
     for (map<string, const CRPCCommand*>::const_iterator mi = mapCommands.begin(); mi != mapCommands.end(); ++mi)
@@ -170,9 +400,8 @@ string CRPCTable::help(string strCommand) const
         try
         {
             Array params;
-            rpcfn_type pfn = pcmd->actor;
-            if (setDone.insert(pfn).second)
-                (*pfn)(params, true);
+            if (setDone.insert(pcmd->actor).second)
+                pcmd->actor(params, true);
         }
         catch (std::exception& e)
         {
@@ -234,113 +463,183 @@ Value stop(const Array& params, bool fHelp)
     return "Bitcoin server stopping";
 }
 
+Value getrpcinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrpcinfo\n"
+            "\nReturns statistics about the RPC server: its work queue and the time spent in each method.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"connections\": xxxxx,       (numeric) The number of open RPC connections\n"
+            "  \"workqueue\": {\n"
+            "    \"threads\": xxxxx,         (numeric) The number of worker threads\n"
+            "    \"depth\": xxxxx,           (numeric) The number of requests waiting for a worker thread\n"
+            "    \"maxdepth\": xxxxx,        (numeric) The maximum queue depth (-rpcworkqueue)\n"
+            "    \"peakdepth\": xxxxx,       (numeric) The highest queue depth seen\n"
+            "    \"active\": xxxxx,          (numeric) The number of requests being executed\n"
+            "    \"rejected\": xxxxx         (numeric) The number of requests refused with HTTP 503 because the queue was full\n"
+            "  },\n"
+            "  \"methods\": {\n"
+            "    \"name\": {               (json object) Statistics for the RPC method \"name\"\n"
+            "      \"calls\": xxxxx,         (numeric) The number of calls\n"
+            "      \"totaltime\": xxxxx,     (numeric) The total time spent in the method, in milliseconds\n"
+            "      \"avgtime\": xxxxx,       (numeric) The average time per call, in milliseconds\n"
+            "      \"maxtime\": xxxxx        (numeric) The longest call, in milliseconds\n"
+            "    }, ...\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getrpcinfo", "")
+            + HelpExampleRpc("getrpcinfo", "")
+        );
+
+    Object obj;
+    {
+        boost::unique_lock<boost::mutex> lock(cs_rpc_connections);
+        obj.push_back(Pair("connections", (uint64_t)rpc_connections.size()));
+    }
+    if (rpc_work_queue != NULL)
+    {
+        size_t nDepth, nActive, nPeakDepth;
+        uint64_t nRejected;
+        rpc_work_queue->GetStats(nDepth, nActive, nPeakDepth, nRejected);
+        Object queue;
+        queue.push_back(Pair("threads", nRPCWorkThreads));
+        queue.push_back(Pair("depth", (uint64_t)nDepth));
+        queue.push_back(Pair("maxdepth", (uint64_t)rpc_work_queue->MaxDepth()));
+        queue.push_back(Pair("peakdepth", (uint64_t)nPeakDepth));
+        queue.push_back(Pair("active", (uint64_t)nActive));
+        queue.push_back(Pair("rejected", nRejected));
+        obj.push_back(Pair("workqueue", queue));
+    }
+    Object methods;
+    {
+        LOCK(cs_rpcStats);
+        BOOST_FOREACH(const PAIRTYPE(std::string, CRPCMethodStats)& item, mapRPCMethodStats)
+        {
+            const CRPCMethodStats& stats = item.second;
+            Object entry;
+            entry.push_back(Pair("calls", stats.nCalls));
+            entry.push_back(Pair("totaltime", stats.nTotalMicros * 0.001));
+            entry.push_back(Pair("avgtime", stats.nCalls ? stats.nTotalMicros * 0.001 / stats.nCalls : 0.0));
+            entry.push_back(Pair("maxtime", stats.nMaxMicros * 0.001));
+            methods.push_back(Pair(item.first, entry));
+        }
+    }
+    obj.push_back(Pair("methods", methods));
+    return obj;
+}
+
 
 
 /**
  * Call Table
  */
 static const CRPCCommand vRPCCommands[] =
-{ //  category              name                      actor (function)         okSafeMode threadSafe reqWallet
-  //  --------------------- ------------------------  -----------------------  ---------- ---------- ---------
+{ //  category              name                      actor (function)         okSafeMode threadSafe reqWallet  parallel
+  //  --------------------- ------------------------  -----------------------  ---------- ---------- ---------  --------
     /* Overall control/query calls */
-    { "control",            "getinfo",                &getinfo,                true,      false,      false }, /* uses wallet if enabled */
-    { "control",            "help",                   &help,                   true,      true,       false },
-    { "control",            "stop",                   &stop,                   true,      true,       false },
-    { "control",            "setmocktime",            &setmocktime,            true,      false,      false },
+    { "control",            "getinfo",                &getinfo,                true,      false,      false,     true }, /* uses wallet if enabled */
+    { "control",            "help",                   &help,                   true,      true,       false,     true },
+    { "control",            "stop",                   &stop,                   true,      true,       false,     false },
+    { "control",            "getrpcinfo",             &getrpcinfo,             true,      true,       false,     true },
+    { "control",            "setmocktime",            &setmocktime,            true,      false,      false,     false },
 
     /* P2P networking */
-    { "network",            "getnetworkinfo",         &getnetworkinfo,         true,      false,      false },
-    { "network",            "addnode",                &addnode,                true,      true,       false },
-    { "network",            "getaddednodeinfo",       &getaddednodeinfo,       true,      true,       false },
-    { "network",            "getconnectioncount",     &getconnectioncount,     true,      false,      false },
-    { "network",            "getnettotals",           &getnettotals,           true,      true,       false },
-    { "network",            "getpeerinfo",            &getpeerinfo,            true,      false,      false },
-    { "network",            "ping",                   &ping,                   true,      false,      false },
+    { "network",            "getnetworkinfo",         &getnetworkinfo,         true,      false,      false,     true },
+    { "network",            "addnode",                &addnode,                true,      true,       false,     false },
+    { "network",            "getaddednodeinfo",       &getaddednodeinfo,       true,      true,       false,     true },
+    { "network",            "getconnectioncount",     &getconnectioncount,     true,      false,      false,     true },
+    { "network",            "getnettotals",           &getnettotals,           true,      true,       false,     true },
+    { "network",            "getpeerinfo",            &getpeerinfo,            true,      false,      false,     true },
+    { "network",            "ping",                   &ping,                   true,      false,      false,     false },
 
     /* Block chain and UTXO */
-    { "blockchain",         "getblockchaininfo",      &getblockchaininfo,      true,      false,      false },
-    { "blockchain",         "getbestblockhash",       &getbestblockhash,       true,      false,      false },
-    { "blockchain",         "getblockcount",          &getblockcount,          true,      false,      false },
-    { "blockchain",         "getblock",               &getblock,               true,      false,      false },
-    { "blockchain",         "getblockhash",           &getblockhash,           true,      false,      false },
-    { "blockchain",         "getchaintips",           &getchaintips,           true,      false,      false },
-    { "blockchain",         "getdifficulty",          &getdifficulty,          true,      false,      false },
-    { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true,      true,       false },
-    { "blockchain",         "getrawmempool",          &getrawmempool,          true,      false,      false },
-    { "blockchain",         "gettxout",               &gettxout,               true,      false,      false },
-    { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false,      false },
-    { "blockchain",         "verifychain",            &verifychain,            true,      false,      false },
+    { "blockchain",         "getblockchaininfo",      &getblockchaininfo,      true,      false,      false,     true },
+    { "blockchain",         "getbestblockhash",       &getbestblockhash,       true,      true,       false,     true },
+    { "blockchain",         "getblockcount",          &getblockcount,          true,      true,       false,     true },
+    { "blockchain",         "getblock",               &getblock,               true,      true,       false,     true },
+    { "blockchain",         "getblockhash",           &getblockhash,           true,      true,       false,     true },
+    { "blockchain",         "getchaintips",           &getchaintips,           true,      false,      false,     true },
+    { "blockchain",         "getdifficulty",          &getdifficulty,          true,      true,       false,     true },
+    { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true,      true,       false,     true },
+    { "blockchain",         "getrawmempool",          &getrawmempool,          true,      true,       false,     true },
+    { "blockchain",         "gettxout",               &gettxout,               true,      false,      false,     true },
+    { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true,      true,       false,     true },
+    { "blockchain",         "verifychain",            &verifychain,            true,      false,      false,     false },
 
     /* Mining */
-    { "mining",             "getblocktemplate",       &getblocktemplate,       true,      false,      false },
-    { "mining",             "getmininginfo",          &getmininginfo,          true,      false,      false },
-    { "mining",             "getnetworkhashps",       &getnetworkhashps,       true,      false,      false },
-    { "mining",             "prioritisetransaction",  &prioritisetransaction,  true,      false,      false },
-    { "mining",             "submitblock",            &submitblock,            true,      true,       false },
+    { "mining",             "getblocktemplate",       &getblocktemplate,       true,      false,      false,     false },
+    { "mining",             "getmininginfo",          &getmininginfo,          true,      false,      false,     true },
+    { "mining",             "getnetworkhashps",       &getnetworkhashps,       true,      false,      false,     true },
+    { "mining",             "prioritisetransaction",  &prioritisetransaction,  true,      false,      false,     false },
+    { "mining",             "submitblock",            &submitblock,            true,      true,       false,     false },
 
 #ifdef ENABLE_WALLET
     /* Coin generation */
-    { "generating",         "getgenerate",            &getgenerate,            true,      false,      false },
-    { "generating",         "gethashespersec",        &gethashespersec,        true,      false,      false },
-    { "generating",         "setgenerate",            &setgenerate,            true,      true,       false },
+    { "generating",         "getgenerate",            &getgenerate,            true,      false,      false,     true },
+    { "generating",         "gethashespersec",        &gethashespersec,        true,      false,      false,     true },
+    { "generating",         "setgenerate",            &setgenerate,            true,      true,       false,     false },
 #endif
 
     /* Raw transactions */
-    { "rawtransactions",    "createrawtransaction",   &createrawtransaction,   true,      false,      false },
-    { "rawtransactions",    "decoderawtransaction",   &decoderawtransaction,   true,      false,      false },
-    { "rawtransactions",    "decodescript",           &decodescript,           true,      false,      false },
-    { "rawtransactions",    "getrawtransaction",      &getrawtransaction,      true,      false,      false },
-    { "rawtransactions",    "sendrawtransaction",     &sendrawtransaction,     false,     false,      false },
-    { "rawtransactions",    "signrawtransaction",     &signrawtransaction,     false,     false,      false }, /* uses wallet if enabled */
+    { "rawtransactions",    "createrawtransaction",   &createrawtransaction,   true,      false,      false,     true },
+    { "rawtransactions",    "decoderawtransaction",   &decoderawtransaction,   true,      false,      false,     true },
+    { "rawtransactions",    "decodescript",           &decodescript,           true,      false,      false,     true },
+    { "rawtransactions",    "getrawtransaction",      &getrawtransaction,      true,      false,      false,     true },
+    { "rawtransactions",    "getaddresshistory",      &getaddresshistory,      true,      true,       false,     true },
+    { "rawtransactions",    "sendrawtransaction",     &sendrawtransaction,     false,     false,      false,     false },
+    { "rawtransactions",    "signrawtransaction",     &signrawtransaction,     false,     false,      false,     false }, /* uses wallet if enabled */
 
     /* Utility functions */
-    { "util",               "createmultisig",         &createmultisig,         true,      true ,      false },
-    { "util",               "validateaddress",        &validateaddress,        true,      false,      false }, /* uses wallet if enabled */
-    { "util",               "verifymessage",          &verifymessage,          true,      false,      false },
-    { "util",               "estimatefee",            &estimatefee,            true,      true,       false },
-    { "util",               "estimatepriority",       &estimatepriority,       true,      true,       false },
+    { "util",               "createmultisig",         &createmultisig,         true,      true,       false,     true },
+    { "util",               "validateaddress",        &validateaddress,        true,      false,      false,     true }, /* uses wallet if enabled */
+    { "util",               "verifymessage",          &verifymessage,          true,      false,      false,     true },
+    { "util",               "estimatefee",            &estimatefee,            true,      true,       false,     true },
+    { "util",               "estimatepriority",       &estimatepriority,       true,      true,       false,     true },
 
 #ifdef ENABLE_WALLET
     /* Wallet */
-    { "wallet",             "addmultisigaddress",     &addmultisigaddress,     true,      false,      true },
-    { "wallet",             "backupwallet",           &backupwallet,           true,      false,      true },
-    { "wallet",             "dumpprivkey",            &dumpprivkey,            true,      false,      true },
-    { "wallet",             "dumpwallet",             &dumpwallet,             true,      false,      true },
-    { "wallet",             "encryptwallet",          &encryptwallet,          true,      false,      true },
-    { "wallet",             "getaccountaddress",      &getaccountaddress,      true,      false,      true },
-    { "wallet",             "getaccount",             &getaccount,             true,      false,      true },
-    { "wallet",             "getaddressesbyaccount",  &getaddressesbyaccount,  true,      false,      true },
-    { "wallet",             "getbalance",             &getbalance,             false,     false,      true },
-    { "wallet",             "getnewaddress",          &getnewaddress,          true,      false,      true },
-    { "wallet",             "getrawchangeaddress",    &getrawchangeaddress,    true,      false,      true },
-    { "wallet",             "getreceivedbyaccount",   &getreceivedbyaccount,   false,     false,      true },
-    { "wallet",             "getreceivedbyaddress",   &getreceivedbyaddress,   false,     false,      true },
-    { "wallet",             "gettransaction",         &gettransaction,         false,     false,      true },
-    { "wallet",             "getunconfirmedbalance",  &getunconfirmedbalance,  false,     false,      true },
-    { "wallet",             "getwalletinfo",          &getwalletinfo,          false,     false,      true },
-    { "wallet",             "importprivkey",          &importprivkey,          true,      false,      true },
-    { "wallet",             "importwallet",           &importwallet,           true,      false,      true },
-    { "wallet",             "importaddress",          &importaddress,          true,      false,      true },
-    { "wallet",             "keypoolrefill",          &keypoolrefill,          true,      false,      true },
-    { "wallet",             "listaccounts",           &listaccounts,           false,     false,      true },
-    { "wallet",             "listaddressgroupings",   &listaddressgroupings,   false,     false,      true },
-    { "wallet",             "listlockunspent",        &listlockunspent,        false,     false,      true },
-    { "wallet",             "listreceivedbyaccount",  &listreceivedbyaccount,  false,     false,      true },
-    { "wallet",             "listreceivedbyaddress",  &listreceivedbyaddress,  false,     false,      true },
-    { "wallet",             "listsinceblock",         &listsinceblock,         false,     false,      true },
-    { "wallet",             "listtransactions",       &listtransactions,       false,     false,      true },
-    { "wallet",             "listunspent",            &listunspent,            false,     false,      true },
-    { "wallet",             "lockunspent",            &lockunspent,            true,      false,      true },
-    { "wallet",             "move",                   &movecmd,                false,     false,      true },
-    { "wallet",             "sendfrom",               &sendfrom,               false,     false,      true },
-    { "wallet",             "sendmany",               &sendmany,               false,     false,      true },
-    { "wallet",             "sendtoaddress",          &sendtoaddress,          false,     false,      true },
-    { "wallet",             "setaccount",             &setaccount,             true,      false,      true },
-    { "wallet",             "settxfee",               &settxfee,               true,      false,      true },
-    { "wallet",             "signmessage",            &signmessage,            true,      false,      true },
-    { "wallet",             "walletlock",             &walletlock,             true,      false,      true },
-    { "wallet",             "walletpassphrasechange", &walletpassphrasechange, true,      false,      true },
-    { "wallet",             "walletpassphrase",       &walletpassphrase,       true,      false,      true },
+    { "wallet",             "addmultisigaddress",     &addmultisigaddress,     true,      false,      true,      false },
+    { "wallet",             "backupwallet",           &backupwallet,           true,      false,      true,      false },
+    { "wallet",             "dumpprivkey",            &dumpprivkey,            true,      false,      true,      false },
+    { "wallet",             "dumpwallet",             &dumpwallet,             true,      false,      true,      false },
+    { "wallet",             "encryptwallet",          &encryptwallet,          true,      false,      true,      false },
+    { "wallet",             "getaccountaddress",      &getaccountaddress,      true,      false,      true,      false },
+    { "wallet",             "getaccount",             &getaccount,             true,      false,      true,      true },
+    { "wallet",             "getaddressesbyaccount",  &getaddressesbyaccount,  true,      false,      true,      true },
+    { "wallet",             "getbalance",             &getbalance,             false,     false,      true,      true },
+    { "wallet",             "getnewaddress",          &getnewaddress,          true,      false,      true,      false },
+    { "wallet",             "getrawchangeaddress",    &getrawchangeaddress,    true,      false,      true,      false },
+    { "wallet",             "getreceivedbyaccount",   &getreceivedbyaccount,   false,     false,      true,      true },
+    { "wallet",             "getreceivedbyaddress",   &getreceivedbyaddress,   false,     false,      true,      true },
+    { "wallet",             "gettransaction",         &gettransaction,         false,     false,      true,      true },
+    { "wallet",             "getunconfirmedbalance",  &getunconfirmedbalance,  false,     false,      true,      true },
+    { "wallet",             "getwalletinfo",          &getwalletinfo,          false,     false,      true,      true },
+    { "wallet",             "importprivkey",          &importprivkey,          true,      true,       true,      false },
+    { "wallet",             "importwallet",           &importwallet,           true,      true,       true,      false },
+    { "wallet",             "importaddress",          &importaddress,          true,      true,       true,      false },
+    { "wallet",             "keypoolrefill",          &keypoolrefill,          true,      false,      true,      false },
+    { "wallet",             "listaccounts",           &listaccounts,           false,     false,      true,      true },
+    { "wallet",             "listaddressgroupings",   &listaddressgroupings,   false,     false,      true,      true },
+    { "wallet",             "listlockunspent",        &listlockunspent,        false,     false,      true,      true },
+    { "wallet",             "listreceivedbyaccount",  &listreceivedbyaccount,  false,     false,      true,      true },
+    { "wallet",             "listreceivedbyaddress",  &listreceivedbyaddress,  false,     false,      true,      true },
+    { "wallet",             "listsinceblock",         &listsinceblock,         false,     false,      true,      true },
+    { "wallet",             "listtransactions",       &listtransactions,       false,     false,      true,      true },
+    { "wallet",             "listunspent",            &listunspent,            false,     false,      true,      true },
+    { "wallet",             "lockunspent",            &lockunspent,            true,      false,      true,      false },
+    { "wallet",             "move",                   &movecmd,                false,     false,      true,      false },
+    { "wallet",             "sendfrom",               &sendfrom,               false,     false,      true,      false },
+    { "wallet",             "sendmany",               &sendmany,               false,     false,      true,      false },
+    { "wallet",             "sendtoaddress",          &sendtoaddress,          false,     false,      true,      false },
+    { "wallet",             "setaccount",             &setaccount,             true,      false,      true,      false },
+    { "wallet",             "settxfee",               &settxfee,               true,      false,      true,      false },
+    { "wallet",             "signmessage",            &signmessage,            true,      false,      true,      false },
+    { "wallet",             "walletlock",             &walletlock,             true,      false,      true,      false },
+    { "wallet",             "walletpassphrasechange", &walletpassphrasechange, true,      false,      true,      false },
+    { "wallet",             "walletpassphrase",       &walletpassphrase,       true,      false,      true,      false },
 #endif // ENABLE_WALLET
 };
 
@@ -418,7 +717,8 @@ bool ClientAllowed(const boost::asio::ip::address& address)
 }
 
 template <typename Protocol>
-class AcceptedConnectionImpl : public AcceptedConnection
+class AcceptedConnectionImpl : public AcceptedConnection,
+                               public boost::enable_shared_from_this< AcceptedConnectionImpl<Protocol> >
 {
 public:
     AcceptedConnectionImpl(
@@ -427,7 +727,11 @@ public:
             bool fUseSSL) :
         sslStream(io_service, context),
         _d(sslStream, fUseSSL),
-        _stream(_d)
+        _stream(_d),
+        idleStrand(io_service),
+        idleTimer(io_service),
+        nIdleTimerGeneration(0),
+        fClosed(false)
     {
     }
 
@@ -443,19 +747,116 @@ public:
 
     virtual void close()
     {
+        boost::unique_lock<boost::mutex> lock(cs_socket);
+        fClosed = true;
         _stream.close();
     }
 
+    virtual void set_idle_timeout(int nSeconds)
+    {
+        // The timer is only touched on the io_service threads, through the
+        // strand, so it is never used concurrently with its own handler.
+        idleStrand.post(boost::bind(&AcceptedConnectionImpl<Protocol>::arm_idle_timer, this->shared_from_this(), nSeconds));
+    }
+
+    virtual void shutdown()
+    {
+        boost::unique_lock<boost::mutex> lock(cs_socket);
+        if (fClosed)
+            return;
+        boost::system::error_code ec;
+        sslStream.lowest_layer().shutdown(socket_base::shutdown_both, ec);
+    }
+
     typename Protocol::endpoint peer;
     asio::ssl::stream<typename Protocol::socket> sslStream;
 
 private:
     SSLIOStreamDevice<Protocol> _d;
     iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
+    //! Serializes all use of idleTimer and nIdleTimerGeneration
+    asio::io_service::strand idleStrand;
+    deadline_timer idleTimer;
+    //! Bumped whenever the timer is re-armed or cancelled, so a handler that was already queued can tell it is stale
+    unsigned int nIdleTimerGeneration;
+    //! Protects shutting down the socket from another thread against closing it
+    boost::mutex cs_socket;
+    bool fClosed;
+
+    void arm_idle_timer(int nSeconds)
+    {
+        boost::system::error_code ec;
+        nIdleTimerGeneration++;
+        idleTimer.cancel(ec);
+        if (nSeconds <= 0)
+            return;
+        idleTimer.expires_from_now(posix_time::seconds(nSeconds), ec);
+        idleTimer.async_wait(idleStrand.wrap(boost::bind(&AcceptedConnectionImpl<Protocol>::idle_timeout, this->shared_from_this(), nIdleTimerGeneration, _1)));
+    }
+
+    void idle_timeout(unsigned int nGeneration, const boost::system::error_code& error)
+    {
+        if (error != asio::error::operation_aborted && nGeneration == nIdleTimerGeneration)
+            shutdown();
+    }
+};
+
+/**
+ * Connection given to request handlers running on a worker thread, while the
+ * socket is owned by the connection thread. Whatever the handler has written
+ * is passed on to the connection thread each time it flushes the stream, so
+ * long replies are sent while they are being produced.
+ */
+class WorkItemConnection : public AcceptedConnection
+{
+public:
+    WorkItemConnection(HTTPWorkItem& itemIn, const std::string& strPeerIn) :
+        buf(itemIn), _stream(&buf), strPeer(strPeerIn) {}
+
+    virtual std::iostream& stream() { return _stream; }
+    virtual std::string peer_address_to_string() const { return strPeer; }
+    virtual void close() { _stream.flush(); }
+    virtual void set_idle_timeout(int nSeconds) {}
+    virtual void shutdown() {}
+
+    //! Drop output that has not been flushed yet
+    void discard() { buf.str(std::string()); }
+
+private:
+    class WorkItemBuf : public std::stringbuf
+    {
+    public:
+        WorkItemBuf(HTTPWorkItem& itemIn) : item(itemIn) {}
+    protected:
+        virtual int sync()
+        {
+            item.Append(str());
+            str(std::string());
+            return 0;
+        }
+    private:
+        HTTPWorkItem& item;
+    };
+
+    WorkItemBuf buf;
+    std::iostream _stream;
+    std::string strPeer;
 };
 
 void ServiceConnection(AcceptedConnection *conn);
 
+static void RPCConnectionThread(boost::shared_ptr<AcceptedConnection> conn)
+{
+    RenameThread("bitcoin-rpcconn");
+    ServiceConnection(conn.get());
+    conn->set_idle_timeout(0);
+    conn->close();
+
+    boost::unique_lock<boost::mutex> lock(cs_rpc_connections);
+    rpc_connections.erase(conn);
+    cond_rpc_connections.notify_all();
+}
+
 //! Forward declaration required for RPCListen
 template <typename Protocol, typename SocketAcceptorService>
 static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
@@ -519,8 +920,29 @@ static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol,
         conn->close();
     }
     else {
-        ServiceConnection(conn.get());
-        conn->close();
+        // Service the connection on its own thread, so that the I/O threads
+        // only accept connections and never block on a client.
+        boost::unique_lock<boost::mutex> lock(cs_rpc_connections);
+        bool fStarted = false;
+        if (rpc_connections.size() < MAX_RPC_CONNECTIONS)
+        {
+            rpc_connections.insert(conn);
+            try {
+                boost::thread t(boost::bind(&RPCConnectionThread, conn));
+                t.detach();
+                fStarted = true;
+            } catch (const boost::thread_resource_error& e) {
+                LogPrintf("%s: Error: %s\n", __func__, e.what());
+                rpc_connections.erase(conn);
+            }
+        }
+        lock.unlock();
+        if (!fStarted)
+        {
+            LogPrint("rpc", "Refusing RPC connection from %s: too many connections\n", conn->peer_address_to_string());
+            conn->stream() << HTTPError(HTTP_SERVICE_UNAVAILABLE, false) << std::flush;
+            conn->close();
+        }
     }
 }
 
@@ -683,9 +1105,16 @@ void StartRPCThreads()
         return;
     }
 
+    nRPCServerTimeout = GetArg("-rpcservertimeout", DEFAULT_RPC_SERVER_TIMEOUT);
+    nRPCWorkThreads = std::max((int)GetArg("-rpcthreads", DEFAULT_RPC_THREADS), 1);
+    rpc_work_queue = new RPCWorkQueue(std::max((int)GetArg("-rpcworkqueue", DEFAULT_RPC_WORKQUEUE), 1));
+    rpc_queue_workers = new boost::thread_group();
+    for (int i = 0; i < nRPCWorkThreads; i++)
+        rpc_queue_workers->create_thread(boost::bind(&RPCWorkQueue::Run, rpc_work_queue));
+
+    // The I/O thread only accepts connections and runs timers
     rpc_worker_group = new boost::thread_group();
-    for (int i = 0; i < GetArg("-rpcthreads", 4); i++)
-        rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
+    rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
     fRPCRunning = true;
 }
 
@@ -729,9 +1158,26 @@ void StopRPCThreads()
     deadlineTimers.clear();
 
     rpc_io_service->stop();
-    cvBlockChange.notify_all();
     if (rpc_worker_group != NULL)
         rpc_worker_group->join_all();
+
+    // No more connections can be accepted now. Drop queued requests, wake up
+    // long-polling ones and unblock connection threads waiting on a client.
+    if (rpc_work_queue != NULL)
+        rpc_work_queue->Interrupt();
+    cvBlockChange.notify_all();
+    {
+        boost::unique_lock<boost::mutex> lock(cs_rpc_connections);
+        BOOST_FOREACH(const boost::shared_ptr<AcceptedConnection>& conn, rpc_connections)
+            conn->shutdown();
+        while (!rpc_connections.empty())
+            cond_rpc_connections.wait(lock);
+    }
+    if (rpc_queue_workers != NULL)
+        rpc_queue_workers->join_all();
+
+    delete rpc_queue_workers; rpc_queue_workers = NULL;
+    delete rpc_work_queue; rpc_work_queue = NULL;
     delete rpc_dummy_work; rpc_dummy_work = NULL;
     delete rpc_worker_group; rpc_worker_group = NULL;
     delete rpc_ssl_context; rpc_ssl_context = NULL;
@@ -817,37 +1263,124 @@ void JSONRequest::parse(const Value& valRequest)
 }
 
 
-static Object JSONRPCExecOne(const Value& req)
+static string JSONRPCExecOne(const Value& req)
 {
-    Object rpc_result;
+    string rpc_result;
 
     JSONRequest jreq;
     try {
         jreq.parse(req);
 
-        Value result = tableRPC.execute(jreq.strMethod, jreq.params);
-        rpc_result = JSONRPCReplyObj(result, Value::null, jreq.id);
+        RPCResult result = tableRPC.execute(jreq.strMethod, jreq.params);
+        rpc_result = WriteJSONRPCReply(result, Value::null, jreq.id);
     }
     catch (Object& objError)
     {
-        rpc_result = JSONRPCReplyObj(Value::null, objError, jreq.id);
+        rpc_result = WriteJSONRPCReply(RPCResult(), objError, jreq.id);
     }
     catch (std::exception& e)
     {
-        rpc_result = JSONRPCReplyObj(Value::null,
-                                     JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+        rpc_result = WriteJSONRPCReply(RPCResult(),
+                                       JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
     }
 
     return rpc_result;
 }
 
+/**
+ * A run of batch requests executed concurrently. The job is queued once for
+ * every worker thread that should help, and the thread that owns the batch
+ * works on it too, so the batch completes even if no worker is free.
+ */
+class JSONRPCBatchJob : public RPCWorkItem
+{
+public:
+    JSONRPCBatchJob(Array::const_iterator begin, Array::const_iterator end) :
+        vReq(begin, end), vResult(vReq.size()), nNext(0), nDone(0) {}
+
+    virtual void Run()
+    {
+        while (true) {
+            size_t i;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                if (nNext >= vReq.size())
+                    return;
+                i = nNext++;
+            }
+            string result = JSONRPCExecOne(vReq[i]);
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                vResult[i] = result;
+                if (++nDone == vReq.size())
+                    cond.notify_all();
+            }
+        }
+    }
+
+    //! Work on the batch from the calling thread, then wait for the helpers to finish
+    void Finish(std::vector<string>& ret)
+    {
+        Run();
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (nDone < vReq.size())
+            cond.wait(lock);
+        ret.insert(ret.end(), vResult.begin(), vResult.end());
+    }
+
+private:
+    const Array vReq;
+    std::vector<string> vResult;
+    boost::mutex cs;
+    boost::condition_variable cond;
+    size_t nNext;
+    size_t nDone;
+};
+
+//! Whether a batch element calls a method that can run concurrently with others
+static bool IsParallelRequest(const Value& req)
+{
+    if (req.type() != obj_type)
+        return false;
+    const Value& valMethod = find_value(req.get_obj(), "method");
+    if (valMethod.type() != str_type)
+        return false;
+    const CRPCCommand *pcmd = tableRPC[valMethod.get_str()];
+    return pcmd && pcmd->parallel;
+}
+
 static string JSONRPCExecBatch(const Array& vReq)
 {
-    Array ret;
-    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+    // Encoded replies, in request order
+    std::vector<string> ret;
+    unsigned int reqIdx = 0;
+    while (reqIdx < vReq.size())
+    {
+        // Consecutive calls without side effects are spread over the worker
+        // threads; any other call acts as a barrier so that its effects are
+        // ordered with respect to the calls around it.
+        unsigned int reqEnd = reqIdx;
+        while (reqEnd < vReq.size() && IsParallelRequest(vReq[reqEnd]))
+            reqEnd++;
+        if (reqEnd - reqIdx < 2 || rpc_work_queue == NULL || nRPCWorkThreads < 2)
+        {
+            ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+            reqIdx++;
+            continue;
+        }
+
+        boost::shared_ptr<JSONRPCBatchJob> job(new JSONRPCBatchJob(vReq.begin() + reqIdx, vReq.begin() + reqEnd));
+        // Helpers are optional: whatever they don't pick up is run here. The
+        // queue refuses them once it is half full, leaving room for clients.
+        unsigned int nHelpers = std::min(reqEnd - reqIdx - 1, (unsigned int)nRPCWorkThreads - 1);
+        for (unsigned int i = 0; i < nHelpers; i++)
+            if (!rpc_work_queue->Enqueue(job, false))
+                break;
+        job->Finish(ret);
+        reqIdx = reqEnd;
+    }
 
-    return write_string(Value(ret), false) + "\n";
+    return "[" + boost::algorithm::join(ret, ",") + "]\n";
 }
 
 static bool HTTPReq_JSONRPC(AcceptedConnection *conn,
@@ -895,10 +1428,10 @@ static bool HTTPReq_JSONRPC(AcceptedConnection *conn,
         if (valRequest.type() == obj_type) {
             jreq.parse(valRequest);
 
-            Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+            RPCResult result = tableRPC.execute(jreq.strMethod, jreq.params);
 
             // Send reply
-            strReply = JSONRPCReply(result, Value::null, jreq.id);
+            strReply = WriteJSONRPCReply(result, Value::null, jreq.id) + "\n";
 
         // array of requests
         } else if (valRequest.type() == array_type)
@@ -921,44 +1454,153 @@ static bool HTTPReq_JSONRPC(AcceptedConnection *conn,
     return true;
 }
 
-void ServiceConnection(AcceptedConnection *conn)
+void HTTPWorkItem::Run()
 {
-    bool fRun = true;
-    while (fRun && !ShutdownRequested())
+    WorkItemConnection conn(*this, strPeer);
+    bool fKeepOpenRet = false;
+    bool fError = false;
+    try
     {
-        int nProto = 0;
-        map<string, string> mapHeaders;
-        string strRequest, strMethod, strURI;
+        // Process via JSON-RPC API
+        if (strURI == "/")
+            fKeepOpenRet = HTTPReq_JSONRPC(&conn, strRequest, mapHeaders, fRun);
 
-        // Read HTTP request line
-        if (!ReadHTTPRequestLine(conn->stream(), nProto, strMethod, strURI))
-            break;
+        // Process via HTTP REST API
+        else if (strURI.substr(0, 6) == "/rest/")
+            fKeepOpenRet = HTTPReq_REST(&conn, strURI, strRequest, mapHeaders, fRun, nProto);
 
-        // Read HTTP message headers and body
-        ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto, MAX_SIZE);
+        else
+            conn.stream() << HTTPError(HTTP_NOT_FOUND, false) << std::flush;
+    }
+    catch (std::exception& e)
+    {
+        LogPrintf("%s: Error: %s\n", __func__, e.what());
+        fError = true;
+    }
+    catch (...)
+    {
+        fError = true;
+    }
+    if (fError)
+    {
+        // Once part of the reply is out, all we can do is close the connection
+        conn.discard();
+        if (!HasOutput())
+            Append(HTTPError(HTTP_INTERNAL_SERVER_ERROR, false));
+        Finish(false);
+        return;
+    }
+    conn.close();
+    Finish(fKeepOpenRet);
+}
 
-        // HTTP Keep-Alive is false; close connection immediately
-        if (mapHeaders["connection"] == "close")
-            fRun = false;
+//! Maximum number of pipelined requests read ahead of their replies on one connection
+static const size_t MAX_RPC_PIPELINE_DEPTH = 16;
 
-        // Process via JSON-RPC API
-        if (strURI == "/") {
-            if (!HTTPReq_JSONRPC(conn, strRequest, mapHeaders, fRun))
+void ServiceConnection(AcceptedConnection *conn)
+{
+    bool fRun = true;
+    while (fRun && !ShutdownRequested())
+    {
+        // Read the next request, plus any requests the client has already
+        // pipelined behind it, and queue them all for the worker threads.
+        std::vector< boost::shared_ptr<HTTPWorkItem> > vPending;
+        bool fQueueFull = false;
+        do
+        {
+            int nProto = 0;
+            map<string, string> mapHeaders;
+            string strRequest, strMethod, strURI;
+
+            // Read HTTP request line
+            conn->set_idle_timeout(nRPCServerTimeout);
+            if (!ReadHTTPRequestLine(conn->stream(), nProto, strMethod, strURI)) {
+                fRun = false;
                 break;
+            }
 
-        // Process via HTTP REST API
-        } else if (strURI.substr(0, 6) == "/rest/") {
-            if (!HTTPReq_REST(conn, strURI, mapHeaders, fRun))
-                break;
+            // Read HTTP message headers and body
+            ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto, MAX_SIZE);
+            conn->set_idle_timeout(0);
+
+            // HTTP Keep-Alive is false; close connection immediately
+            if (mapHeaders["connection"] == "close")
+                fRun = false;
 
-        } else {
-            conn->stream() << HTTPError(HTTP_NOT_FOUND, false) << std::flush;
+            boost::shared_ptr<HTTPWorkItem> item(new HTTPWorkItem(strURI, mapHeaders, strRequest, conn->peer_address_to_string(), fRun, nProto));
+            if (!rpc_work_queue->Enqueue(item)) {
+                fQueueFull = true;
+                fRun = false;
+                break;
+            }
+            vPending.push_back(item);
+        } while (fRun && vPending.size() < MAX_RPC_PIPELINE_DEPTH &&
+                 conn->stream().rdbuf()->in_avail() > 0);
+        conn->set_idle_timeout(0);
+
+        // Send the replies in request order, forwarding each as it is produced
+        bool fOpen = true;
+        BOOST_FOREACH(const boost::shared_ptr<HTTPWorkItem>& item, vPending)
+        {
+            bool fComplete = !fOpen;
+            while (!fComplete)
+            {
+                string strOutput;
+                fComplete = item->WaitOutput(strOutput);
+                conn->stream() << strOutput << std::flush;
+            }
+            if (fOpen)
+                fOpen = item->KeepOpen();
+            // Handlers of requests whose replies won't be sent must not wait for us
+            if (!fOpen)
+                item->Abandon();
+        }
+        if (!fOpen)
             break;
+
+        if (fQueueFull)
+        {
+            LogPrint("rpc", "RPC work queue full, refusing request from %s\n", conn->peer_address_to_string());
+            conn->stream() << HTTPError(HTTP_SERVICE_UNAVAILABLE, false) << std::flush;
         }
     }
 }
 
-json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+/** Adds the lifetime of the object to the statistics of an RPC method */
+class CRPCCallTimer
+{
+public:
+    CRPCCallTimer(const std::string& strMethodIn) : strMethod(strMethodIn), nTimeStart(GetTimeMicros()) {}
+    ~CRPCCallTimer()
+    {
+        int64_t nTime = GetTimeMicros() - nTimeStart;
+        LOCK(cs_rpcStats);
+        CRPCMethodStats& stats = mapRPCMethodStats[strMethod];
+        stats.nCalls++;
+        stats.nTotalMicros += nTime;
+        stats.nMaxMicros = std::max(stats.nMaxMicros, nTime);
+    }
+
+private:
+    const std::string& strMethod;
+    int64_t nTimeStart;
+};
+
+RPCResult CRPCActor::operator()(const Array& params, bool fHelp) const
+{
+    if (pfnEncoded)
+        return RPCResult::FromEncoded((*pfnEncoded)(params, fHelp));
+    return (*pfn)(params, fHelp);
+}
+
+bool CRPCActor::operator<(const CRPCActor& other) const
+{
+    if (pfn != other.pfn)
+        return std::less<rpcfn_type>()(pfn, other.pfn);
+    return std::less<rpcfn_encoded_type>()(pfnEncoded, other.pfnEncoded);
+}
+
+RPCResult CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
 {
     // Find method
     const CRPCCommand *pcmd = tableRPC[strMethod];
@@ -975,10 +1617,18 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
         !pcmd->okSafeMode)
         throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, string("Safe mode: ") + strWarning);
 
+    // Record the time spent in the method, including waiting for locks
+    CRPCCallTimer timer(strMethod);
+#ifdef ENABLE_WALLET
+    // Let the wallet see everything validated before this call, e.g. a
+    // transaction just submitted with sendrawtransaction
+    if (pcmd->reqWallet)
+        SyncWithValidationNotifications();
+#endif
     try
     {
         // Execute
-        Value result;
+        RPCResult result;
         {
             if (pcmd->threadSafe)
                 result = pcmd->actor(params, false);
@@ -22,6 +22,16 @@
 class CBlockIndex;
 class CNetAddr;
 
+/** Default number of threads executing RPC requests */
+static const int DEFAULT_RPC_THREADS = 4;
+/** Default maximum number of RPC requests waiting for a worker thread */
+static const int DEFAULT_RPC_WORKQUEUE = 16;
+/** Default number of seconds an idle keep-alive connection is kept open */
+static const int DEFAULT_RPC_SERVER_TIMEOUT = 30;
+/** Default and maximum number of -addressindex entries returned by one request */
+static const unsigned int DEFAULT_ADDRESS_HISTORY_RESULTS = 100;
+static const unsigned int MAX_ADDRESS_HISTORY_RESULTS = 1000;
+
 class AcceptedConnection
 {
 public:
@@ -30,6 +40,10 @@ public:
     virtual std::iostream& stream() = 0;
     virtual std::string peer_address_to_string() const = 0;
     virtual void close() = 0;
+    /** Shut the connection down if it is still idle after nSeconds (0 cancels) */
+    virtual void set_idle_timeout(int nSeconds) = 0;
+    /** Abort blocking reads and writes on this connection from another thread */
+    virtual void shutdown() = 0;
 };
 
 /** Start RPC threads */
@@ -76,16 +90,36 @@ void RPCRunLater(const std::string& name, boost::function<void(void)> func, int6
 extern CNetAddr BoostAsioToCNetAddr(boost::asio::ip::address address);
 
 typedef json_spirit::Value(*rpcfn_type)(const json_spirit::Array& params, bool fHelp);
+/** Handler for a method with a large result, which it returns already encoded as JSON */
+typedef std::string(*rpcfn_encoded_type)(const json_spirit::Array& params, bool fHelp);
+
+/** The handler of an RPC method, of either type */
+class CRPCActor
+{
+public:
+    CRPCActor(rpcfn_type pfnIn) : pfn(pfnIn), pfnEncoded(NULL) {}
+    CRPCActor(rpcfn_encoded_type pfnEncodedIn) : pfn(NULL), pfnEncoded(pfnEncodedIn) {}
+
+    RPCResult operator()(const json_spirit::Array& params, bool fHelp) const;
+
+    //! Order handlers, so that help can skip methods registered under several names
+    bool operator<(const CRPCActor& other) const;
+
+private:
+    rpcfn_type pfn;
+    rpcfn_encoded_type pfnEncoded;
+};
 
 class CRPCCommand
 {
 public:
     std::string category;
     std::string name;
-    rpcfn_type actor;
+    CRPCActor actor;
     bool okSafeMode;
     bool threadSafe;
     bool reqWallet;
+    bool parallel; //!< Has no side effects, so batched calls can run concurrently
 };
 
 /**
@@ -107,7 +141,7 @@ public:
      * @returns Result of the call.
      * @throws an exception (json_spirit::Value) when an error happens.
      */
-    json_spirit::Value execute(const std::string &method, const json_spirit::Array &params) const;
+    RPCResult execute(const std::string &method, const json_spirit::Array &params) const;
 };
 
 extern const CRPCTable tableRPC;
@@ -196,7 +230,8 @@ extern json_spirit::Value getblockchaininfo(const json_spirit::Array& params, bo
 extern json_spirit::Value getnetworkinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value setmocktime(const json_spirit::Array& params, bool fHelp);
 
-extern json_spirit::Value getrawtransaction(const json_spirit::Array& params, bool fHelp); // in rcprawtransaction.cpp
+extern std::string getrawtransaction(const json_spirit::Array& params, bool fHelp); // in rcprawtransaction.cpp
+extern std::string getaddresshistory(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listunspent(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value lockunspent(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listlockunspent(const json_spirit::Array& params, bool fHelp);
@@ -213,7 +248,7 @@ extern json_spirit::Value settxfee(const json_spirit::Array& params, bool fHelp)
 extern json_spirit::Value getmempoolinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getrawmempool(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp);
-extern json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp);
+extern std::string getblock(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettxoutsetinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettxout(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value verifychain(const json_spirit::Array& params, bool fHelp);
@@ -222,7 +257,9 @@ extern json_spirit::Value getchaintips(const json_spirit::Array& params, bool fH
 // in rest.cpp
 extern bool HTTPReq_REST(AcceptedConnection *conn,
                   std::string& strURI,
+                  std::string& strRequest,
                   std::map<std::string, std::string>& mapHeaders,
-                  bool fRun);
+                  bool fRun,
+                  int nProto);
 
 #endif // BITCOIN_RPCSERVER_H
@@ -34,6 +34,41 @@ const char* GetTxnOutputType(txnouttype t)
     return NULL;
 }
 
+bool MatchFixedTemplate(const CScript& scriptPubKey, txnouttype& typeRet, CScript::const_iterator& pbeginRet, CScript::const_iterator& pendRet)
+{
+    const unsigned int nSize = scriptPubKey.size();
+
+    // OP_DUP OP_HASH160 20 [20 byte hash] OP_EQUALVERIFY OP_CHECKSIG
+    if (nSize == 25 && scriptPubKey[0] == OP_DUP && scriptPubKey[1] == OP_HASH160 &&
+        scriptPubKey[2] == 20 && scriptPubKey[23] == OP_EQUALVERIFY && scriptPubKey[24] == OP_CHECKSIG)
+    {
+        typeRet = TX_PUBKEYHASH;
+        pbeginRet = scriptPubKey.begin() + 3;
+        pendRet = scriptPubKey.begin() + 23;
+        return true;
+    }
+
+    // OP_HASH160 20 [20 byte hash] OP_EQUAL
+    if (scriptPubKey.IsPayToScriptHash())
+    {
+        typeRet = TX_SCRIPTHASH;
+        pbeginRet = scriptPubKey.begin() + 2;
+        pendRet = scriptPubKey.begin() + 22;
+        return true;
+    }
+
+    // 33 [compressed pubkey] OP_CHECKSIG, or 65 [uncompressed pubkey] OP_CHECKSIG
+    if ((nSize == 35 || nSize == 67) && scriptPubKey[0] == nSize - 2 && scriptPubKey[nSize - 1] == OP_CHECKSIG)
+    {
+        typeRet = TX_PUBKEY;
+        pbeginRet = scriptPubKey.begin() + 1;
+        pendRet = scriptPubKey.end() - 1;
+        return true;
+    }
+
+    return false;
+}
+
 /**
  * Return public keys or hashes from scriptPubKey, for 'standard' transaction types.
  */
@@ -58,13 +93,12 @@ bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, vector<vector<unsi
         mTemplates.insert(make_pair(TX_NULL_DATA, CScript() << OP_RETURN));
     }
 
-    // Shortcut for pay-to-script-hash, which are more constrained than the other types:
-    // it is always OP_HASH160 20 [20 byte hash] OP_EQUAL
-    if (scriptPubKey.IsPayToScriptHash())
+    // Shortcut for the common fixed-layout scripts; pay-to-script-hash is only
+    // ever recognized here, as it is always OP_HASH160 20 [20 byte hash] OP_EQUAL
+    CScript::const_iterator pbegin, pend;
+    if (MatchFixedTemplate(scriptPubKey, typeRet, pbegin, pend))
     {
-        typeRet = TX_SCRIPTHASH;
-        vector<unsigned char> hashBytes(scriptPubKey.begin()+2, scriptPubKey.begin()+22);
-        vSolutionsRet.push_back(hashBytes);
+        vSolutionsRet.push_back(valtype(pbegin, pend));
         return true;
     }
 
@@ -182,6 +216,10 @@ int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned c
 
 bool IsStandard(const CScript& scriptPubKey, txnouttype& whichType)
 {
+    CScript::const_iterator pbegin, pend;
+    if (MatchFixedTemplate(scriptPubKey, whichType, pbegin, pend))
+        return true;
+
     vector<valtype> vSolutions;
     if (!Solver(scriptPubKey, whichType, vSolutions))
         return false;
@@ -202,8 +240,29 @@ bool IsStandard(const CScript& scriptPubKey, txnouttype& whichType)
 
 bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet)
 {
-    vector<valtype> vSolutions;
     txnouttype whichType;
+    CScript::const_iterator pbegin, pend;
+    if (MatchFixedTemplate(scriptPubKey, whichType, pbegin, pend))
+    {
+        if (whichType == TX_PUBKEY)
+        {
+            CPubKey pubKey(pbegin, pend);
+            if (!pubKey.IsValid())
+                return false;
+            addressRet = pubKey.GetID();
+        }
+        else
+        {
+            uint160 hash(valtype(pbegin, pend));
+            if (whichType == TX_PUBKEYHASH)
+                addressRet = CKeyID(hash);
+            else
+                addressRet = CScriptID(hash);
+        }
+        return true;
+    }
+
+    vector<valtype> vSolutions;
     if (!Solver(scriptPubKey, whichType, vSolutions))
         return false;
 
@@ -80,6 +80,14 @@ typedef boost::variant<CNoDestination, CKeyID, CScriptID> CTxDestination;
 
 const char* GetTxnOutputType(txnouttype t);
 
+/**
+ * Recognize the canonical pay-to-pubkey-hash, pay-to-script-hash and
+ * pay-to-pubkey (33 or 65 byte key) encodings by their fixed byte layout,
+ * without decoding opcodes or copying anything. On success pbeginRet/pendRet
+ * delimit the hash or public key inside scriptPubKey. Returning false does not
+ * mean the script is non-standard; callers must fall back to Solver().
+ */
+bool MatchFixedTemplate(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<unsigned char>::const_iterator& pbeginRet, std::vector<unsigned char>::const_iterator& pendRet);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey, txnouttype& whichType);
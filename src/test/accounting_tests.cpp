@@ -28,6 +28,20 @@ GetResults(CWalletDB& walletdb, std::map<CAmount, CAccountingEntry>& results)
     }
 }
 
+// The in-memory activity log must hold every transaction and accounting entry under its nOrderPos
+static void
+CheckOrderedTxIndex()
+{
+    BOOST_CHECK_EQUAL(pwalletMain->wtxOrdered.size(), pwalletMain->mapWallet.size() + pwalletMain->laccentries.size());
+    BOOST_FOREACH(const CWallet::TxItems::value_type& item, pwalletMain->wtxOrdered)
+    {
+        const CWalletTx* pwtx = item.second.first;
+        const CAccountingEntry* pacentry = item.second.second;
+        BOOST_CHECK((pwtx != NULL) != (pacentry != NULL));
+        BOOST_CHECK_EQUAL(item.first, pwtx ? pwtx->nOrderPos : pacentry->nOrderPos);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(acc_orderupgrade)
 {
     CWalletDB walletdb(pwalletMain->strWalletFile);
@@ -134,6 +148,18 @@ BOOST_AUTO_TEST_CASE(acc_orderupgrade)
     BOOST_CHECK(results[4].strComment.empty());
     BOOST_CHECK(results[5].nTime == 1333333334);
     BOOST_CHECK(6 == vpwtx[1]->nOrderPos);
+    CheckOrderedTxIndex();
+
+
+    // Entries added through the wallet are logged without reordering
+    ae.nTime = 1333333340;
+    ae.strOtherAccount = "f";
+    ae.nOrderPos = pwalletMain->IncOrderPosNext();
+    BOOST_CHECK(walletdb.WriteAccountingEntry(ae));
+    pwalletMain->AddAccountingEntry(ae);
+    CheckOrderedTxIndex();
+    BOOST_CHECK(pwalletMain->wtxOrdered.rbegin()->second.second != NULL);
+    BOOST_CHECK(pwalletMain->wtxOrdered.rbegin()->second.second->strOtherAccount == "f");
 }
 
 BOOST_AUTO_TEST_SUITE_END()
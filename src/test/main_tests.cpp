@@ -4,6 +4,9 @@
 
 #include "core/transaction.h"
 #include "main.h"
+#include "random.h"
+#include "script/standard.h"
+#include "txdb.h"
 
 #include <boost/test/unit_test.hpp>
 
@@ -21,4 +24,67 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
     BOOST_CHECK(nSum == 2099999997690000ULL);
 }
 
+BOOST_AUTO_TEST_CASE(addressindex_test)
+{
+    CBlockTreeDB db(1 << 20, true);
+    uint160 hashScript = CScriptID(CScript() << OP_TRUE);
+    uint160 hashOther = CScriptID(CScript() << OP_FALSE);
+    uint256 txid = GetRandHash();
+
+    // Written out of order; heights past one byte must still sort numerically
+    std::vector<std::pair<CAddressIndexKey, CAddressIndexValue> > vWrite;
+    vWrite.push_back(std::make_pair(CAddressIndexKey(hashScript, 70000, txid, 0, true), CAddressIndexValue(5, COutPoint(txid, 1))));
+    vWrite.push_back(std::make_pair(CAddressIndexKey(hashScript, 256, txid, 1, false), CAddressIndexValue(5, COutPoint())));
+    vWrite.push_back(std::make_pair(CAddressIndexKey(hashOther, 10, txid, 0, false), CAddressIndexValue(7, COutPoint())));
+    vWrite.push_back(std::make_pair(CAddressIndexKey(hashScript, 1, txid, 0, false), CAddressIndexValue(3, COutPoint())));
+    std::vector<std::pair<COutPoint, CSpentIndexValue> > vSpent;
+    vSpent.push_back(std::make_pair(COutPoint(txid, 1), CSpentIndexValue(txid, 0, 70000)));
+    BOOST_CHECK(db.WriteAddressIndex(vWrite, vSpent));
+
+    std::vector<std::pair<CAddressIndexKey, CAddressIndexValue> > vRead;
+    BOOST_CHECK(db.ReadAddressIndex(hashScript, -1, uint256(), 10, vRead));
+    BOOST_REQUIRE_EQUAL(vRead.size(), 3U);
+    BOOST_CHECK_EQUAL(vRead[0].first.nHeight, 1);
+    BOOST_CHECK_EQUAL(vRead[1].first.nHeight, 256);
+    BOOST_CHECK_EQUAL(vRead[2].first.nHeight, 70000);
+    BOOST_CHECK(vRead[2].first.fSpend && vRead[2].second.prevout == COutPoint(txid, 1));
+
+    // Paging, continuing after the last transaction read
+    vRead.clear();
+    BOOST_CHECK(db.ReadAddressIndex(hashScript, 1, txid, 1, vRead));
+    BOOST_REQUIRE_EQUAL(vRead.size(), 1U);
+    BOOST_CHECK_EQUAL(vRead[0].first.nHeight, 256);
+
+    // A page does not end in the middle of a transaction's entries
+    uint256 txidMulti = GetRandHash();
+    std::vector<std::pair<CAddressIndexKey, CAddressIndexValue> > vMulti;
+    std::vector<CAddressIndexKey> vMultiKeys;
+    for (unsigned int i = 0; i < 3; i++) {
+        vMulti.push_back(std::make_pair(CAddressIndexKey(hashScript, 512, txidMulti, i, false), CAddressIndexValue(1, COutPoint())));
+        vMultiKeys.push_back(vMulti.back().first);
+    }
+    BOOST_CHECK(db.WriteAddressIndex(vMulti, std::vector<std::pair<COutPoint, CSpentIndexValue> >()));
+    vRead.clear();
+    BOOST_CHECK(db.ReadAddressIndex(hashScript, 256, txid, 1, vRead));
+    BOOST_REQUIRE_EQUAL(vRead.size(), 3U);
+    BOOST_CHECK(vRead[0].first.txid == txidMulti && vRead[2].first.txid == txidMulti);
+    vRead.clear();
+    BOOST_CHECK(db.ReadAddressIndex(hashScript, 512, txidMulti, 10, vRead));
+    BOOST_REQUIRE_EQUAL(vRead.size(), 1U);
+    BOOST_CHECK_EQUAL(vRead[0].first.nHeight, 70000);
+    BOOST_CHECK(db.EraseAddressIndex(vMultiKeys, std::vector<COutPoint>()));
+
+    CSpentIndexValue spent;
+    BOOST_CHECK(db.ReadSpentIndex(COutPoint(txid, 1), spent));
+    BOOST_CHECK_EQUAL(spent.nHeight, 70000);
+
+    // Erasing the spend, as when its block is disconnected
+    std::vector<CAddressIndexKey> vErase(1, vWrite[0].first);
+    BOOST_CHECK(db.EraseAddressIndex(vErase, std::vector<COutPoint>(1, COutPoint(txid, 1))));
+    vRead.clear();
+    BOOST_CHECK(db.ReadAddressIndex(hashScript, -1, uint256(), 10, vRead));
+    BOOST_CHECK_EQUAL(vRead.size(), 2U);
+    BOOST_CHECK(!db.ReadSpentIndex(COutPoint(txid, 1), spent));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,12 +2,17 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "chainparams.h"
+#include "clientversion.h"
 #include "main.h"
 #include "miner.h"
 #include "pubkey.h"
+#include "streams.h"
 #include "uint256.h"
 #include "util.h"
 
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
 BOOST_AUTO_TEST_SUITE(miner_tests)
@@ -261,4 +266,81 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
 
 }
 
+// This forks off the chain CreateNewBlock_validity mined, below its tip, so
+// the imported blocks have less work and the active chain is left alone.
+BOOST_AUTO_TEST_CASE(LoadExternalBlockFiles_out_of_order)
+{
+    ModifiableParams()->setSkipProofOfWorkCheck(true);
+
+    std::vector<CBlock> vBlocks(4);
+    uint256 hashTip;
+    {
+        LOCK(cs_main);
+        BOOST_REQUIRE(chainActive.Height() > (int)vBlocks.size());
+        hashTip = chainActive.Tip()->GetBlockHash();
+        const CBlockIndex* pindexFork = chainActive[chainActive.Height() - vBlocks.size() - 1];
+        uint256 hashPrev = pindexFork->GetBlockHash();
+        for (unsigned int i = 0; i < vBlocks.size(); i++)
+        {
+            CMutableTransaction txCoinbase;
+            txCoinbase.vin.resize(1);
+            txCoinbase.vin[0].scriptSig = CScript() << (int64_t)(pindexFork->nHeight + 1 + i) << OP_1;
+            txCoinbase.vout.resize(1);
+            txCoinbase.vout[0].scriptPubKey = CScript() << OP_TRUE;
+
+            CBlock& block = vBlocks[i];
+            block.nVersion = 1;
+            block.hashPrevBlock = hashPrev;
+            block.nTime = chainActive.Tip()->GetBlockTime() + 1 + i;
+            block.nBits = pindexFork->nBits;
+            block.nNonce = 0;
+            block.vtx.push_back(CTransaction(txCoinbase));
+            block.hashMerkleRoot = block.BuildMerkleTree();
+            hashPrev = block.GetHash();
+        }
+    }
+
+    // Write them to a new block file, children before parents and with a
+    // record that does not deserialize in between, as -reindex may find them
+    int nFile = 0;
+    while (boost::filesystem::exists(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk")))
+        nFile++;
+    {
+        CAutoFile fileout(OpenBlockFile(CDiskBlockPos(nFile, 0)), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!fileout.IsNull());
+        const int order[] = {2, 0, -1, 3, 1};
+        for (unsigned int i = 0; i < sizeof(order)/sizeof(*order); i++)
+        {
+            if (order[i] < 0) {
+                unsigned char garbage[100];
+                memset(garbage, 0xff, sizeof(garbage));
+                fileout << FLATDATA(Params().MessageStart()) << (unsigned int)sizeof(garbage) << FLATDATA(garbage);
+                continue;
+            }
+            const CBlock& block = vBlocks[order[i]];
+            unsigned int nSize = fileout.GetSerializeSize(block);
+            fileout << FLATDATA(Params().MessageStart()) << nSize << block;
+        }
+    }
+
+    BOOST_CHECK(LoadExternalBlockFiles(std::vector<CImportFile>(1, CImportFile(NULL, nFile))));
+
+    // Every block is stored, at the position it was found in the file
+    {
+        LOCK(cs_main);
+        BOOST_FOREACH(const CBlock& block, vBlocks)
+        {
+            BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
+            BOOST_REQUIRE(mi != mapBlockIndex.end());
+            BOOST_CHECK(mi->second->nStatus & BLOCK_HAVE_DATA);
+            CBlock blockRead;
+            BOOST_CHECK(ReadBlockFromDisk(blockRead, mi->second->GetBlockPos()));
+            BOOST_CHECK(blockRead.GetHash() == block.GetHash());
+        }
+        BOOST_CHECK(chainActive.Tip()->GetBlockHash() == hashTip);
+    }
+
+    ModifiableParams()->setSkipProofOfWorkCheck(false);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -9,6 +9,7 @@
 #include "script/script_error.h"
 #include "script/interpreter.h"
 #include "script/sign.h"
+#include "script/standard.h"
 #include "uint256.h"
 
 #ifdef ENABLE_WALLET
@@ -281,6 +282,60 @@ BOOST_AUTO_TEST_CASE(multisig_Solver1)
     }
 }
 
+BOOST_AUTO_TEST_CASE(multisig_MatchFixedTemplate)
+{
+    CKey key[2];
+    key[0].MakeNewKey(true);
+    key[1].MakeNewKey(false);
+    CScript inner;
+    inner << OP_1 << ToByteVector(key[0].GetPubKey()) << OP_1 << OP_CHECKMULTISIG;
+
+    // Canonical encodings are matched, and agree with Solver
+    std::vector<CScript> canonical;
+    canonical.push_back(GetScriptForDestination(key[0].GetPubKey().GetID()));
+    canonical.push_back(GetScriptForDestination(CScriptID(inner)));
+    canonical.push_back(CScript() << ToByteVector(key[0].GetPubKey()) << OP_CHECKSIG);
+    canonical.push_back(CScript() << ToByteVector(key[1].GetPubKey()) << OP_CHECKSIG);
+    BOOST_FOREACH(const CScript& s, canonical)
+    {
+        txnouttype whichType, solverType;
+        CScript::const_iterator pbegin, pend;
+        vector<valtype> solutions;
+        BOOST_CHECK(MatchFixedTemplate(s, whichType, pbegin, pend));
+        BOOST_CHECK(Solver(s, solverType, solutions));
+        BOOST_CHECK_EQUAL(whichType, solverType);
+        BOOST_CHECK(solutions.size() == 1 && solutions[0] == valtype(pbegin, pend));
+    }
+
+    // Other encodings are left to the full Solver
+    valtype hash = ToByteVector(key[0].GetPubKey().GetID());
+    CScript pushdata;
+    pushdata << OP_DUP << OP_HASH160 << OP_PUSHDATA1;
+    pushdata.push_back(20);
+    pushdata.insert(pushdata.end(), hash.begin(), hash.end());
+    pushdata << OP_EQUALVERIFY << OP_CHECKSIG;
+    valtype oddkey(34, 0x02);
+    std::vector<CScript> other;
+    other.push_back(pushdata);
+    other.push_back(CScript() << oddkey << OP_CHECKSIG);
+    other.push_back(inner);
+    other.push_back(CScript() << OP_RETURN);
+    other.push_back(CScript() << OP_HASH160 << hash << OP_EQUALVERIFY);
+    BOOST_FOREACH(const CScript& s, other)
+    {
+        txnouttype whichType;
+        CScript::const_iterator pbegin, pend;
+        BOOST_CHECK(!MatchFixedTemplate(s, whichType, pbegin, pend));
+    }
+
+    txnouttype whichType;
+    vector<valtype> solutions;
+    BOOST_CHECK(Solver(pushdata, whichType, solutions));
+    BOOST_CHECK_EQUAL(whichType, TX_PUBKEYHASH);
+    BOOST_CHECK(Solver(CScript() << oddkey << OP_CHECKSIG, whichType, solutions));
+    BOOST_CHECK_EQUAL(whichType, TX_PUBKEY);
+}
+
 BOOST_AUTO_TEST_CASE(multisig_Sign)
 {
     // Test SignSignature() (and therefore the version of Solver() that signs transactions)
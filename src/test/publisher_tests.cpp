@@ -0,0 +1,118 @@
+// Copyright (c) 2014 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "publisher.h"
+
+#include "netbase.h"
+#include "random.h"
+#include "streams.h"
+#include "util.h"
+#include "version.h"
+
+#ifndef WIN32
+#include <sys/un.h>
+#endif
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_AUTO_TEST_SUITE(publisher_tests)
+
+#ifndef WIN32
+struct PublishedMessage
+{
+    std::string strTopic;
+    std::vector<unsigned char> vchBody;
+    uint32_t nSequence;
+};
+
+// Read from the subscriber socket until a whole message has arrived
+static bool ReadMessage(SOCKET hSocket, CDataStream& ssBuf, PublishedMessage& msg)
+{
+    while (true) {
+        try {
+            CDataStream ss(ssBuf);
+            ss >> msg.strTopic >> msg.vchBody >> msg.nSequence;
+            ssBuf = ss;
+            return true;
+        } catch (const std::ios_base::failure&) {
+            // incomplete, read more
+        }
+        char pchBuf[4096];
+        int nBytes = recv(hSocket, pchBuf, sizeof(pchBuf), 0);
+        if (nBytes <= 0)
+            return false;
+        ssBuf.write(pchBuf, nBytes);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(publish_transactions)
+{
+    boost::filesystem::path path = GetTempPath() / strprintf("test_bitcoin_publish_%lu", (unsigned long)GetRand(1000000));
+    std::string strAddr = "unix:" + path.string();
+    std::string strError;
+
+    CPublisher publisher;
+    BOOST_CHECK(publisher.Listen(PUB_HASHTX, strAddr, strError));
+    BOOST_CHECK(publisher.Listen(PUB_RAWTX, strAddr, strError));
+    BOOST_CHECK(!publisher.Listen(PUB_RAWTX, "127.0.0.1", strError)); // no port
+    boost::thread thread(boost::bind(&CPublisher::Thread, &publisher));
+
+    SOCKET hSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    BOOST_REQUIRE(hSocket != INVALID_SOCKET);
+    struct timeval timeout;
+    timeout.tv_sec = 10;
+    timeout.tv_usec = 0;
+    setsockopt(hSocket, SOL_SOCKET, SO_RCVTIMEO, (void*)&timeout, sizeof(timeout));
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.string().c_str(), sizeof(addr.sun_path) - 1);
+    BOOST_REQUIRE(connect(hSocket, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    for (int i = 0; i < 200 && publisher.GetSubscriberCount() == 0; i++)
+        MilliSleep(10);
+    BOOST_REQUIRE_EQUAL(publisher.GetSubscriberCount(), 1U);
+
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = 42;
+    CTransaction tx(mtx);
+    CBlock block;
+    block.vtx.push_back(tx);
+
+    publisher.PublishTransaction(tx);
+    publisher.PublishBlock(block); // not subscribed to
+    publisher.PublishTransaction(tx);
+
+    CDataStream ssBuf(SER_NETWORK, PROTOCOL_VERSION);
+    for (uint32_t n = 0; n < 2; n++) {
+        PublishedMessage msg;
+        BOOST_REQUIRE(ReadMessage(hSocket, ssBuf, msg));
+        BOOST_CHECK_EQUAL(msg.strTopic, "hashtx");
+        BOOST_CHECK_EQUAL(msg.nSequence, n);
+        BOOST_CHECK(msg.vchBody.size() == 32 && uint256(msg.vchBody) == tx.GetHash());
+
+        BOOST_REQUIRE(ReadMessage(hSocket, ssBuf, msg));
+        BOOST_CHECK_EQUAL(msg.strTopic, "rawtx");
+        BOOST_CHECK_EQUAL(msg.nSequence, n);
+        CTransaction txRead;
+        CDataStream(msg.vchBody, SER_NETWORK, PROTOCOL_VERSION) >> txRead;
+        BOOST_CHECK(txRead.GetHash() == tx.GetHash());
+    }
+    BOOST_CHECK(ssBuf.empty());
+
+    // A subscriber hanging up is noticed
+    CloseSocket(hSocket);
+    for (int i = 0; i < 200 && publisher.GetSubscriberCount() != 0; i++)
+        MilliSleep(10);
+    BOOST_CHECK_EQUAL(publisher.GetSubscriberCount(), 0U);
+
+    thread.interrupt();
+    thread.join();
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
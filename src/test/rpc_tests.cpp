@@ -6,7 +6,10 @@
 #include "rpcclient.h"
 
 #include "base58.h"
+#include "main.h"
 #include "netbase.h"
+#include "random.h"
+#include "utiltime.h"
 
 #include <boost/algorithm/string.hpp>
 #include <boost/test/unit_test.hpp>
@@ -14,6 +17,9 @@
 using namespace std;
 using namespace json_spirit;
 
+extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry);
+extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, JSONStreamWriter& entry);
+
 Array
 createArgs(int nRequired, const char* address1=NULL, const char* address2=NULL)
 {
@@ -34,9 +40,9 @@ Value CallRPC(string args)
     vArgs.erase(vArgs.begin());
     Array params = RPCConvertValues(strMethod, vArgs);
 
-    rpcfn_type method = tableRPC[strMethod]->actor;
+    const CRPCActor& method = tableRPC[strMethod]->actor;
     try {
-        Value result = (*method)(params, false);
+        Value result = method(params, false).GetValue();
         return result;
     }
     catch (Object& objError)
@@ -139,6 +145,124 @@ BOOST_AUTO_TEST_CASE(rpc_parse_monetary_values)
     BOOST_CHECK_EQUAL(AmountFromValue(ValueFromString("20999999.99999999")), 2099999999999999LL);
 }
 
+BOOST_AUTO_TEST_CASE(rpc_json_stream_writer)
+{
+    // The streaming writer must produce exactly what write_string() does
+    Object obj;
+    obj.push_back(Pair("str", "quote\" backslash\\ newline\n tab\t"));
+    obj.push_back(Pair("int", -42));
+    obj.push_back(Pair("int64", (int64_t)2099999999999999LL));
+    obj.push_back(Pair("real", ValueFromAmount(17622195LL)));
+    obj.push_back(Pair("true", true));
+    obj.push_back(Pair("null", Value::null));
+    Array arr;
+    arr.push_back("a");
+    arr.push_back(Object());
+    arr.push_back(Array());
+    Object inner;
+    inner.push_back(Pair("x", 1));
+    arr.push_back(inner);
+    obj.push_back(Pair("arr", arr));
+
+    string strJSON;
+    JSONStreamWriter writer(strJSON);
+    writer.BeginObject();
+    writer.Pair("str", "quote\" backslash\\ newline\n tab\t");
+    writer.Pair("int", -42);
+    writer.Pair("int64", (int64_t)2099999999999999LL);
+    writer.Pair("real", ValueFromAmount(17622195LL).get_real());
+    writer.Key("true");
+    writer.Bool(true);
+    writer.Key("null");
+    writer.Null();
+    writer.Key("arr");
+    writer.BeginArray();
+    writer.String("a");
+    writer.BeginObject();
+    writer.EndObject();
+    writer.BeginArray();
+    writer.EndArray();
+    writer.BeginObject();
+    writer.Pair("x", 1);
+    writer.EndObject();
+    writer.EndArray();
+    writer.EndObject();
+    BOOST_CHECK_EQUAL(strJSON, write_string(Value(obj), false));
+
+    // Encoded results are spliced into the reply unchanged
+    RPCResult encoded = RPCResult::FromEncoded(strJSON);
+    BOOST_CHECK(encoded.IsEncoded());
+    BOOST_CHECK(!RPCResult(obj).IsEncoded());
+    BOOST_CHECK_EQUAL(encoded.Write(), strJSON);
+    BOOST_CHECK_EQUAL(write_string(encoded.GetValue(), false), strJSON);
+    BOOST_CHECK_EQUAL(WriteJSONRPCReply(encoded, Value::null, 1) + "\n", JSONRPCReply(obj, Value::null, 1));
+    BOOST_CHECK_EQUAL(WriteJSONRPCReply(encoded, JSONRPCError(RPC_MISC_ERROR, "e"), 1) + "\n",
+                      JSONRPCReply(Value::null, JSONRPCError(RPC_MISC_ERROR, "e"), 1));
+}
+
+/** A block of about 1MB of two-in, two-out pay-to-pubkey-hash transactions */
+static CBlock MakeFullBlock()
+{
+    CBlock block;
+    unsigned int nSize = 0;
+    while (nSize < MAX_BLOCK_SIZE - 1000) {
+        CMutableTransaction tx;
+        tx.vin.resize(2);
+        for (unsigned int i = 0; i < tx.vin.size(); i++) {
+            tx.vin[i].prevout = COutPoint(GetRandHash(), insecure_rand() % 4);
+            std::vector<unsigned char> vchSig(72), vchPubKey(33);
+            BOOST_FOREACH(unsigned char& c, vchSig) c = insecure_rand();
+            BOOST_FOREACH(unsigned char& c, vchPubKey) c = insecure_rand();
+            tx.vin[i].scriptSig << vchSig << vchPubKey;
+        }
+        tx.vout.resize(2);
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            tx.vout[i].nValue = insecure_rand();
+            std::vector<unsigned char> vchHash(20);
+            BOOST_FOREACH(unsigned char& c, vchHash) c = insecure_rand();
+            tx.vout[i].scriptPubKey = GetScriptForDestination(CKeyID(uint160(vchHash)));
+        }
+        block.vtx.push_back(tx);
+        nSize += ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    }
+    return block;
+}
+
+BOOST_AUTO_TEST_CASE(rpc_tx_to_json_1mb_block)
+{
+    CBlock block = MakeFullBlock();
+
+    // Every transaction of a full block, as the REST json block format lists them
+    int64_t nStart = GetTimeMicros();
+    Array arr;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        Object entry;
+        TxToJSON(tx, 0, entry);
+        arr.push_back(entry);
+    }
+    string strTree = write_string(Value(arr), false);
+    int64_t nTree = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    string strStream;
+    JSONStreamWriter writer(strStream);
+    writer.BeginArray();
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        writer.BeginObject();
+        TxToJSON(tx, 0, writer);
+        writer.EndObject();
+    }
+    writer.EndArray();
+    int64_t nStream = GetTimeMicros() - nStart;
+
+    // Both are produced by the same serializer
+    BOOST_CHECK(strStream == strTree);
+
+    // Run test_bitcoin with --log_level=message to see BOOST_TEST_MESSAGEs:
+    BOOST_TEST_MESSAGE("TxToJSON of " << block.vtx.size() << " transactions (" << strStream.size() << " bytes of JSON): json_spirit tree "
+                       << nTree / 1000 << "ms, JSONStreamWriter " << nStream / 1000 << "ms");
+}
+
 BOOST_AUTO_TEST_CASE(rpc_boostasiotocnetaddr)
 {
     // Check IPv4 addresses
@@ -25,7 +25,7 @@ BOOST_AUTO_TEST_CASE(rpc_addmultisig)
 {
     LOCK(pwalletMain->cs_wallet);
 
-    rpcfn_type addmultisig = tableRPC["addmultisigaddress"]->actor;
+    const CRPCActor& addmultisig = tableRPC["addmultisigaddress"]->actor;
 
     // old, 65-byte-long:
     const char address1Hex[] = "0434e3e09f49ea168c5bbf53f877ff4206923858aab7c7e1df25bc263978107c95e35065a27ef6f1b27222db0ec97e0e895eaca603d3ee0d4c060ce3d8a00286c8";
@@ -34,15 +34,15 @@ BOOST_AUTO_TEST_CASE(rpc_addmultisig)
 
     Value v;
     CBitcoinAddress address;
-    BOOST_CHECK_NO_THROW(v = addmultisig(createArgs(1, address1Hex), false));
+    BOOST_CHECK_NO_THROW(v = addmultisig(createArgs(1, address1Hex), false).GetValue());
     address.SetString(v.get_str());
     BOOST_CHECK(address.IsValid() && address.IsScript());
 
-    BOOST_CHECK_NO_THROW(v = addmultisig(createArgs(1, address1Hex, address2Hex), false));
+    BOOST_CHECK_NO_THROW(v = addmultisig(createArgs(1, address1Hex, address2Hex), false).GetValue());
     address.SetString(v.get_str());
     BOOST_CHECK(address.IsValid() && address.IsScript());
 
-    BOOST_CHECK_NO_THROW(v = addmultisig(createArgs(2, address1Hex, address2Hex), false));
+    BOOST_CHECK_NO_THROW(v = addmultisig(createArgs(2, address1Hex, address2Hex), false).GetValue());
     address.SetString(v.get_str());
     BOOST_CHECK(address.IsValid() && address.IsScript());
 
@@ -99,4 +99,49 @@ BOOST_AUTO_TEST_CASE(getlocator_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(chainsnapshot_test)
+{
+    // Build a main chain and a fork off it at height 500.
+    std::vector<CBlockIndex> vBlocksMain(1000);
+    std::vector<CBlockIndex> vBlocksSide(100);
+    for (unsigned int i=0; i<vBlocksMain.size(); i++) {
+        vBlocksMain[i].nHeight = i;
+        vBlocksMain[i].pprev = i ? &vBlocksMain[i - 1] : NULL;
+        vBlocksMain[i].BuildSkip();
+    }
+    for (unsigned int i=0; i<vBlocksSide.size(); i++) {
+        vBlocksSide[i].nHeight = i + 500;
+        vBlocksSide[i].pprev = i ? &vBlocksSide[i - 1] : &vBlocksMain[499];
+        vBlocksSide[i].BuildSkip();
+    }
+
+    CChain chain;
+    chain.SetTip(&vBlocksMain.back());
+    CChainSnapshot snapshot(chain.Tip());
+    BOOST_CHECK_EQUAL(snapshot.Height(), chain.Height());
+    BOOST_CHECK(snapshot.Tip() == chain.Tip());
+
+    for (int i=0; i < 1000; i++) {
+        int nHeight = insecure_rand() % (chain.Height() + 3) - 1;
+        BOOST_CHECK(snapshot[nHeight] == chain[nHeight]);
+    }
+    BOOST_CHECK(snapshot.Contains(&vBlocksMain[600]));
+    BOOST_CHECK(!snapshot.Contains(&vBlocksSide[50]));
+    BOOST_CHECK(snapshot.Next(&vBlocksMain[600]) == &vBlocksMain[601]);
+    BOOST_CHECK(snapshot.Next(&vBlocksSide[50]) == NULL);
+    BOOST_CHECK(snapshot.Next(chain.Tip()) == NULL);
+    BOOST_CHECK(snapshot.FindFork(&vBlocksMain[600]) == &vBlocksMain[600]);
+    BOOST_CHECK(snapshot.FindFork(&vBlocksSide[50]) == &vBlocksMain[499]);
+
+    // Moving the chain to the fork leaves the earlier snapshot intact.
+    chain.SetTip(&vBlocksSide.back());
+    BOOST_CHECK(snapshot.Contains(&vBlocksMain[600]));
+    BOOST_CHECK(!chain.Contains(&vBlocksMain[600]));
+    BOOST_CHECK(CChainSnapshot(chain.Tip()).Contains(&vBlocksSide[50]));
+
+    BOOST_CHECK(CChainSnapshot().Tip() == NULL);
+    BOOST_CHECK_EQUAL(CChainSnapshot().Height(), -1);
+    BOOST_CHECK(CChainSnapshot()[0] == NULL);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
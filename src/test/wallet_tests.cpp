@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "wallet.h"
+#include "walletdb.h"
 
 #include <set>
 #include <stdint.h>
@@ -21,6 +22,8 @@
 
 using namespace std;
 
+extern CWallet* pwalletMain;
+
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
 
 BOOST_AUTO_TEST_SUITE(wallet_tests)
@@ -221,6 +224,16 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
         BOOST_CHECK_EQUAL(nValueRet, 500000 * COIN); // we should get the exact amount
         BOOST_CHECK_EQUAL(setCoinsRet.size(), 10U); // in ten coins
 
+        // an exact match that needs all but one of many coins is found, rather than a near miss with change
+        empty_wallet();
+        for (int i = 0; i < 100; i++)
+            add_coin(3 * CENT);
+        add_coin(2 * CENT);
+
+        BOOST_CHECK( wallet.SelectCoinsMinConf(299 * CENT, 1, 1, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, 299 * CENT); // 99 * 3 + 2
+        BOOST_CHECK_EQUAL(setCoinsRet.size(), 100U);
+
         // if there's not enough in the smaller coins to make at least 1 cent change (0.5+0.6+0.7 < 1.0+1.0),
         // we need to try finding an exact subset anyway
 
@@ -305,4 +318,42 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(deferred_bad_key_not_in_keypool)
+{
+    LOCK(pwalletMain->cs_wallet);
+    CWalletDB walletdb(pwalletMain->strWalletFile);
+
+    // A key record whose private key belongs to another public key, loaded
+    // without a check as -walletdeferkeycheck does
+    CKey key, keyOther;
+    key.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+    CPubKey pubkeyBad = key.GetPubKey();
+    BOOST_CHECK(pwalletMain->LoadKey(keyOther, pubkeyBad));
+    pwalletMain->LoadUncheckedKey(pubkeyBad.GetID());
+    BOOST_CHECK(pwalletMain->HasUncheckedKeys());
+
+    // Put it in the key pool ahead of a good key
+    CPubKey pubkeyGood = pwalletMain->GenerateNewKey();
+    const int64_t nBad = 1000000, nGood = nBad + 1;
+    BOOST_CHECK(walletdb.WritePool(nBad, CKeyPool(pubkeyBad)));
+    BOOST_CHECK(walletdb.WritePool(nGood, CKeyPool(pubkeyGood)));
+    std::set<int64_t> setKeyPoolSaved;
+    setKeyPoolSaved.swap(pwalletMain->setKeyPool);
+    pwalletMain->setKeyPool.insert(nBad);
+    pwalletMain->setKeyPool.insert(nGood);
+
+    // The bad key is dropped from the pool and the good one handed out
+    int64_t nIndex;
+    CKeyPool keypool;
+    pwalletMain->ReserveKeyFromKeyPool(nIndex, keypool);
+    BOOST_CHECK_EQUAL(nIndex, nGood);
+    BOOST_CHECK(keypool.vchPubKey == pubkeyGood);
+    BOOST_CHECK(!walletdb.ReadPool(nBad, keypool));
+    BOOST_CHECK(!pwalletMain->CheckUncheckedKey(pubkeyBad.GetID()));
+    pwalletMain->KeepKey(nIndex);
+
+    pwalletMain->setKeyPool.swap(setKeyPoolSaved);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
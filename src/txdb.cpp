@@ -8,6 +8,7 @@
 #include "pow.h"
 #include "uint256.h"
 
+#include <limits>
 #include <stdint.h>
 
 #include <boost/thread.hpp>
@@ -102,12 +103,16 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
-       that restriction.  */
-    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
+       that restriction.  Everything is read from one snapshot, so the best
+       block and the coins agree even if a cache flush commits meanwhile,
+       and callers need not hold cs_main for the duration of the scan. */
+    CLevelDBSnapshot snapshot(const_cast<CLevelDBWrapper&>(db));
+    boost::scoped_ptr<leveldb::Iterator> pcursor(snapshot.NewIterator());
     pcursor->SeekToFirst();
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock();
+    if (!snapshot.Read('B', stats.hashBlock))
+        stats.hashBlock = uint256(0);
     ss << stats.hashBlock;
     CAmount nTotalAmount = 0;
     while (pcursor->Valid()) {
@@ -146,7 +151,10 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
             return error("%s : Deserialize or I/O error - %s", __func__, e.what());
         }
     }
-    stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
+    {
+        LOCK(cs_main);
+        stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
+    }
     stats.hashSerialized = ss.GetHash();
     stats.nTotalAmount = nTotalAmount;
     return true;
@@ -163,6 +171,88 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >&vect, const CBlockLocator &locator) {
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
+        batch.Write(make_pair('t', it->first), it->second);
+    batch.Write('T', locator);
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadTxIndexBestBlock(CBlockLocator &locator) {
+    return Read('T', locator);
+}
+
+bool CBlockTreeDB::EraseTxIndexBestBlock() {
+    return Erase('T');
+}
+
+bool CBlockTreeDB::ReadAddressIndex(const uint160 &hashScript, int nAfterHeight, const uint256 &txidAfter, unsigned int nCount, std::vector<std::pair<CAddressIndexKey, CAddressIndexValue> > &vEntries) {
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('a', hashScript);
+    const std::string strPrefix = ssKeySet.str();
+    if (nAfterHeight < 0) {
+        pcursor->Seek(strPrefix);
+    } else {
+        // The highest key the transaction can have entries under; the
+        // iterator starts there, or at the first key past it
+        CDataStream ssKeyAfter(SER_DISK, CLIENT_VERSION);
+        ssKeyAfter << make_pair('a', CAddressIndexKey(hashScript, nAfterHeight, txidAfter, std::numeric_limits<unsigned int>::max(), true));
+        pcursor->Seek(ssKeyAfter.str());
+    }
+
+    // A page ends with the last entry of a transaction, so that it can be
+    // continued from that transaction's height and txid
+    for (; pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        leveldb::Slice slKey = pcursor->key();
+        if (!slKey.starts_with(strPrefix))
+            break;
+        try {
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            std::pair<CAddressIndexKey, CAddressIndexValue> entry;
+            ssKey >> chType >> entry.first;
+            if (entry.first.nHeight == nAfterHeight && entry.first.txid == txidAfter)
+                continue;
+            if (vEntries.size() >= nCount && (vEntries.empty() ||
+                entry.first.nHeight != vEntries.back().first.nHeight || entry.first.txid != vEntries.back().first.txid))
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> entry.second;
+            vEntries.push_back(entry);
+        } catch (std::exception &e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    return true;
+}
+
+bool CBlockTreeDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAddressIndexValue> > &vEntries, const std::vector<std::pair<COutPoint, CSpentIndexValue> > &vSpent) {
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<CAddressIndexKey, CAddressIndexValue> >::const_iterator it = vEntries.begin(); it != vEntries.end(); it++)
+        batch.Write(make_pair('a', it->first), it->second);
+    for (std::vector<std::pair<COutPoint, CSpentIndexValue> >::const_iterator it = vSpent.begin(); it != vSpent.end(); it++)
+        batch.Write(make_pair('p', it->first), it->second);
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::EraseAddressIndex(const std::vector<CAddressIndexKey> &vEntries, const std::vector<COutPoint> &vSpent) {
+    CLevelDBBatch batch;
+    for (std::vector<CAddressIndexKey>::const_iterator it = vEntries.begin(); it != vEntries.end(); it++)
+        batch.Erase(make_pair('a', *it));
+    for (std::vector<COutPoint>::const_iterator it = vSpent.begin(); it != vSpent.end(); it++)
+        batch.Erase(make_pair('p', *it));
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadSpentIndex(const COutPoint &outpoint, CSpentIndexValue &value) {
+    return Read(make_pair('p', outpoint), value);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair('F', name), fValue ? '1' : '0');
 }
@@ -57,6 +57,14 @@ public:
     bool ReadReindexing(bool &fReindex);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    /** Write index entries together with the block they take the index up to, while it is being built in the background */
+    bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list, const CBlockLocator &locator);
+    bool ReadTxIndexBestBlock(CBlockLocator &locator);
+    bool EraseTxIndexBestBlock();
+    bool ReadAddressIndex(const uint160 &hashScript, int nAfterHeight, const uint256 &txidAfter, unsigned int nCount, std::vector<std::pair<CAddressIndexKey, CAddressIndexValue> > &vEntries);
+    bool WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAddressIndexValue> > &vEntries, const std::vector<std::pair<COutPoint, CSpentIndexValue> > &vSpent);
+    bool EraseAddressIndex(const std::vector<CAddressIndexKey> &vEntries, const std::vector<COutPoint> &vSpent);
+    bool ReadSpentIndex(const COutPoint &outpoint, CSpentIndexValue &value);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts();
@@ -145,6 +145,8 @@ public:
     }
 
     bool lookup(uint256 hash, CTransaction& result) const;
+    /** Look up the fee rate a transaction in the pool pays, returns false if it is not in the pool */
+    bool lookupFeeRate(const uint256& hash, CFeeRate& feeRate) const;
 
     /** Estimate fee rate needed to get into the next nBlocks */
     CFeeRate estimateFee(int nBlocks) const;
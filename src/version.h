@@ -9,7 +9,14 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 70002;
+/**
+ * 70013 is the version "feefilter" (BIP 133) is deployed with. The versions
+ * in between are only partly implemented here: NODE_BLOOM (BIP 111, 70011)
+ * is advertised because bloom filters are always served, and a "sendheaders"
+ * request (BIP 130, 70012) is ignored, which BIP 130 permits; new blocks are
+ * still announced with inv.
+ */
+static const int PROTOCOL_VERSION = 70013;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -34,4 +41,7 @@ static const int BIP0031_VERSION = 60000;
 //! "mempool" command, enhanced "getdata" behavior starts with this version
 static const int MEMPOOL_GD_VERSION = 60002;
 
+//! "feefilter" tells peers to filter invs to you by fee starts with this version
+static const int FEEFILTER_VERSION = 70013;
+
 #endif // BITCOIN_VERSION_H
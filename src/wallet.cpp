@@ -12,6 +12,7 @@
 #include "script/script.h"
 #include "script/sign.h"
 #include "timedata.h"
+#include "ui_interface.h"
 #include "util.h"
 #include "utilmoneystr.h"
 
@@ -76,7 +77,7 @@ CPubKey CWallet::GenerateNewKey()
 
     // Compressed public keys were introduced in version 0.6.0
     if (fCompressed)
-        SetMinVersion(FEATURE_COMPRPUBKEY);
+        SetMinVersion(FEATURE_COMPRPUBKEY, pwalletdbEncryption);
 
     CPubKey pubkey = secret.GetPubKey();
 
@@ -106,6 +107,10 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
+        if (pwalletdbEncryption)
+            return pwalletdbEncryption->WriteKey(pubkey,
+                                                 secret.GetPrivKey(),
+                                                 mapKeyMetadata[pubkey.GetID()]);
         return CWalletDB(strWalletFile).WriteKey(pubkey,
                                                  secret.GetPrivKey(),
                                                  mapKeyMetadata[pubkey.GetID()]);
@@ -218,7 +223,10 @@ bool CWallet::Unlock(const SecureString& strWalletPassphrase)
             if (!crypter.Decrypt(pMasterKey.second.vchCryptedKey, vMasterKey))
                 continue; // try another master key
             if (CCryptoKeyStore::Unlock(vMasterKey))
+            {
+                RequestKeyPoolCheck();
                 return true;
+            }
         }
     }
     return false;
@@ -272,6 +280,11 @@ bool CWallet::ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase,
 
 void CWallet::SetBestChain(const CBlockLocator& loc)
 {
+    {
+        LOCK(cs_wallet);
+        if (fSyncCommitFailed)
+            return;
+    }
     CWalletDB walletdb(strWalletFile);
     walletdb.WriteBestBlock(loc);
 }
@@ -415,6 +428,56 @@ void CWallet::AddToSpends(const uint256& wtxid)
         AddToSpends(txin.prevout, wtxid);
 }
 
+/**
+ * True if every output of ours in wtx is spent by a wallet transaction that
+ * is in a block. Such a transaction cannot add to any balance until a block
+ * holding one of those spends is disconnected.
+ */
+bool CWallet::IsSpentInChain(const CWalletTx& wtx) const
+{
+    AssertLockHeld(cs_wallet);
+    const uint256 hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        if (IsMine(wtx.vout[i]) == ISMINE_NO)
+            continue;
+
+        bool fSpent = false;
+        pair<TxSpends::const_iterator, TxSpends::const_iterator> range;
+        range = mapTxSpends.equal_range(COutPoint(hash, i));
+        for (TxSpends::const_iterator it = range.first; it != range.second && !fSpent; ++it)
+        {
+            std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+            fSpent = mit != mapWallet.end() && mit->second.GetDepthInMainChain() > 0;
+        }
+        if (!fSpent)
+            return false;
+    }
+    return true;
+}
+
+void CWallet::PruneUnspentTx(const uint256& hash)
+{
+    std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(hash);
+    if (mit == mapWallet.end() || IsSpentInChain(mit->second))
+        setUnspentTxs.erase(hash);
+}
+
+void CWallet::PruneUnspentTxs()
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    std::set<uint256>::iterator it = setUnspentTxs.begin();
+    while (it != setUnspentTxs.end())
+    {
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(*it);
+        if (mit == mapWallet.end() || IsSpentInChain(mit->second))
+            setUnspentTxs.erase(it++);
+        else
+            ++it;
+    }
+}
+
 bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
 {
     if (IsCrypted())
@@ -520,29 +583,25 @@ int64_t CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
     return nRet;
 }
 
-CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
+void CWallet::AddAccountingEntry(const CAccountingEntry& acentry)
 {
-    AssertLockHeld(cs_wallet); // mapWallet
-    CWalletDB walletdb(strWalletFile);
-
-    // First: get all CWalletTx and CAccountingEntry into a sorted-by-order multimap.
-    TxItems txOrdered;
+    AssertLockHeld(cs_wallet); // laccentries, wtxOrdered
+    laccentries.push_back(acentry);
+    CAccountingEntry& entry = laccentries.back();
+    wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+}
 
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
+void CWallet::RebuildOrderedTxIndex()
+{
+    AssertLockHeld(cs_wallet); // mapWallet, laccentries, wtxOrdered
+    wtxOrdered.clear();
     for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
     {
         CWalletTx* wtx = &((*it).second);
-        txOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
-    }
-    acentries.clear();
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
-    BOOST_FOREACH(CAccountingEntry& entry, acentries)
-    {
-        txOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+        wtxOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
     }
-
-    return txOrdered;
+    BOOST_FOREACH(CAccountingEntry& entry, laccentries)
+        wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
 }
 
 void CWallet::MarkDirty()
@@ -550,11 +609,15 @@ void CWallet::MarkDirty()
     {
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        {
             item.second.MarkDirty();
+            // Outputs we ignored before (e.g. of a newly imported key) may be ours now
+            setUnspentTxs.insert(item.first);
+        }
     }
 }
 
-bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
+bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb)
 {
     uint256 hash = wtxIn.GetHash();
 
@@ -563,6 +626,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         mapWallet[hash] = wtxIn;
         mapWallet[hash].BindWallet(this);
         AddToSpends(hash);
+        setUnspentTxs.insert(hash);
     }
     else
     {
@@ -574,8 +638,10 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         bool fInsertedNew = ret.second;
         if (fInsertedNew)
         {
+            setUnspentTxs.insert(hash);
             wtx.nTimeReceived = GetAdjustedTime();
-            wtx.nOrderPos = IncOrderPosNext();
+            wtx.nOrderPos = IncOrderPosNext(pwalletdb);
+            wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
 
             wtx.nTimeSmart = wtx.nTimeReceived;
             if (wtxIn.hashBlock != 0)
@@ -587,9 +653,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
                     {
                         // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
                         int64_t latestTolerated = latestNow + 300;
-                        std::list<CAccountingEntry> acentries;
-                        TxItems txOrdered = OrderedTxItems(acentries);
-                        for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+                        const TxItems& txOrdered = wtxOrdered;
+                        for (TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
                         {
                             CWalletTx *const pwtx = (*it).second.first;
                             if (pwtx == &wtx)
@@ -652,7 +717,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
 
         // Write to disk
         if (fInsertedNew || fUpdated)
-            if (!wtx.WriteToDisk())
+            if (!wtx.WriteToDisk(pwalletdb))
                 return false;
 
         // Break debit/credit balance caches:
@@ -679,7 +744,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
  * pblock is optional, but should be provided if the transaction is known to be in a block.
  * If fUpdate is true, existing transactions will be updated.
  */
-bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate)
+bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate, CWalletDB* pwalletdb)
 {
     {
         AssertLockHeld(cs_wallet);
@@ -691,17 +756,62 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
             // Get merkle branch if transaction was found in a block
             if (pblock)
                 wtx.SetMerkleBranch(*pblock);
-            return AddToWallet(wtx);
+            return AddToWallet(wtx, false, pwalletdb);
         }
     }
     return false;
 }
 
 void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
+{
+    SyncTransaction(tx, pblock, NULL);
+}
+
+/**
+ * Sync all transactions of a block, writing whatever changes in the wallet
+ * in one database transaction rather than one write (and flush) per record.
+ */
+void CWallet::SyncTransactions(const std::vector<CTransaction>& vtx, const CBlock* pblock)
 {
     LOCK2(cs_main, cs_wallet);
-    if (!AddToWalletIfInvolvingMe(tx, pblock, true))
-        return; // Not one of ours
+    int64_t nStart = GetTimeMicros();
+    CWalletDB* pwalletdb = NULL;
+    if (fFileBacked)
+    {
+        pwalletdb = new CWalletDB(strWalletFile);
+        if (!pwalletdb->TxnBegin())
+        {
+            delete pwalletdb;
+            pwalletdb = NULL;
+        }
+    }
+
+    unsigned int nWritten = 0;
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        if (SyncTransaction(tx, pblock, pwalletdb))
+            nWritten++;
+
+    if (pwalletdb)
+    {
+        if (!pwalletdb->TxnCommit())
+        {
+            // mapWallet now holds changes that wallet.dat does not. Keep
+            // the best block where it was and shut down, so that the next
+            // start scans these blocks again.
+            fSyncCommitFailed = true;
+            AbortNode("CWallet::SyncTransactions() : committing wallet changes failed",
+                      _("Error: Failed to write wallet transactions, shutting down"));
+        }
+        delete pwalletdb;
+    }
+    LogPrint("bench", "    - Wallet sync: %u of %u txs written, %.2fms\n", nWritten, vtx.size(), (GetTimeMicros() - nStart) * 0.001);
+}
+
+bool CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock, CWalletDB* pwalletdb)
+{
+    LOCK2(cs_main, cs_wallet);
+    if (!AddToWalletIfInvolvingMe(tx, pblock, true, pwalletdb))
+        return false; // Not one of ours
 
     // If a transaction changes 'conflicted' state, that changes the balance
     // available of the outputs it spends. So force those to be
@@ -709,8 +819,18 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
     {
         if (mapWallet.count(txin.prevout.hash))
+        {
             mapWallet[txin.prevout.hash].MarkDirty();
+            // A spend that left the chain may give the outputs back
+            if (pblock)
+                PruneUnspentTx(txin.prevout.hash);
+            else
+                setUnspentTxs.insert(txin.prevout.hash);
+        }
     }
+    if (pblock)
+        PruneUnspentTx(tx.GetHash());
+    return true;
 }
 
 void CWallet::EraseFromWallet(const uint256 &hash)
@@ -719,8 +839,27 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
-            CWalletDB(strWalletFile).EraseTx(hash);
+        map<uint256, CWalletTx>::iterator it = mapWallet.find(hash);
+        if (it == mapWallet.end())
+            return;
+        std::pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(it->second.nOrderPos);
+        for (TxItems::iterator itOrdered = range.first; itOrdered != range.second; ++itOrdered)
+        {
+            if (itOrdered->second.first == &it->second)
+            {
+                wtxOrdered.erase(itOrdered);
+                break;
+            }
+        }
+        if (!it->second.IsCoinBase())
+        {
+            BOOST_FOREACH(const CTxIn& txin, it->second.vin)
+                if (mapWallet.count(txin.prevout.hash))
+                    setUnspentTxs.insert(txin.prevout.hash);
+        }
+        setUnspentTxs.erase(hash);
+        mapWallet.erase(it);
+        CWalletDB(strWalletFile).EraseTx(hash);
     }
     return;
 }
@@ -915,8 +1054,10 @@ void CWalletTx::GetAccountAmounts(const string& strAccount, CAmount& nReceived,
 }
 
 
-bool CWalletTx::WriteToDisk()
+bool CWalletTx::WriteToDisk(CWalletDB *pwalletdb)
 {
+    if (pwalletdb)
+        return pwalletdb->WriteTx(GetHash(), *this);
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
@@ -925,36 +1066,262 @@ bool CWalletTx::WriteToDisk()
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
  */
+namespace {
+
+/**
+ * The keys, scripts and watch-only outputs of a wallet, copied once so that
+ * rescan threads can rule out most outputs without locking the keystore.
+ */
+class CWalletScanFilter
+{
+public:
+    std::set<uint160> setHashes;
+    std::set<CScript> setWatchOnly;
+
+    //! False only for outputs IsMine() would also reject
+    bool MayBeMine(const CScript& script) const
+    {
+        if (!setWatchOnly.empty() && setWatchOnly.count(script))
+            return true;
+        txnouttype whichType;
+        CScript::const_iterator pbegin, pend;
+        if (MatchFixedTemplate(script, whichType, pbegin, pend))
+        {
+            // A pubkey is known by its key ID, the hashes by themselves
+            if (whichType == TX_PUBKEY)
+                return setHashes.count(Hash160(pbegin, pend)) != 0;
+            return setHashes.count(uint160(std::vector<unsigned char>(pbegin, pend))) != 0;
+        }
+        if (!script.empty() && script[0] == OP_RETURN)
+            return false;
+        // Anything else (multisig, non-standard) is left to IsMine()
+        return true;
+    }
+
+    bool MayBeMine(const CTransaction& tx) const
+    {
+        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+            if (MayBeMine(txout.scriptPubKey))
+                return true;
+        return false;
+    }
+};
+
+/** A block read by the rescan threads, with the transactions that may pay us marked. */
+struct CRescanBlock
+{
+    CBlock block;
+    bool fRead; //!< False if the block could not be read from disk
+    std::vector<char> vfMaybeMine;
+};
+
+/**
+ * Reads the blocks of a chain snapshot on several threads, ahead of the
+ * thread that applies them to the wallet in order.
+ */
+class CRescanReader
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condReader;
+    boost::condition_variable condMaster;
+    boost::thread_group threadGroup;
+
+    const CChainSnapshot& chain;
+    //! Where each block from the start height on is stored, copied under cs_main; null if it isn't
+    std::vector<CDiskBlockPos> vBlockPos;
+    const CWalletScanFilter& filter;
+    const int nReadAhead;
+    const int nStartHeight;
+    int nNextHeight;
+    int nApplyHeight;
+    bool fQuit;
+    std::map<int, CRescanBlock*> mapRead;
+
+    void ThreadRead()
+    {
+        while (true)
+        {
+            int nHeight;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fQuit && nNextHeight <= chain.Height() && nNextHeight >= nApplyHeight + nReadAhead)
+                    condReader.wait(lock);
+                if (fQuit || nNextHeight > chain.Height())
+                    return;
+                nHeight = nNextHeight++;
+            }
+
+            CRescanBlock* pread = new CRescanBlock();
+            const CDiskBlockPos& pos = vBlockPos[nHeight - nStartHeight];
+            pread->fRead = !pos.IsNull() && ReadBlockFromDisk(pread->block, pos) &&
+                           pread->block.GetHash() == chain[nHeight]->GetBlockHash();
+            pread->vfMaybeMine.resize(pread->block.vtx.size());
+            for (unsigned int i = 0; i < pread->block.vtx.size(); i++)
+                pread->vfMaybeMine[i] = filter.MayBeMine(pread->block.vtx[i]);
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            mapRead[nHeight] = pread;
+            condMaster.notify_one();
+        }
+    }
+
+public:
+    CRescanReader(const CChainSnapshot& chainIn, const CWalletScanFilter& filterIn, int nStartHeightIn, int nThreads) :
+        chain(chainIn), filter(filterIn), nReadAhead(nThreads * RESCAN_READ_AHEAD), nStartHeight(nStartHeightIn),
+        nNextHeight(nStartHeightIn), nApplyHeight(nStartHeightIn), fQuit(false)
+    {
+        // The index entries' position fields are written under cs_main
+        vBlockPos.resize(chain.Height() - nStartHeight + 1);
+        {
+            LOCK(cs_main);
+            for (const CBlockIndex* pindex = chain.Tip(); pindex && pindex->nHeight >= nStartHeight; pindex = pindex->pprev)
+            {
+                if (pindex->nStatus & BLOCK_HAVE_DATA)
+                    vBlockPos[pindex->nHeight - nStartHeight] = pindex->GetBlockPos();
+            }
+        }
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CRescanReader::ThreadRead, this));
+    }
+
+    ~CRescanReader()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fQuit = true;
+            condReader.notify_all();
+        }
+        threadGroup.join_all();
+        for (std::map<int, CRescanBlock*>::iterator it = mapRead.begin(); it != mapRead.end(); ++it)
+            delete it->second;
+    }
+
+    //! Wait for the block at nHeight to be read; the caller owns the result
+    CRescanBlock* Take(int nHeight)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nApplyHeight = nHeight;
+        condReader.notify_all();
+        std::map<int, CRescanBlock*>::iterator it;
+        while ((it = mapRead.find(nHeight)) == mapRead.end())
+            condMaster.wait(lock);
+        CRescanBlock* pread = it->second;
+        mapRead.erase(it);
+        return pread;
+    }
+};
+
+} // anon namespace
+
+/**
+ * Scan the active chain from pindexStart for transactions involving the
+ * wallet. Blocks are read and checked against a copy of the wallet's keys
+ * and scripts by background threads; cs_main and cs_wallet are only taken
+ * to add the transactions that pass that check, so the caller should not
+ * hold them. Returns the number of transactions found, or -1 if the scan
+ * stopped early because a block could not be read.
+ */
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
     int ret = 0;
     int64_t nNow = GetTime();
 
-    CBlockIndex* pindex = pindexStart;
+    CChainSnapshot chain = GetActiveChainSnapshot();
+    const CBlockIndex* pindex = pindexStart ? chain.FindFork(pindexStart) : NULL;
+
+    // no need to read and scan block, if block was created before
+    // our wallet birthday (as adjusted for block time variability)
+    int64_t nTimeFirstKeyScan;
     {
-        LOCK2(cs_main, cs_wallet);
+        LOCK(cs_wallet);
+        nTimeFirstKeyScan = nTimeFirstKey;
+    }
+    while (pindex && nTimeFirstKeyScan && (pindex->GetBlockTime() < (nTimeFirstKeyScan - 7200)))
+        pindex = chain.Next(pindex);
 
-        // no need to read and scan block, if block was created before
-        // our wallet birthday (as adjusted for block time variability)
-        while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)))
-            pindex = chainActive.Next(pindex);
+    if (pindex)
+    {
+        CWalletScanFilter filter;
+        {
+            LOCK(cs_KeyStore);
+            std::set<CKeyID> setKeys;
+            GetKeys(setKeys);
+            BOOST_FOREACH(const CKeyID& keyID, setKeys)
+                filter.setHashes.insert(keyID);
+            for (ScriptMap::const_iterator it = mapScripts.begin(); it != mapScripts.end(); ++it)
+                filter.setHashes.insert(it->first);
+            filter.setWatchOnly = setWatchOnly;
+        }
+
+        int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), MAX_RESCAN_THREADS));
+        CRescanReader reader(chain, filter, pindex->nHeight, nThreads);
 
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
         double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
-        while (pindex)
+        double dProgressTip = Checkpoints::GuessVerificationProgress(chain.Tip(), false);
+        for (int nHeight = pindex->nHeight; nHeight <= chain.Height(); nHeight++)
         {
+            pindex = chain[nHeight];
             if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
                 ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            CRescanBlock* pread = reader.Take(nHeight);
+            if (!pread->fRead)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                LogPrintf("ScanForWalletTransactions() : failed to read block %s at height %d, rescan aborted\n", pindex->GetBlockHash().ToString(), nHeight);
+                delete pread;
+                ret = -1;
+                break;
             }
-            pindex = chainActive.Next(pindex);
+            const CBlock& block = pread->block;
+
+            // Besides the transactions that may pay us, those spending our
+            // coins (or an earlier candidate in this block) and those we
+            // already have need a closer look.
+            std::vector<unsigned int> vCandidates;
+            {
+                LOCK(cs_wallet);
+                std::set<uint256> setBlockCandidates;
+                for (unsigned int i = 0; i < block.vtx.size(); i++)
+                {
+                    const CTransaction& tx = block.vtx[i];
+                    bool fCandidate = pread->vfMaybeMine[i] || mapWallet.count(tx.GetHash());
+                    if (!fCandidate && !tx.IsCoinBase())
+                    {
+                        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                        {
+                            if (mapWallet.count(txin.prevout.hash) || setBlockCandidates.count(txin.prevout.hash))
+                            {
+                                fCandidate = true;
+                                break;
+                            }
+                        }
+                    }
+                    if (fCandidate)
+                    {
+                        vCandidates.push_back(i);
+                        setBlockCandidates.insert(tx.GetHash());
+                    }
+                }
+            }
+
+            if (!vCandidates.empty())
+            {
+                LOCK2(cs_main, cs_wallet);
+                // Write the block's wallet changes in one database transaction
+                CWalletDB walletdb(strWalletFile);
+                bool fBatch = fFileBacked && walletdb.TxnBegin();
+                BOOST_FOREACH(unsigned int i, vCandidates)
+                {
+                    if (AddToWalletIfInvolvingMe(block.vtx[i], &block, fUpdate, fBatch ? &walletdb : NULL))
+                        ret++;
+                }
+                if (fBatch && !walletdb.TxnCommit())
+                    LogPrintf("ScanForWalletTransactions() : committing wallet changes failed\n");
+            }
+            delete pread;
+
             if (GetTime() >= nNow + 60) {
                 nNow = GetTime();
                 LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
@@ -962,6 +1329,11 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
         }
         ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     }
+
+    {
+        LOCK2(cs_main, cs_wallet);
+        PruneUnspentTxs();
+    }
     return ret;
 }
 
@@ -983,6 +1355,7 @@ void CWallet::ReacceptWalletTransactions()
             wtx.AcceptToMemoryPool(false);
         }
     }
+    PruneUnspentTxs();
 }
 
 void CWalletTx::RelayWalletTransaction()
@@ -1062,9 +1435,9 @@ CAmount CWallet::GetBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const uint256& hash, setUnspentTxs)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(hash)->second;
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableCredit();
         }
@@ -1078,9 +1451,9 @@ CAmount CWallet::GetUnconfirmedBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const uint256& hash, setUnspentTxs)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(hash)->second;
             if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
                 nTotal += pcoin->GetAvailableCredit();
         }
@@ -1093,9 +1466,9 @@ CAmount CWallet::GetImmatureBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const uint256& hash, setUnspentTxs)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(hash)->second;
             nTotal += pcoin->GetImmatureCredit();
         }
     }
@@ -1107,9 +1480,9 @@ CAmount CWallet::GetWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const uint256& hash, setUnspentTxs)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(hash)->second;
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
@@ -1123,9 +1496,9 @@ CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const uint256& hash, setUnspentTxs)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(hash)->second;
             if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
                 nTotal += pcoin->GetAvailableWatchOnlyCredit();
         }
@@ -1138,9 +1511,9 @@ CAmount CWallet::GetImmatureWatchOnlyBalance() const
     CAmount nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const uint256& hash, setUnspentTxs)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(hash)->second;
             nTotal += pcoin->GetImmatureWatchOnlyCredit();
         }
     }
@@ -1156,10 +1529,9 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const uint256& wtxid, setUnspentTxs)
         {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(wtxid)->second;
 
             if (!IsFinalTx(*pcoin))
                 continue;
@@ -1177,15 +1549,66 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
             for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
                 isminetype mine = IsMine(pcoin->vout[i]);
                 if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue > 0 &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
+                    !IsLockedCoin(wtxid, i) && pcoin->vout[i].nValue > 0 &&
+                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(wtxid, i)))
                         vCoins.push_back(COutput(pcoin, i, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
             }
         }
     }
 }
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
+typedef pair<CAmount, pair<const CWalletTx*,unsigned int> > CoinValue;
+
+/**
+ * Depth-first search for a subset of vValue (sorted by descending value)
+ * that adds up to exactly nTargetValue, so that no change output is needed.
+ * Branches that overshoot, or that cannot reach the target with the coins
+ * left, are cut, and coins of equal value are only tried in one order. The
+ * search gives up after nMaxTries steps, so its cost does not depend on the
+ * luck of the draw.
+ */
+static bool ExactMatchSubset(const vector<CoinValue>& vValue, const CAmount& nTargetValue,
+                             vector<char>& vfBest, int& nTries, int nMaxTries = MAX_EXACT_MATCH_TRIES)
+{
+    // vRemaining[i] is the sum of the values of coins i..end
+    vector<CAmount> vRemaining(vValue.size() + 1, 0);
+    for (unsigned int i = vValue.size(); i > 0; i--)
+        vRemaining[i - 1] = vRemaining[i] + vValue[i - 1].first;
+
+    vector<unsigned int> vSelected;
+    CAmount nTotal = 0;
+    unsigned int i = 0;
+    for (nTries = 0; nTries < nMaxTries; nTries++)
+    {
+        if (nTotal == nTargetValue)
+        {
+            vfBest.assign(vValue.size(), false);
+            BOOST_FOREACH(unsigned int n, vSelected)
+                vfBest[n] = true;
+            return true;
+        }
+
+        if (nTotal > nTargetValue || nTotal + vRemaining[i] < nTargetValue)
+        {
+            // Backtrack: drop the last coin taken and skip the coins of the
+            // same value after it, whose branches would be the same again
+            if (vSelected.empty())
+                return false;
+            i = vSelected.back();
+            vSelected.pop_back();
+            nTotal -= vValue[i].first;
+            for (i++; i < vValue.size() && vValue[i].first == vValue[i - 1].first; i++) {}
+            continue;
+        }
+
+        vSelected.push_back(i);
+        nTotal += vValue[i].first;
+        i++;
+    }
+    return false;
+}
+
+static void ApproximateBestSubset(const vector<CoinValue>& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
                                   vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
@@ -1231,21 +1654,18 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,uns
     }
 }
 
-bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
+bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
 
-    // List of values less than target
-    pair<CAmount, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
-    coinLowestLarger.first = std::numeric_limits<CAmount>::max();
-    coinLowestLarger.second.first = NULL;
-    vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > > vValue;
-    CAmount nTotalLower = 0;
-
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    int64_t nStart = GetTimeMicros();
 
+    // Collect the coins we may spend, in random order so that ties between
+    // equal coins are not always broken the same way
+    vector<CoinValue> vCandidates;
+    vCandidates.reserve(vCoins.size());
     BOOST_FOREACH(const COutput &output, vCoins)
     {
         if (!output.fSpendable)
@@ -1257,9 +1677,20 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
             continue;
 
         int i = output.i;
-        CAmount n = pcoin->vout[i].nValue;
+        vCandidates.push_back(make_pair(pcoin->vout[i].nValue, make_pair(pcoin, i)));
+    }
+    random_shuffle(vCandidates.begin(), vCandidates.end(), GetRandInt);
+
+    // List of values less than target
+    CoinValue coinLowestLarger;
+    coinLowestLarger.first = std::numeric_limits<CAmount>::max();
+    coinLowestLarger.second.first = NULL;
+    vector<CoinValue> vValue;
+    CAmount nTotalLower = 0;
 
-        pair<CAmount,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin, i));
+    BOOST_FOREACH(const CoinValue& coin, vCandidates)
+    {
+        CAmount n = coin.first;
 
         if (n == nTargetValue)
         {
@@ -1297,14 +1728,24 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
+    // Look for a subset that needs no change, then solve subset sum by
+    // stochastic approximation if there is none (or it took too long to find)
     sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
     vector<char> vfBest;
     CAmount nBest;
+    int nTries = 0;
+
+    if (ExactMatchSubset(vValue, nTargetValue, vfBest, nTries))
+        nBest = nTargetValue;
+    else
+    {
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+        if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
+            ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    }
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    LogPrint("selectcoins", "SelectCoins() : %u candidates, %u below target, exact search %d steps, %dus\n",
+             vCandidates.size(), vValue.size(), nTries, GetTimeMicros() - nStart);
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
@@ -1802,20 +2243,146 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
         else
             nTargetSize = max(GetArg("-keypool", 100), (int64_t) 0);
 
-        while (setKeyPool.size() < (nTargetSize + 1))
+        if (setKeyPool.size() >= (nTargetSize + 1))
+            return true;
+
+        // Write the new keys and their pool entries in one database transaction
+        if (!fFileBacked || pwalletdbEncryption || !walletdb.TxnBegin())
+            return false;
+        pwalletdbEncryption = &walletdb;
+
+        std::vector<int64_t> vAdded;
+        bool fOk = true;
+        try {
+            while (setKeyPool.size() < (nTargetSize + 1))
+            {
+                int64_t nEnd = 1;
+                if (!setKeyPool.empty())
+                    nEnd = *(--setKeyPool.end()) + 1;
+                if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
+                {
+                    fOk = false;
+                    break;
+                }
+                setKeyPool.insert(nEnd);
+                vAdded.push_back(nEnd);
+            }
+        } catch (...) {
+            fOk = false;
+        }
+        pwalletdbEncryption = NULL;
+
+        if (fOk)
+            fOk = walletdb.TxnCommit();
+        else
+            walletdb.TxnAbort();
+        if (!fOk)
         {
-            int64_t nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
-            setKeyPool.insert(nEnd);
-            LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
+            // None of the new entries made it to disk; the keys stay in memory, unused
+            BOOST_FOREACH(int64_t nIndex, vAdded)
+                setKeyPool.erase(nIndex);
+            throw runtime_error("TopUpKeyPool() : writing generated key failed");
         }
+        LogPrintf("keypool added %u keys, size=%u\n", vAdded.size(), setKeyPool.size());
     }
     return true;
 }
 
+bool CWallet::IsKeyPoolLow()
+{
+    LOCK(cs_wallet);
+    unsigned int nTargetSize = max(GetArg("-keypool", 100), (int64_t) 0);
+    return !IsLocked() && setKeyPool.size() < nTargetSize / 2 + 1;
+}
+
+void CWallet::RequestKeyPoolCheck()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexKeyPoolCheck);
+        fKeyPoolCheck = true;
+    }
+    condKeyPoolCheck.notify_one();
+}
+
+void CWallet::WaitForKeyPoolCheck()
+{
+    boost::unique_lock<boost::mutex> lock(mutexKeyPoolCheck);
+    while (!fKeyPoolCheck)
+        condKeyPoolCheck.wait(lock);
+    fKeyPoolCheck = false;
+}
+
+void ThreadTopUpKeyPool(CWallet* pwallet)
+{
+    RenameThread("bitcoin-keypool");
+
+    while (true)
+    {
+        // Sleep until a key is taken or the wallet is unlocked
+        pwallet->WaitForKeyPoolCheck();
+
+        if (pwallet->IsKeyPoolLow())
+        {
+            try {
+                pwallet->TopUpKeyPool();
+            } catch (const std::runtime_error& e) {
+                LogPrintf("ThreadTopUpKeyPool() : %s\n", e.what());
+            }
+        }
+    }
+}
+
+void CWallet::GetUncheckedKeys(std::vector<CKeyID>& vKeys) const
+{
+    LOCK(cs_wallet);
+    vKeys.assign(setUncheckedKeys.begin(), setUncheckedKeys.end());
+}
+
+bool CWallet::CheckUncheckedKey(const CKeyID& keyid)
+{
+    AssertLockHeld(cs_wallet); // setUncheckedKeys, setBadKeys
+    if (setBadKeys.count(keyid))
+        return false;
+    if (!setUncheckedKeys.count(keyid))
+        return true;
+
+    // Keys are only left unchecked in plaintext wallets, but the wallet may
+    // have been encrypted since; then the check waits for an unlock.
+    CKey key;
+    if (!GetKey(keyid, key))
+        return true;
+    setUncheckedKeys.erase(keyid);
+    if (key.GetPubKey().GetID() == keyid)
+        return true;
+
+    LogPrintf("Error: wallet private key for %s does not match its public key\n", CBitcoinAddress(keyid).ToString());
+    setBadKeys.insert(keyid);
+    strMiscWarning = _("Warning: wallet.dat contains private keys that do not match their public keys! Restore a backup.");
+    return false;
+}
+
+void ThreadCheckWalletKeys(CWallet* pwallet)
+{
+    RenameThread("bitcoin-keycheck");
+
+    std::vector<CKeyID> vKeys;
+    pwallet->GetUncheckedKeys(vKeys);
+    LogPrintf("Checking %u wallet keys in the background\n", vKeys.size());
+
+    int64_t nStart = GetTimeMillis();
+    unsigned int nBad = 0;
+    BOOST_FOREACH(const CKeyID& keyid, vKeys)
+    {
+        boost::this_thread::interruption_point();
+        LOCK(pwallet->cs_wallet);
+        if (!pwallet->CheckUncheckedKey(keyid))
+            nBad++;
+    }
+    LogPrintf("Checked %u wallet keys in %dms, %u bad\n", vKeys.size(), GetTimeMillis() - nStart, nBad);
+    if (nBad)
+        uiInterface.ThreadSafeMessageBox(strMiscWarning, "", CClientUIInterface::MSG_ERROR);
+}
+
 void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
@@ -1823,22 +2390,37 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
     {
         LOCK(cs_wallet);
 
-        if (!IsLocked())
+        // Normally ThreadTopUpKeyPool keeps the pool filled; only generate
+        // keys here if it has fallen behind completely
+        if (!IsLocked() && setKeyPool.empty())
             TopUpKeyPool();
 
-        // Get the oldest key
-        if(setKeyPool.empty())
-            return;
-
         CWalletDB walletdb(strWalletFile);
 
-        nIndex = *(setKeyPool.begin());
-        setKeyPool.erase(setKeyPool.begin());
-        if (!walletdb.ReadPool(nIndex, keypool))
-            throw runtime_error("ReserveKeyFromKeyPool() : read failed");
-        if (!HaveKey(keypool.vchPubKey.GetID()))
-            throw runtime_error("ReserveKeyFromKeyPool() : unknown key in key pool");
-        assert(keypool.vchPubKey.IsValid());
+        // Get the oldest key, dropping keys whose private key is bad
+        while (true)
+        {
+            if(setKeyPool.empty())
+            {
+                nIndex = -1;
+                keypool.vchPubKey = CPubKey();
+                return;
+            }
+
+            nIndex = *(setKeyPool.begin());
+            setKeyPool.erase(setKeyPool.begin());
+            RequestKeyPoolCheck();
+            if (!walletdb.ReadPool(nIndex, keypool))
+                throw runtime_error("ReserveKeyFromKeyPool() : read failed");
+            if (!HaveKey(keypool.vchPubKey.GetID()))
+                throw runtime_error("ReserveKeyFromKeyPool() : unknown key in key pool");
+            assert(keypool.vchPubKey.IsValid());
+            // Keys loaded without a checksum are checked before they are handed out
+            if (CheckUncheckedKey(keypool.vchPubKey.GetID()))
+                break;
+            walletdb.ErasePool(nIndex);
+            LogPrintf("keypool drop bad key %d\n", nIndex);
+        }
         LogPrintf("keypool reserve %d\n", nIndex);
     }
 }
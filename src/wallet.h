@@ -26,6 +26,9 @@
 #include <utility>
 #include <vector>
 
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
 /**
  * Settings
  */
@@ -41,14 +44,26 @@ static const CAmount DEFAULT_TRANSACTION_FEE = 0;
 static const CAmount nHighTransactionFeeWarning = 0.01 * COIN;
 //! Largest (in bytes) free transaction we're willing to create
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 1000;
+//! Number of steps the exact-match coin search may take before falling back to the stochastic solver
+static const int MAX_EXACT_MATCH_TRIES = 100000;
+//! Maximum number of threads reading blocks ahead during a wallet rescan
+static const int MAX_RESCAN_THREADS = 4;
+//! Number of blocks each rescan thread may read ahead of the ones being applied
+static const int RESCAN_READ_AHEAD = 16;
 
 class CAccountingEntry;
 class CCoinControl;
 class COutput;
 class CReserveKey;
 class CScript;
+class CWallet;
 class CWalletTx;
 
+//! Keep the key pool of a wallet topped up in the background, so callers rarely have to generate keys
+void ThreadTopUpKeyPool(CWallet* pwallet);
+//! Check the keys that -walletdeferkeycheck left unchecked at load
+void ThreadCheckWalletKeys(CWallet* pwallet);
+
 /** (client) version numbers for particular wallet features */
 enum WalletFeature
 {
@@ -107,6 +122,7 @@ class CWallet : public CCryptoKeyStore, public CValidationInterface
 private:
     bool SelectCoins(const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl *coinControl = NULL) const;
 
+    //! Open database transaction that key writes go to, while encrypting the wallet or refilling the key pool
     CWalletDB *pwalletdbEncryption;
 
     //! the current wallet version: clients below this version are not able to load the wallet
@@ -130,6 +146,32 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    bool SyncTransaction(const CTransaction& tx, const CBlock* pblock, CWalletDB* pwalletdb);
+
+    /**
+     * Wallet transactions that may still have unspent outputs of ours.
+     * A transaction is dropped once every output of ours has been spent by a
+     * wallet transaction in a block, so that balance and coin queries only
+     * visit the part of the history that can still contribute to them.
+     */
+    std::set<uint256> setUnspentTxs;
+    bool IsSpentInChain(const CWalletTx& wtx) const;
+    void PruneUnspentTx(const uint256& hash);
+    void PruneUnspentTxs();
+
+    //! Wakes ThreadTopUpKeyPool when a key is taken from the pool or the wallet is unlocked
+    boost::mutex mutexKeyPoolCheck;
+    boost::condition_variable condKeyPoolCheck;
+    bool fKeyPoolCheck;
+
+    //! Keys loaded without a checksum (-walletdeferkeycheck) whose private key has not been checked yet
+    std::set<CKeyID> setUncheckedKeys;
+    //! Keys whose private key does not match their public key; never handed out from the key pool
+    std::set<CKeyID> setBadKeys;
+
+    //! A block's wallet changes could not be committed; the best block is no longer recorded, so they are rescanned at the next start
+    bool fSyncCommitFailed;
+
 public:
     /*
      * Main wallet lock.
@@ -180,9 +222,22 @@ public:
         nNextResend = 0;
         nLastResend = 0;
         nTimeFirstKey = 0;
+        fKeyPoolCheck = true;
+        fSyncCommitFailed = false;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
+    std::list<CAccountingEntry> laccentries;
+
+    typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
+    typedef std::multimap<int64_t, TxPair > TxItems;
+    /**
+     * The wallet's activity log: every transaction and accounting entry, ordered by nOrderPos.
+     * There is no per-account log. The account a received transaction is listed under follows
+     * the address book label of the receiving address, which setaccount can change at any time,
+     * so listtransactions for one account walks this log and filters it.
+     */
+    TxItems wtxOrdered;
 
     int64_t nOrderPosNext;
     std::map<uint256, int> mapRequestCount;
@@ -201,7 +256,7 @@ public:
     bool CanSupportFeature(enum WalletFeature wf) { AssertLockHeld(cs_wallet); return nWalletMaxVersion >= wf; }
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl = NULL) const;
-    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
 
     bool IsSpent(const uint256& hash, unsigned int n) const;
 
@@ -220,6 +275,14 @@ public:
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
     //! Adds a key to the store, without saving it to disk (used by LoadWallet)
     bool LoadKey(const CKey& key, const CPubKey &pubkey) { return CCryptoKeyStore::AddKeyPubKey(key, pubkey); }
+    //! Mark a loaded key as not checked yet (used by LoadWallet)
+    void LoadUncheckedKey(const CKeyID& keyid) { AssertLockHeld(cs_wallet); setUncheckedKeys.insert(keyid); }
+    //! The keys loaded without being checked, that still have to be
+    void GetUncheckedKeys(std::vector<CKeyID>& vKeys) const;
+    //! Whether any key loaded without being checked still has to be
+    bool HasUncheckedKeys() const { LOCK(cs_wallet); return !setUncheckedKeys.empty(); }
+    //! Check a key loaded without a checksum, if it hasn't been yet; returns false if it is bad
+    bool CheckUncheckedKey(const CKeyID& keyid);
     //! Load metadata (used by LoadWallet)
     bool LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &metadata);
 
@@ -259,21 +322,18 @@ public:
      */
     int64_t IncOrderPosNext(CWalletDB *pwalletdb = NULL);
 
-    typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
-    typedef std::multimap<int64_t, TxPair > TxItems;
-
-    /**
-     * Get the wallet's activity log
-     * @return multimap of ordered transactions and accounting entries
-     * @warning Returned pointers are *only* valid within the scope of passed acentries
-     */
-    TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
+    //! Add an accounting entry to the activity log, once it has been committed to the database
+    void AddAccountingEntry(const CAccountingEntry& acentry);
+    //! Rebuild wtxOrdered from mapWallet and laccentries (used after loading or reordering)
+    void RebuildOrderedTxIndex();
 
     void MarkDirty();
-    bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet=false);
+    bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet=false, CWalletDB* pwalletdb=NULL);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
-    bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
+    void SyncTransactions(const std::vector<CTransaction>& vtx, const CBlock* pblock);
+    bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate, CWalletDB* pwalletdb=NULL);
     void EraseFromWallet(const uint256 &hash);
+    //! Returns the number of transactions found, or -1 if a block could not be read
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
@@ -295,6 +355,12 @@ public:
 
     bool NewKeyPool();
     bool TopUpKeyPool(unsigned int kpSize = 0);
+    //! Whether the key pool has dropped below half its target size
+    bool IsKeyPoolLow();
+    //! Ask ThreadTopUpKeyPool to check whether the key pool needs refilling
+    void RequestKeyPoolCheck();
+    //! Block until RequestKeyPoolCheck() has been called since the last return (interruptible)
+    void WaitForKeyPoolCheck();
     void ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool);
     void KeepKey(int64_t nIndex);
     void ReturnKey(int64_t nIndex);
@@ -899,7 +965,7 @@ public:
         return true;
     }
 
-    bool WriteToDisk();
+    bool WriteToDisk(CWalletDB *pwalletdb = NULL);
 
     int64_t GetTxTime() const;
     int GetRequestCount() const;
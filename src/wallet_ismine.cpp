@@ -34,10 +34,39 @@ isminetype IsMine(const CKeyStore &keystore, const CTxDestination& dest)
     return IsMine(keystore, script);
 }
 
+/**
+ * Fast path for the fixed-layout scripts recognized by MatchFixedTemplate:
+ * keys and hashes are read straight out of scriptPubKey instead of being
+ * copied into a solutions vector first.
+ */
+static isminetype IsMineFixedTemplate(const CKeyStore &keystore, txnouttype whichType, CScript::const_iterator pbegin, CScript::const_iterator pend)
+{
+    if (whichType == TX_PUBKEY)
+        return keystore.HaveKey(CPubKey(pbegin, pend).GetID()) ? ISMINE_SPENDABLE : ISMINE_NO;
+
+    uint160 hash(valtype(pbegin, pend));
+    if (whichType == TX_PUBKEYHASH)
+        return keystore.HaveKey(CKeyID(hash)) ? ISMINE_SPENDABLE : ISMINE_NO;
+
+    CScript subscript;
+    if (keystore.GetCScript(CScriptID(hash), subscript) && IsMine(keystore, subscript) == ISMINE_SPENDABLE)
+        return ISMINE_SPENDABLE;
+    return ISMINE_NO;
+}
+
 isminetype IsMine(const CKeyStore &keystore, const CScript& scriptPubKey)
 {
-    vector<valtype> vSolutions;
     txnouttype whichType;
+    CScript::const_iterator pbegin, pend;
+    if (MatchFixedTemplate(scriptPubKey, whichType, pbegin, pend)) {
+        if (IsMineFixedTemplate(keystore, whichType, pbegin, pend) == ISMINE_SPENDABLE)
+            return ISMINE_SPENDABLE;
+        if (keystore.HaveWatchOnly(scriptPubKey))
+            return ISMINE_WATCH_ONLY;
+        return ISMINE_NO;
+    }
+
+    vector<valtype> vSolutions;
     if (!Solver(scriptPubKey, whichType, vSolutions)) {
         if (keystore.HaveWatchOnly(scriptPubKey))
             return ISMINE_WATCH_ONLY;
@@ -13,6 +13,8 @@
 #include "utiltime.h"
 #include "wallet.h"
 
+#include <deque>
+
 #include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
 #include <boost/scoped_ptr.hpp>
@@ -23,6 +25,11 @@ using namespace std;
 
 static uint64_t nAccountingEntryNumber = 0;
 
+//! Maximum number of threads decoding wallet records at load time
+static const int MAX_WALLET_LOAD_THREADS = 8;
+//! Minimum number of tx/key records given to each wallet load thread
+static const unsigned int WALLET_LOAD_RECORDS_PER_THREAD = 1000;
+
 //
 // CWalletDB
 //
@@ -321,9 +328,20 @@ DBErrors CWalletDB::ReorderTransactions(CWallet* pwallet)
     }
     WriteOrderPosNext(nOrderPosNext);
 
+    // Positions may have changed, so rebuild the in-memory activity log
+    LoadOrderedTxIndex(pwallet);
+
     return DB_LOAD_OK;
 }
 
+void CWalletDB::LoadOrderedTxIndex(CWallet* pwallet)
+{
+    LOCK(pwallet->cs_wallet);
+    pwallet->laccentries.clear();
+    ListAccountCreditDebit("*", pwallet->laccentries);
+    pwallet->RebuildOrderedTxIndex();
+}
+
 class CWalletScanState {
 public:
     unsigned int nKeys;
@@ -342,6 +360,103 @@ public:
     }
 };
 
+/** Decode and check a "tx" record (after the type) */
+static bool ReadWalletTx(CDataStream& ssKey, CDataStream& ssValue, CWalletTx& wtx, bool& fUpgraded, string& strErr)
+{
+    uint256 hash;
+    ssKey >> hash;
+    ssValue >> wtx;
+    CValidationState state;
+    if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+        return false;
+
+    // Undo serialize changes in 31600
+    if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+    {
+        if (!ssValue.empty())
+        {
+            char fTmp;
+            char fUnused;
+            ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+            strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                               wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = fTmp;
+        }
+        else
+        {
+            strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = 0;
+        }
+        fUpgraded = true;
+    }
+    return true;
+}
+
+/**
+ * Decode a "key" or "wkey" record (after the type). With fDeferCheck, a key
+ * stored without a checksum is not checked against its public key here, and
+ * fChecked is left false.
+ */
+static bool ReadWalletKey(const string& strType, CDataStream& ssKey, CDataStream& ssValue,
+                          CPubKey& vchPubKey, CKey& key, bool fDeferCheck, bool& fChecked, string& strErr)
+{
+    ssKey >> vchPubKey;
+    if (!vchPubKey.IsValid())
+    {
+        strErr = "Error reading wallet database: CPubKey corrupt";
+        return false;
+    }
+    CPrivKey pkey;
+    uint256 hash = 0;
+
+    if (strType == "key")
+    {
+        ssValue >> pkey;
+    } else {
+        CWalletKey wkey;
+        ssValue >> wkey;
+        pkey = wkey.vchPrivKey;
+    }
+
+    // Old wallets store keys as "key" [pubkey] => [privkey]
+    // ... which was slow for wallets with lots of keys, because the public key is re-derived from the private key
+    // using EC operations as a checksum.
+    // Newer wallets store keys as "key"[pubkey] => [privkey][hash(pubkey,privkey)], which is much faster while
+    // remaining backwards-compatible.
+    try
+    {
+        ssValue >> hash;
+    }
+    catch(...){}
+
+    bool fSkipCheck = false;
+
+    if (hash != 0)
+    {
+        // hash pubkey/privkey to accelerate wallet load
+        std::vector<unsigned char> vchKey;
+        vchKey.reserve(vchPubKey.size() + pkey.size());
+        vchKey.insert(vchKey.end(), vchPubKey.begin(), vchPubKey.end());
+        vchKey.insert(vchKey.end(), pkey.begin(), pkey.end());
+
+        if (Hash(vchKey.begin(), vchKey.end()) != hash)
+        {
+            strErr = "Error reading wallet database: CPubKey/CPrivKey corrupt";
+            return false;
+        }
+
+        fSkipCheck = true;
+    }
+    fChecked = fSkipCheck || !fDeferCheck;
+
+    if (!key.Load(pkey, vchPubKey, fSkipCheck || fDeferCheck))
+    {
+        strErr = "Error reading wallet database: CPrivKey corrupt";
+        return false;
+    }
+    return true;
+}
+
 bool
 ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
              CWalletScanState &wss, string& strType, string& strErr)
@@ -365,33 +480,12 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         }
         else if (strType == "tx")
         {
-            uint256 hash;
-            ssKey >> hash;
             CWalletTx wtx;
-            ssValue >> wtx;
-            CValidationState state;
-            if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+            bool fUpgraded = false;
+            if (!ReadWalletTx(ssKey, ssValue, wtx, fUpgraded, strErr))
                 return false;
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-            {
-                if (!ssValue.empty())
-                {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                                       wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                }
-                else
-                {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
-                wss.vWalletUpgrade.push_back(hash);
-            }
+            if (fUpgraded)
+                wss.vWalletUpgrade.push_back(wtx.GetHash());
 
             if (wtx.nOrderPos == -1)
                 wss.fAnyUnordered = true;
@@ -430,62 +524,13 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         }
         else if (strType == "key" || strType == "wkey")
         {
-            CPubKey vchPubKey;
-            ssKey >> vchPubKey;
-            if (!vchPubKey.IsValid())
-            {
-                strErr = "Error reading wallet database: CPubKey corrupt";
-                return false;
-            }
-            CKey key;
-            CPrivKey pkey;
-            uint256 hash = 0;
-
             if (strType == "key")
-            {
                 wss.nKeys++;
-                ssValue >> pkey;
-            } else {
-                CWalletKey wkey;
-                ssValue >> wkey;
-                pkey = wkey.vchPrivKey;
-            }
-
-            // Old wallets store keys as "key" [pubkey] => [privkey]
-            // ... which was slow for wallets with lots of keys, because the public key is re-derived from the private key
-            // using EC operations as a checksum.
-            // Newer wallets store keys as "key"[pubkey] => [privkey][hash(pubkey,privkey)], which is much faster while
-            // remaining backwards-compatible.
-            try
-            {
-                ssValue >> hash;
-            }
-            catch(...){}
-
-            bool fSkipCheck = false;
-
-            if (hash != 0)
-            {
-                // hash pubkey/privkey to accelerate wallet load
-                std::vector<unsigned char> vchKey;
-                vchKey.reserve(vchPubKey.size() + pkey.size());
-                vchKey.insert(vchKey.end(), vchPubKey.begin(), vchPubKey.end());
-                vchKey.insert(vchKey.end(), pkey.begin(), pkey.end());
-
-                if (Hash(vchKey.begin(), vchKey.end()) != hash)
-                {
-                    strErr = "Error reading wallet database: CPubKey/CPrivKey corrupt";
-                    return false;
-                }
-
-                fSkipCheck = true;
-            }
-
-            if (!key.Load(pkey, vchPubKey, fSkipCheck))
-            {
-                strErr = "Error reading wallet database: CPrivKey corrupt";
+            CPubKey vchPubKey;
+            CKey key;
+            bool fChecked;
+            if (!ReadWalletKey(strType, ssKey, ssValue, vchPubKey, key, false, fChecked, strErr))
                 return false;
-            }
             if (!pwallet->LoadKey(key, vchPubKey))
             {
                 strErr = "Error reading wallet database: LoadKey failed";
@@ -603,15 +648,80 @@ static bool IsKeyType(string strType)
             strType == "mkey" || strType == "ckey");
 }
 
+static void NoteBadRecord(const string& strType, DBErrors& result, bool& fNoncriticalErrors)
+{
+    // losing keys is considered a catastrophic error, anything else
+    // we assume the user can live with:
+    if (IsKeyType(strType))
+        result = DB_CORRUPT;
+    else
+    {
+        // Leave other errors alone, if we try to fix them we might make things worse.
+        fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
+        if (strType == "tx")
+            // Rescan if there is a bad transaction record:
+            SoftSetBoolArg("-rescan", true);
+    }
+}
+
+/**
+ * A "tx", "key" or "wkey" record. Decoding and checking these dominates the
+ * time it takes to load a large wallet, so LoadWallet collects them from the
+ * cursor and has them processed by several threads before adding them to the
+ * wallet in order.
+ */
+class CWalletLoadRecord
+{
+public:
+    std::string strType;
+    CDataStream ssKey;
+    CDataStream ssValue;
+    bool fOk;
+    std::string strErr;
+
+    // "tx"
+    CWalletTx wtx;
+    bool fUpgraded;
+
+    // "key" and "wkey"
+    CPubKey vchPubKey;
+    CKey key;
+    bool fKeyChecked;
+
+    CWalletLoadRecord(const std::string& strTypeIn, const CDataStream& ssKeyIn, const CDataStream& ssValueIn) :
+        strType(strTypeIn), ssKey(ssKeyIn), ssValue(ssValueIn), fOk(false), fUpgraded(false), fKeyChecked(false) {}
+};
+
+static void DecodeWalletRecords(std::deque<CWalletLoadRecord>& vRecords, unsigned int nFirst, unsigned int nStep, bool fDeferKeyCheck)
+{
+    for (unsigned int i = nFirst; i < vRecords.size(); i += nStep)
+    {
+        CWalletLoadRecord& rec = vRecords[i];
+        try {
+            string strType;
+            rec.ssKey >> strType;
+            if (rec.strType == "tx")
+                rec.fOk = ReadWalletTx(rec.ssKey, rec.ssValue, rec.wtx, rec.fUpgraded, rec.strErr);
+            else
+                rec.fOk = ReadWalletKey(rec.strType, rec.ssKey, rec.ssValue, rec.vchPubKey, rec.key, fDeferKeyCheck, rec.fKeyChecked, rec.strErr);
+        } catch (...) {
+            rec.fOk = false;
+        }
+    }
+}
+
 DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
     CWalletScanState wss;
     bool fNoncriticalErrors = false;
     DBErrors result = DB_LOAD_OK;
+    bool fDeferKeyCheck = GetBoolArg("-walletdeferkeycheck", false);
 
     try {
         LOCK(pwallet->cs_wallet);
+        std::deque<CWalletLoadRecord> vRecords;
+        int64_t nStart = GetTimeMillis();
         int nMinVersion = 0;
         if (Read((string)"minversion", nMinVersion))
         {
@@ -642,27 +752,66 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 return DB_CORRUPT;
             }
 
-            // Try to be tolerant of single corrupt records:
             string strType, strErr;
-            if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr))
+            try {
+                CDataStream(ssKey) >> strType;
+            } catch (...) {}
+            if (strType == "tx" || strType == "key" || strType == "wkey")
             {
-                // losing keys is considered a catastrophic error, anything else
-                // we assume the user can live with:
-                if (IsKeyType(strType))
-                    result = DB_CORRUPT;
-                else
-                {
-                    // Leave other errors alone, if we try to fix them we might make things worse.
-                    fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
-                    if (strType == "tx")
-                        // Rescan if there is a bad transaction record:
-                        SoftSetBoolArg("-rescan", true);
-                }
+                vRecords.push_back(CWalletLoadRecord(strType, ssKey, ssValue));
+                continue;
             }
+
+            // Try to be tolerant of single corrupt records:
+            if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr))
+                NoteBadRecord(strType, result, fNoncriticalErrors);
             if (!strErr.empty())
                 LogPrintf("%s\n", strErr);
         }
         pcursor->close();
+        int64_t nRead = GetTimeMillis();
+
+        int nThreads = std::min((int)boost::thread::hardware_concurrency(), MAX_WALLET_LOAD_THREADS);
+        nThreads = std::max(1, std::min(nThreads, (int)(vRecords.size() / WALLET_LOAD_RECORDS_PER_THREAD)));
+        {
+            boost::thread_group threadGroup;
+            for (int i = 1; i < nThreads; i++)
+                threadGroup.create_thread(boost::bind(&DecodeWalletRecords, boost::ref(vRecords), i, nThreads, fDeferKeyCheck));
+            DecodeWalletRecords(vRecords, 0, nThreads, fDeferKeyCheck);
+            threadGroup.join_all();
+        }
+        int64_t nDecoded = GetTimeMillis();
+
+        BOOST_FOREACH(CWalletLoadRecord& rec, vRecords)
+        {
+            if (rec.strType == "key")
+                wss.nKeys++;
+            if (rec.fOk && rec.strType == "tx")
+            {
+                if (rec.fUpgraded)
+                    wss.vWalletUpgrade.push_back(rec.wtx.GetHash());
+                if (rec.wtx.nOrderPos == -1)
+                    wss.fAnyUnordered = true;
+                pwallet->AddToWallet(rec.wtx, true);
+            }
+            else if (rec.fOk)
+            {
+                if (!pwallet->LoadKey(rec.key, rec.vchPubKey))
+                {
+                    rec.fOk = false;
+                    rec.strErr = "Error reading wallet database: LoadKey failed";
+                }
+                else if (!rec.fKeyChecked)
+                    pwallet->LoadUncheckedKey(rec.vchPubKey.GetID());
+            }
+            if (!rec.fOk)
+                NoteBadRecord(rec.strType, result, fNoncriticalErrors);
+            if (!rec.strErr.empty())
+                LogPrintf("%s\n", rec.strErr);
+        }
+
+        LogPrintf("Wallet records: read in %dms, %u tx/key records decoded on %d threads in %dms, added in %dms\n",
+                  nRead - nStart, vRecords.size(), nThreads, nDecoded - nRead, GetTimeMillis() - nDecoded);
     }
     catch (boost::thread_interrupted) {
         throw;
@@ -700,6 +849,8 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 
     if (wss.fAnyUnordered)
         result = ReorderTransactions(pwallet);
+    else
+        LoadOrderedTxIndex(pwallet);
 
     return result;
 }
@@ -135,6 +135,8 @@ private:
     void operator=(const CWalletDB&);
 
     bool WriteAccountingEntry(const uint64_t nAccEntryNum, const CAccountingEntry& acentry);
+    //! Load all accounting entries into the wallet and rebuild its ordered activity log
+    void LoadOrderedTxIndex(CWallet* pwallet);
 };
 
 bool BackupWallet(const CWallet& wallet, const std::string& strDest);